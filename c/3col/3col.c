@@ -48,6 +48,56 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef THREECOL_LIBRARY
+#ifndef USE_THREADS
+#error "3col can only be made into a library with USE_THREADS"
+#endif
+#include "3col.h"
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef USE_FORK
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef USE_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 extern double strtod(const char *, char **);
 
@@ -185,6 +235,42 @@ static int mark_up=0;
  */
 static int truncating=0;
 
+/* Text that matches any of these patterns is highlighted, in some
+ * combination of these styles. A grey background is this grey.
+ */
+enum { hl_bold=1, hl_italic=2, hl_underline=4, hl_grey=8 };
+typedef struct Highlight {
+  char *pattern;
+  int style;
+  struct Highlight *next;
+} Highlight;
+static Highlight *highlights=0;
+static double highlight_grey=0.85;
+
+/* Should we put repeated lines into the output only once?
+ */
+static int share_strings=0;
+
+/* Should we follow the DSC strictly, so that each page can be taken
+ * out and printed on its own?
+ */
+static int strict_DSC=0;
+
+/* Should we use the procset we used to use, which keeps the position in
+ * variables and takes the printer rather longer to get through? (Only if
+ * something you embed with %P depends on it, or to compare the two.)
+ */
+static int old_procset=0;
+
+/* Should we draw each page as a picture too, so that it can be looked at
+ * without a PostScript interpreter? If so, into which files (the name has
+ * a %d in it for the page number), and at how many dots per inch?
+ * The pictures are PNG files if the name ends in ".png", PBM otherwise.
+ */
+static char *preview_file=0;
+static double preview_dpi=72;
+static int preview_png=0;
+
 /* Should we display line numbers in the margin?
  * If so, at what interval?
  * And should line numbers be continuous across files?
@@ -209,6 +295,11 @@ static char *file_name_font="Times-Bold";
 static double file_name_font_size=9;
 static int file_name_skip_lines=3;
 
+/* How many input files should we have opened and started reading
+ * ahead of the one we're working on?
+ */
+static int read_ahead=16;
+
 /* How many characters per tab position?
  */
 static int tab_width=8;
@@ -221,6 +312,11 @@ static int n_columns=3;
  */
 static int latinise=0;
 
+/* Is the input in UTF-8? (If so, we convert fonts to ISO-Latin-1
+ * anyway, and turn what we can into that.)
+ */
+static int utf_8=0;
+
 /* Should we print the date and time of printout?
  * If so, in what font?
  */
@@ -233,6 +329,13 @@ static double date_font_size=6;
 
 static char *title=0;
 
+/* If we're given a manifest of documents to make, this is its name;
+ * and this is how many we should make at once (0 means as many as
+ * there are processors).
+ */
+static char *batch_file=0;
+static int batch_jobs=0;
+
 /* Format for date, suitable for input to strftime().
  */
 static char date_format[256]="Printed %d %b %Y";
@@ -321,10 +424,6 @@ static int page_num;	/* 1.. */
  */
 static int input_line_num;	/* 0.. */
 
-/* Indeed, what *is* the input file?
- */
-static FILE *input_file=0;
-
 /* Which output font are we using?
  * (Bit 0 governs boldness, bit 1 governs italicity.)
  */
@@ -384,6 +483,287 @@ static void *xmalloc(size_t n, char *what_for) {
 }
 
 
+#ifdef USE_THREADS
+
+/* --------------------------------- Rings --------------------------------- */
+
+/* Threads pass blocks of data to each other through rings. Each ring has
+ * exactly one thread putting things in and one taking them out, so neither
+ * of them needs a lock except when the ring is empty and the taker has to
+ * wait. Every block belongs to some fixed pool smaller than a ring, so a
+ * ring can never fill up.
+ */
+#define RING_SIZE 32	/* must be a power of 2 */
+
+typedef struct Ring {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int sleeping;		/* is the taker waiting for |changed|? */
+  unsigned head;	/* where the next thing will be taken from */
+  unsigned tail;	/* where the next thing will be put */
+  void *item[RING_SIZE];
+} Ring;
+
+#define NEW_RING { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, { 0 } }
+
+/* Empty a ring, ready to use it again. Nobody else had better be using it.
+ */
+static void ring_init(Ring *r) {
+  r->head=r->tail=0; r->sleeping=0;
+}
+
+static void ring_put(Ring *r, void *p) {
+  unsigned t=r->tail;
+  r->item[t&(RING_SIZE-1)]=p;
+  __atomic_store_n(&r->tail,t+1,__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->sleeping,__ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+/* Take the next thing from |r|, waiting for it if necessary. We spin for
+ * a little while first, since usually it isn't long in coming.
+ */
+static void *ring_get(Ring *r) {
+  unsigned h=r->head;
+  void *p;
+  int i;
+  for (i=0;i<100;++i)
+    if (__atomic_load_n(&r->tail,__ATOMIC_ACQUIRE)!=h) goto got_it;
+  pthread_mutex_lock(&r->lock);
+  __atomic_store_n(&r->sleeping,1,__ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&r->tail,__ATOMIC_SEQ_CST)==h)
+    pthread_cond_wait(&r->changed,&r->lock);
+  __atomic_store_n(&r->sleeping,0,__ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&r->lock);
+got_it:
+  p=r->item[h&(RING_SIZE-1)];
+  __atomic_store_n(&r->head,h+1,__ATOMIC_RELEASE);
+  return p;
+}
+
+#endif
+
+
+/* -------------------------------- Output -------------------------------- */
+
+/* All the PostScript goes through |out_printf| and |out_putc|, which
+ * collect it in big blocks. Without threads, we write each block to
+ * stdout when it's full; with them, the writer thread does that while
+ * we get on with filling the next one.
+ */
+#define OUT_BLOCK 262144
+
+typedef struct Out_block {
+  size_t len;
+  size_t size;		/* OUT_BLOCK, except as a library (see below) */
+  char *data;		/* |size| bytes */
+} Out_block;
+
+static Out_block *out_cur;
+static long out_sent;	/* how much has been sent off before |out_cur| */
+
+/* How much output there has been so far.
+ */
+#define out_tell() (out_sent+(long)out_cur->len)
+
+#define out_putc(c) \
+  (out_cur->len<out_cur->size \
+   ? (void)(out_cur->data[out_cur->len++]=(char)(c)) : out_full(c))
+
+#ifdef THREECOL_LIBRARY
+
+/* As a library (see the very end of the file) we don't write anything
+ * anywhere. The output is cut into pieces -- the prologue, each page,
+ * and the trailer -- and each is handed over when the calling program
+ * asks for it. We lay out on a thread of our own, which waits in
+ * |out_piece| until the caller has finished with one piece before
+ * starting on the next; so there's just the one block, which grows to
+ * hold the biggest piece.
+ */
+enum {
+  l_idle,	/* not started yet */
+  l_working,	/* laying out the next piece */
+  l_ready,	/* a piece is in |out_cur|, and the caller can have it */
+  l_done	/* nothing more to come */
+};
+
+static pthread_mutex_t lib_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lib_changed=PTHREAD_COND_INITIALIZER;
+static int lib_state=l_done;	/* protected by |lib_lock| */
+static int lib_piece;		/* the number of the piece in |out_cur| */
+static int lib_abandoned;	/* has the caller stopped wanting pieces? */
+
+/* Once the caller has given up, there's no point reading any more input.
+ */
+#define abandoned() __atomic_load_n(&lib_abandoned,__ATOMIC_ACQUIRE)
+
+/* The block is full, but the piece isn't finished: make it bigger.
+ */
+static void out_send(void) {
+  out_cur->size*=2;
+  out_cur->data=realloc(out_cur->data,out_cur->size);
+  if (!out_cur->data) fatal("Out of memory: needed %lu bytes for one page",
+                            (unsigned long)out_cur->size);
+}
+
+/* Piece number |n| is finished. Hand it over, and wait until the
+ * caller wants the next one.
+ */
+static void out_piece(int n) {
+  out_sent+=out_cur->len;
+  pthread_mutex_lock(&lib_lock);
+  if (!lib_abandoned) {
+    lib_piece=n; lib_state=l_ready;
+    pthread_cond_broadcast(&lib_changed);
+    while (lib_state==l_ready && !lib_abandoned)
+      pthread_cond_wait(&lib_changed,&lib_lock);
+  }
+  pthread_mutex_unlock(&lib_lock);
+  out_cur->len=0;
+}
+
+#elif defined(USE_THREADS)
+
+#define OUT_BLOCKS 8
+
+static Out_block out_blocks[OUT_BLOCKS];
+static Ring out_ring=NEW_RING;	/* main loop -> writer */
+static Ring out_free=NEW_RING;	/* writer -> main loop */
+static pthread_t writer_id;
+
+/* Write out blocks until we get an empty one, which means stop.
+ */
+static void *writer_main(void *arg) {
+  Out_block *b;
+  arg=arg;	/* pacify compiler */
+  while ((b=ring_get(&out_ring))->len) {
+    fwrite(b->data,1,b->len,stdout);
+    b->len=0;
+    ring_put(&out_free,b);
+  }
+  return 0;
+}
+
+/* Send the current block off to be written, and get another.
+ */
+static void out_send(void) {
+  out_sent+=out_cur->len;
+  ring_put(&out_ring,out_cur);
+  out_cur=ring_get(&out_free);
+}
+
+#else
+
+static void out_send(void) {
+  out_sent+=out_cur->len;
+  fwrite(out_cur->data,1,out_cur->len,stdout);
+  out_cur->len=0;
+}
+
+#endif
+
+#ifndef THREECOL_LIBRARY
+#define out_piece(n) ((void)0)
+#define abandoned() 0
+#endif
+
+/* The current block is full: send it off, and put |c| in the next.
+ */
+static void out_full(int c) {
+  out_send();
+  out_cur->data[out_cur->len++]=(char)c;
+}
+
+static void out_write(const char *s, size_t n) {
+  size_t k;
+  while (n) {
+    if (out_cur->len==out_cur->size) out_send();
+    k=out_cur->size-out_cur->len;
+    if (k>n) k=n;
+    memcpy(out_cur->data+out_cur->len,s,k);
+    out_cur->len+=k; s+=k; n-=k;
+  }
+}
+
+/* Just like |printf|, except that it goes into the current block.
+ * It nearly always fits; when it doesn't, we format it somewhere
+ * else and copy it in.
+ */
+static void out_printf(const char *s, ...) {
+  static char *buf=0;
+  static size_t buf_size=0;
+  va_list ap;
+  size_t room=out_cur->size-out_cur->len;
+  int n;
+  va_start(ap,s);
+  n=vsnprintf(out_cur->data+out_cur->len,room,s,ap);
+  va_end(ap);
+  if (n<0) return;
+  if ((size_t)n<room) { out_cur->len+=n; return; }
+  if ((size_t)n>=buf_size) {
+    free(buf);
+    buf_size=n+1;
+    buf=xmalloc(buf_size,"an output buffer");
+  }
+  va_start(ap,s);
+  vsnprintf(buf,buf_size,s,ap);
+  va_end(ap);
+  out_write(buf,n);
+}
+
+/* Get ready to produce some output.
+ */
+static void out_begin(void) {
+  out_sent=0;
+#ifdef THREECOL_LIBRARY
+  static Out_block b;
+  if (!b.data) {
+    b.size=OUT_BLOCK;
+    b.data=xmalloc(OUT_BLOCK,"an output block");
+  }
+  b.len=0;
+  out_cur=&b;
+#elif defined(USE_THREADS)
+  int i;
+  ring_init(&out_ring); ring_init(&out_free);
+  for (i=0;i<OUT_BLOCKS;++i) {
+    out_blocks[i].len=0; out_blocks[i].size=OUT_BLOCK;
+    out_blocks[i].data=xmalloc(OUT_BLOCK,"an output block");
+    ring_put(&out_free,&out_blocks[i]);
+  }
+  out_cur=ring_get(&out_free);
+  if (pthread_create(&writer_id,0,writer_main,0))
+    fatal("I couldn't start the thread to write the output with");
+#else
+  static Out_block b;
+  b.len=0; b.size=OUT_BLOCK;
+  b.data=xmalloc(OUT_BLOCK,"an output block");
+  out_cur=&b;
+#endif
+}
+
+/* Write out whatever's left. As a library, that's the trailer, which
+ * is the piece after the last page.
+ */
+static void out_end(void) {
+#ifdef THREECOL_LIBRARY
+  out_piece(page_num+1);
+#else
+# ifdef USE_THREADS
+  if (out_cur->len) out_send();
+  ring_put(&out_ring,out_cur);	/* an empty block tells the writer to stop */
+  pthread_join(writer_id,0);
+# else
+  out_send();
+# endif
+  fflush(stdout);
+#endif
+}
+
+
 /* -------------------------------- Strings -------------------------------- */
 
 /* Copy a string into a newly allocated piece of memory.
@@ -438,11 +818,356 @@ static int strccmp(const char *s, const char *t) {
 static void emit_string(const char *s) {
   char c;
   while ((c=*s++)!=0) {
-    if (c=='(' || c==')' || c=='\\') putchar('\\');
-    putchar(c);
+    if (c=='(' || c==')' || c=='\\') out_putc('\\');
+    out_putc(c);
+  }
+}
+
+/* --------------------------- Repeated strings --------------------------- */
+
+/* Logs tend to say the same thing over and over again. If |share_strings|
+ * is set, we note on the first pass which lines (and which beginnings of
+ * lines) turn up more than once, and put each of those into an array in
+ * the PostScript once, at the start; where they occur, we emit "123 D"
+ * instead of the string itself.
+ * Beginnings are tried at every |SHARE_STEP| characters, so we can keep
+ * a running hash as we go along the line and look each one up as it
+ * comes. Strings shorter than |SHARE_MIN| aren't worth it.
+ * When the table fills up we throw away everything seen only once so
+ * far, so that repeats later on still have room; if that doesn't free
+ * a quarter of it, the table stays full and new strings aren't shared.
+ */
+#define SHARE_TABLE 262144	/* must be a power of 2 */
+#define SHARE_MAX 131072	/* at most this many different strings */
+#define SHARE_STEP 16
+#define SHARE_MIN 8
+#define SHARE_LIMIT 65535	/* the longest array PostScript allows */
+
+typedef struct Shared {
+  unsigned long hash;
+  int len;
+  long count;		/* how often it turned up on the first pass */
+  long index;		/* its place in the array, or -1 */
+  char *s;
+} Shared;
+
+static Shared **share_table;	/* hashed by |hash| */
+static Shared **share_order;	/* in order of first appearance */
+static long n_shared;		/* how many in |share_order| */
+static long n_numbered;		/* how many of them go in the array */
+static int share_full;		/* no use throwing any more away */
+
+#define share_hash(h,c) ((h)*257+(unsigned char)(c)+1)
+
+/* Make room in the table by forgetting the strings seen only once.
+ */
+static void evict_shared(void) {
+  long i,n=0;
+  unsigned long k;
+  Shared *p;
+  memset(share_table,0,SHARE_TABLE*sizeof(Shared*));
+  for (i=0;i<n_shared;++i) {
+    p=share_order[i];
+    if (p->count<=1) { free(p->s); free(p); continue; }
+    share_order[n++]=p;
+    k=p->hash&(SHARE_TABLE-1);
+    while (share_table[k]) k=(k+1)&(SHARE_TABLE-1);
+    share_table[k]=p;
+  }
+  n_shared=n;
+  if (n_shared>SHARE_MAX/4*3) share_full=1;
+}
+
+/* Find the string |s| of length |len|, with hash |h|.
+ * If it isn't there and |add| is set, make a new entry for it (if there
+ * is still room), with count 0. Otherwise return 0.
+ */
+static Shared *find_shared(const char *s, int len, unsigned long h, int add) {
+  unsigned long i=h&(SHARE_TABLE-1);
+  Shared *p;
+  while ((p=share_table[i])!=0) {
+    if (p->hash==h && p->len==len && !memcmp(p->s,s,len)) return p;
+    i=(i+1)&(SHARE_TABLE-1);
+  }
+  if (!add) return 0;
+  if (n_shared>=SHARE_MAX) {
+    if (share_full) return 0;
+    evict_shared();
+    return find_shared(s,len,h,add);
+  }
+  p=xmalloc(sizeof(Shared),"a repeated string");
+  p->hash=h; p->len=len; p->count=0; p->index=-1;
+  p->s=xmalloc(len+1,"a repeated string");
+  memcpy(p->s,s,len); p->s[len]=0;
+  share_table[i]=p;
+  share_order[n_shared++]=p;
+  return p;
+}
+
+/* On the first pass: note that the line |s| occurs.
+ */
+static void count_string(const char *s) {
+  unsigned long h=0;
+  int len=strlen(s);
+  int i;
+  Shared *p;
+  if (len<SHARE_MIN) return;
+  if (!share_table) {
+    share_table=xmalloc(SHARE_TABLE*sizeof(Shared*),"the string table");
+    memset(share_table,0,SHARE_TABLE*sizeof(Shared*));
+    share_order=xmalloc(SHARE_MAX*sizeof(Shared*),"the string table");
+  }
+  for (i=0;i<len;) {
+    h=share_hash(h,s[i]);
+    if (++i%SHARE_STEP==0 || i==len)
+      if ((p=find_shared(s,i,h,1))!=0) ++p->count;
+  }
+}
+
+/* The document is finished: forget all the strings.
+ */
+static void forget_shared(void) {
+  long i;
+  for (i=0;i<n_shared;++i) { free(share_order[i]->s); free(share_order[i]); }
+  if (share_table) memset(share_table,0,SHARE_TABLE*sizeof(Shared*));
+  n_shared=n_numbered=0; share_full=0;
+}
+
+/* Between the passes: decide which strings go in the array.
+ */
+static void number_strings(void) {
+  long i;
+  n_numbered=0;
+  for (i=0;i<n_shared && n_numbered<SHARE_LIMIT;++i)
+    if (share_order[i]->count>1) share_order[i]->index=n_numbered++;
+}
+
+/* Emit the array of repeated strings, in chunks small enough not to
+ * overflow the operand stack.
+ */
+static void emit_shared_strings(void) {
+  long i,k=0;
+  out_printf("/DS %ld array def\n",n_numbered);
+  for (i=0;i<n_shared;++i) {
+    if (share_order[i]->index<0) continue;
+    if (!(k%256)) out_printf("%sDS %ld [\n",k?"] putinterval\n":"",k);
+    out_putc('('); emit_string(share_order[i]->s); out_printf(")\n");
+    ++k;
+  }
+  if (k) out_printf("] putinterval\n");
+}
+
+/* Emit the line |s|, ready to be shown: either as a string, or as a
+ * reference to the array followed by whatever's left. We look at the
+ * whole line first, then at shorter and shorter beginnings of it (only
+ * the first few, since lines are seldom that long).
+ */
+#define SHARE_TRIES 16
+
+static void emit_line_string(const char *s, int underlined) {
+  unsigned long h=0,hs[SHARE_TRIES+1];
+  int at[SHARE_TRIES+1];
+  int len=strlen(s);
+  int i,n=0;
+  Shared *p;
+  if (n_numbered && len>=SHARE_MIN) {
+    for (i=0;i<len;) {
+      h=share_hash(h,s[i]);
+      if (++i==len || (i%SHARE_STEP==0 && n<SHARE_TRIES)) {
+        hs[n]=h; at[n++]=i;
+      }
+    }
+    while (n-->0) {
+      if ((p=find_shared(s,at[n],hs[n],0))==0 || p->index<0) continue;
+      out_printf("%ld D ",p->index);
+      if (at[n]==len) return;
+      out_printf("%s (",underlined?"shu":"s");
+      emit_string(s+at[n]); out_printf(") ");
+      return;
+    }
+  }
+  out_putc('('); emit_string(s); out_printf(") ");
+}
+
+/* ------------------------------- Pictures ------------------------------- */
+
+/* The mark-up directive %E includes an EPS file. We map the file into
+ * memory (or, without USE_MMAP, just read it), find its bounding box,
+ * and keep it until the document is finished. A picture that turned up
+ * more than once on the first pass is sent only once, in the document
+ * setup, as a Level 2 form; after that each use is just "execform".
+ */
+typedef struct Picture {
+  char *name;
+  char *data;		/* the whole file */
+  size_t size;
+  int mapped;		/* is |data| mapped, rather than read? */
+  char *ps;		/* the PostScript part of it */
+  size_t ps_len;
+  double bbox[4];	/* llx lly urx ury */
+  long count;		/* how often it turned up on the first pass */
+  int form;		/* its number as a form, or -1 */
+  struct Picture *next;
+} Picture;
+
+static Picture *pictures;
+static int n_forms;
+
+/* What we look for, and what we put at the end of a form's data.
+ */
+#define BBOX_DSC "%%BoundingBox:"
+#define EPS_EOD "%%3col-EndOfPicture"
+
+/* Find the DSC comment |what| at the start of a line in the first 64K
+ * of |s| (or the last, if |at_end|), skipping any that say "(atend)".
+ * Return the position just after it, or 0.
+ */
+static char *find_DSC(char *s, size_t len, const char *what, int at_end) {
+  size_t l=strlen(what), i=0, n=len, j;
+  if (n>65536) { if (at_end) i=n-65536; n=i+65536; }
+  for (;i+l<=n;++i) {
+    if ((i && s[i-1]!='\n' && s[i-1]!='\r') || memcmp(s+i,what,l)) continue;
+    for (j=i+l; j<len && s[j]==' '; ++j) ;
+    if (j+7<=len && !memcmp(s+j,"(atend)",7)) continue;
+    return s+j;
+  }
+  return 0;
+}
+
+/* Read the file |name| into a new Picture. Return 0 if we can't.
+ */
+static Picture *load_picture(const char *name) {
+  Picture *p;
+  char *s,*e;
+  int i;
+  FILE *f=fopen(name,"rb");
+  if (!f) { error("I couldn't open the picture `%s'",name); return 0; }
+  p=xmalloc(sizeof(Picture),"a picture");
+  p->name=copy_string(name); p->count=0; p->form=-1;
+  p->data=0; p->mapped=0;
+#ifdef USE_MMAP
+  {
+    struct stat st;
+    if (!fstat(fileno(f),&st) && st.st_size>0) {
+      p->size=(size_t)st.st_size;
+      p->data=mmap(0,p->size,PROT_READ,MAP_PRIVATE,fileno(f),0);
+      if (p->data==MAP_FAILED) p->data=0; else p->mapped=1;
+    }
+  }
+#endif
+  if (!p->data) {
+    size_t n=0,l=65536;
+    p->data=xmalloc(l,"a picture");
+    while ((n+=fread(p->data+n,1,l-n,f))==l) {
+      p->data=realloc(p->data,l<<=1);
+      if (!p->data) fatal("Out of memory, reading the picture `%s'",name);
+    }
+    p->size=n;
+  }
+  fclose(f);
+  p->ps=p->data; p->ps_len=p->size;
+  /* DOS EPS files have a binary header saying where the PostScript is. */
+  if (p->size>=12 && (unsigned char)p->data[0]==0xC5
+      && (unsigned char)p->data[1]==0xD0 && (unsigned char)p->data[2]==0xD3
+      && (unsigned char)p->data[3]==0xC6) {
+    unsigned char *h=(unsigned char *)p->data;
+    size_t off=h[4]|h[5]<<8|(size_t)h[6]<<16|(size_t)h[7]<<24;
+    size_t len=h[8]|h[9]<<8|(size_t)h[10]<<16|(size_t)h[11]<<24;
+    if (off<p->size && len<=p->size-off) { p->ps=p->data+off; p->ps_len=len; }
+  }
+  s=find_DSC(p->ps,p->ps_len,BBOX_DSC,0);
+  if (!s) s=find_DSC(p->ps,p->ps_len,BBOX_DSC,1);
+  for (i=0;s && i<4;++i) {
+    p->bbox[i]=strtod(s,&e);
+    if (e==s) s=0; else s=e;
+  }
+  if (!s || p->bbox[2]<=p->bbox[0] || p->bbox[3]<=p->bbox[1]) {
+    error("The picture `%s' doesn't have a proper bounding box",name);
+    p->bbox[0]=p->bbox[1]=0; p->bbox[2]=p->bbox[3]=72;
+  }
+  p->next=pictures; pictures=p;
+  return p;
+}
+
+/* Find the picture |name|, loading it if this is the first time.
+ */
+static Picture *find_picture(const char *name) {
+  Picture *p;
+  for (p=pictures;p;p=p->next) if (!strcmp(p->name,name)) return p;
+  return load_picture(name);
+}
+
+/* The document is finished: forget all the pictures.
+ */
+static void forget_pictures(void) {
+  Picture *p;
+  while ((p=pictures)!=0) {
+    pictures=p->next;
+#ifdef USE_MMAP
+    if (p->mapped) munmap(p->data,p->size); else
+#endif
+    free(p->data);
+    free(p->name); free(p);
+  }
+  n_forms=0;
+}
+
+/* Emit the PostScript of picture |p|, making sure it ends with a newline.
+ */
+static void emit_picture_data(Picture *p) {
+  out_write(p->ps,p->ps_len);
+  if (p->ps_len && p->ps[p->ps_len-1]!='\n') out_putc('\n');
+}
+
+/* Between the passes: decide which pictures become forms.
+ */
+static void number_pictures(void) {
+  Picture *p;
+  n_forms=0;
+  for (p=pictures;p;p=p->next) if (p->count>1) p->form=n_forms++;
+}
+
+/* In the setup: define a form for each picture that needs one. Its data
+ * is read into an array of strings, and drawn afresh by <EP> each time,
+ * reading them one after another. (A ReusableStreamDecode filter would
+ * be simpler, but it needs Level 3.)
+ */
+static void emit_forms(void) {
+  Picture *p;
+  for (p=pictures;p;p=p->next) {
+    if (p->form<0) continue;
+    out_printf("%%%%BeginDocument: %s\n",p->name);
+    out_printf("/E%dd [ currentfile 0 (%s) /SubFileDecode filter\n"
+               "  { dup 65535 string readstring { exch } { exch pop exit }"
+               " ifelse } loop\n",p->form,EPS_EOD);
+    emit_picture_data(p);
+    out_printf("%s\n(%s) ] def\n%%%%EndDocument\n",EPS_EOD,EPS_EOD);
+    out_printf("/E%d << /FormType 1 /Matrix [1 0 0 1 0 0]"
+               " /BBox [%lg %lg %lg %lg]\n",p->form,
+               p->bbox[0],p->bbox[1],p->bbox[2],p->bbox[3]);
+    out_printf("  /PaintProc { pop E%dd EP } >> def\n",p->form);
+  }
+}
+
+/* Draw picture |p|, scaled to fit in the column and in the |n| lines
+ * starting with this one.
+ */
+static void emit_picture(Picture *p, int n) {
+  double w=p->bbox[2]-p->bbox[0], h=p->bbox[3]-p->bbox[1];
+  double k=col_text_width/w;
+  if (n*line_spacing/h<k) k=n*line_spacing/h;
+  out_printf("gsave x y %lg sub translate %lg dup scale %lg %lg translate\n",
+             (n-.75)*line_spacing,k,0-p->bbox[0],0-p->bbox[1]);
+  if (p->form>=0) out_printf("E%d execform\n",p->form);
+  else {
+    out_printf("EB\n%%%%BeginDocument: %s\n",p->name);
+    emit_picture_data(p);
+    out_printf("%%%%EndDocument\nEE\n");
   }
+  out_printf("grestore xym\n");
 }
 
+
 /* ============================= Config files ============================= */
 
 /*****************************************************************************
@@ -696,6 +1421,66 @@ static void c_nf_font(void *place) {
   file_name_font_size=double_vals[0];
 }
 
+/* Parse a Highlight item: a pattern, then a style, which is
+ * some of "Bold", "Italic", "Underline", "Grey" joined with "+".
+ */
+static void c_highlight(void *place) {
+  Highlight *h,**hp;
+  char word[16];
+  char *s=str_vals[1];
+  int style=0, n;
+  place=place;	/* pacify compiler */
+  while (*s) {
+    for (n=0; s[n] && s[n]!='+'; ++n) ;
+    if (n>=16) n=15;
+    memcpy(word,s,n); word[n]=0;
+    if (!strccmp(word,"Bold")) style|=hl_bold;
+    else if (!strccmp(word,"Italic")) style|=hl_italic;
+    else if (!strccmp(word,"Underline")) style|=hl_underline;
+    else if (!strccmp(word,"Grey") || !strccmp(word,"Gray")) style|=hl_grey;
+    else { config_err("I don't know how to highlight in `%s'",word); return; }
+    s+=n; if (*s) ++s;
+  }
+  h=xmalloc(sizeof(Highlight),"a highlighting pattern");
+  h->pattern=copy_string(str_vals[0]);
+  h->style=style;
+  h->next=0;
+  for (hp=&highlights;*hp;hp=&(*hp)->next) ;
+  *hp=h;
+}
+
+/* Parse a Preview item: the name of the files to draw the pages in,
+ * which must have exactly one %d (say) in it, for the page number.
+ */
+static void c_preview(void *place) {
+  char *s=str_vals[0];
+  int n=0, l;
+  place=place;	/* pacify compiler */
+  if (!strccmp(s,"None")) { preview_file=0; return; }
+  for (;*s;++s) {
+    if (*s!='%') continue;
+    if (*++s=='%') continue;
+    while (*s && strchr("-+ #0123456789",*s)) ++s;
+    if (*s!='d') { n=-1; break; }
+    ++n;
+  }
+  if (n!=1) {
+    config_err("`%s' should have just one %%d in it, for the page number",
+               str_vals[0]);
+    return;
+  }
+  l=strlen(str_vals[0]);
+  if (l>4 && !stricmp(str_vals[0]+l-4,".png")) {
+#ifndef HAVE_ZLIB
+    config_err("I can't make PNG files without zlib; try PBM instead");
+    return;
+#endif
+    preview_png=1;
+  }
+  else preview_png=0;
+  preview_file=copy_string(str_vals[0]);
+}
+
 /* The options we understand.
  * The meaning of all this stuff should be obvious by now.
  */
@@ -722,6 +1507,13 @@ static Config_option config_options[] = {
   { "Page_numbers",  1, "S",       &c_page_numbers, 0 },
   { "Mark_up",       1, "S",       &c_boolean,      &mark_up },
   { "Truncate",      1, "S",       &c_boolean,      &truncating },
+  { "Share_strings", 1, "S",       &c_boolean,      &share_strings },
+  { "Strict_DSC",    1, "S",       &c_boolean,      &strict_DSC },
+  { "Old_procset",   1, "S",       &c_boolean,      &old_procset },
+  { "Highlight",     2, "SS",      &c_highlight,    0 },
+  { "Highlight_grey",1, "D",       &c_double,       &highlight_grey },
+  { "Preview",       1, "S",       &c_preview,      0 },
+  { "Preview_dpi",   1, "D",       &c_double,       &preview_dpi },
   { "Line_numbers",  1, "S",       &c_boolean,      &show_line_numbers },
   { "LN_interval",   1, "I",       &c_integer,      &line_number_interval },
   { "LN_ctsly",      1, "S",       &c_boolean,      &line_number_continuously },
@@ -731,8 +1523,11 @@ static Config_option config_options[] = {
   { "New_file_font", 2, "SD",      &c_nf_font,      0 },
   { "New_file_skip", 1, "I",       &c_integer,      &file_name_skip_lines },
   { "Tab_width",     1, "I",       &c_integer,      &tab_width },
+  { "Read_ahead",    1, "I",       &c_integer,      &read_ahead },
+  { "Batch_jobs",    1, "I",       &c_integer,      &batch_jobs },
   { "Columns",       1, "I",       &c_integer,      &n_columns },
   { "ISO_Latin_1",   1, "S",       &c_boolean,      &latinise },
+  { "UTF_8",         1, "S",       &c_boolean,      &utf_8 },
   { "Date",          1, "S",       &c_boolean,      &show_date },
   { "Date_format",   1, "S",       &c_string256,    &date_format },
   { "Date_font",     2, "SD",      &c_date_font,    0 },
@@ -934,6 +1729,7 @@ static void do_command_line(int argc, char *argv[]) {
     ++s;
     /* Deal with special options, mostly for back-compatibility */
     if (!stricmp(s,"title")) { title=argv[1]; Next2; }
+    if (!stricmp(s,"batch")) { batch_file=argv[1]; Next2; }
     if (!stricmp(s,"number")) {
       show_line_numbers=1; line_number_interval=atoi(argv[1]); Next2; }
     if (!stricmp(s,"ignore-FF")) { ff_behaviour=as_newline; continue; }
@@ -987,7 +1783,7 @@ static void do_command_line(int argc, char *argv[]) {
     if (t) error("Unknown option `%s'",s);
   }
 done:
-  if (!n_input_files) {
+  if (!n_input_files && !batch_file) {
     /* No files given? Read from stdin, of course. */
     make_tempfile();
     input_filenames[n_input_files++]=tempfile_name;
@@ -1073,9 +1869,10 @@ static void grok_date(void) {
 /* Work out everything we can on the basis of the
  * config options etc.
  * This includes setting up that temporary file if necessary.
+ * Only the dimensions are the same for all the documents in a batch
+ * that have the same options.
  */
-static void grok_things(void) {
-  grok_dimensions();
+static void grok_document(void) {
   grok_title();
   if (show_date) grok_date();
   if (tempfile_name) {
@@ -1093,6 +1890,13 @@ static void grok_things(void) {
   user_name=getenv("USER");
   if (!user_name) user_name="<unknown>";
   if (tab_width<1) tab_width=1;
+  if (preview_dpi<1) preview_dpi=1;
+  if (utf_8) latinise=1;
+}
+
+static void grok_things(void) {
+  grok_dimensions();
+  grok_document();
 }
 
 
@@ -1108,26 +1912,39 @@ static void grok_things(void) {
 
 /* ----------------------------- Little bits ----------------------------- */
 
+/* Emit a DSC bounding-box comment |what| for the printable area of
+ * the paper, in default user space.
+ */
+static void DSC_bbox(const char *what) {
+  double w=paper_desc.rotated ? paper_desc.Ysize : paper_desc.Xsize;
+  double h=paper_desc.rotated ? paper_desc.Xsize : paper_desc.Ysize;
+  double m=paper_desc.margin;
+  out_printf("%%%%%s: %d %d %d %d\n",what,
+             (int)m,(int)m,(int)(w-m+.999),(int)(h-m+.999));
+}
+
 /* Emit the initial DSC comments.
  */
 static void prologue_DSC(void) {
-  printf("%%!PS-Adobe-2.0\n");
-  printf("%%%%Title: %s\n",title);
-  if (show_n_pages) printf("%%%%Pages: %d\n",n_pages);
-  else printf("%%%%Pages: (atend)\n");
-  printf("%%%%PageOrder: Ascend\n");
-  if (paper_desc.rotated) printf("%%%%Orientation: Landscape\n");
-  else printf("%%%%Orientation: Portrait\n");
-  printf("%%%%EndComments\n\n");
-  printf("%%%%BeginProlog\n\n");
+  out_printf(strict_DSC ? "%%!PS-Adobe-3.0\n" : "%%!PS-Adobe-2.0\n");
+  out_printf("%%%%Title: %s\n",title);
+  if (strict_DSC) DSC_bbox("BoundingBox");
+  if (show_n_pages) out_printf("%%%%Pages: %d\n",n_pages);
+  else out_printf("%%%%Pages: (atend)\n");
+  out_printf("%%%%PageOrder: Ascend\n");
+  if (n_forms) out_printf("%%%%LanguageLevel: 2\n");
+  if (paper_desc.rotated) out_printf("%%%%Orientation: Landscape\n");
+  else out_printf("%%%%Orientation: Portrait\n");
+  out_printf("%%%%EndComments\n\n");
+  out_printf("%%%%BeginProlog\n\n");
 }
 
 /* Emit definition of <ff>, which is the same as <findfont> if |latinise==0|,
  * and does the necessary conversions if |latinise!=0|.
  */
 static void prologue_findfont(void) {
-  if (!latinise) { printf("/ff { findfont } bind def\n"); return; }
-  printf(
+  if (!latinise) { out_printf("/ff { findfont } bind def\n"); return; }
+  out_printf(
 "/ISO-8859-1-encoding [\n"
 "\n"
 " /ring /circumflex /tilde /dotlessi\n"
@@ -1208,6 +2025,87 @@ static void prologue_findfont(void) {
 );
 }
 
+/* Emit the operators that have to do with where we are: moving
+ * to the start of each column, and displaying each line and moving
+ * on to the next, with or without things in the margin.
+ * These are done for every line of every page, so they have to be
+ * quick to interpret. Keeping the position in variables means
+ * several |def|s and name lookups each time; instead, we keep it
+ * in the current point, and |y| just finds out what that is.
+ * Only |x| needs to be a variable, and that's set once a column.
+ * The current point is always at the left of the current line,
+ * unless we're part-way through it; so everything that draws
+ * something else restores it (with |gsave| and |grestore|,
+ * generally) before it finishes.
+ */
+static void prologue_lines(void) {
+  int i;
+  out_printf("/mt /moveto load def /s /show load def /rmt /rmoveto load def\n");
+  out_printf("/sw /stringwidth load def /st /stroke load def /np /newpath load def\n");
+  out_printf("/slw /setlinewidth load def /sg /setgray load def\n");
+  out_printf("/del { %lg 0 rmoveto } bind def\n",-char_width);
+  out_printf("/y { currentpoint exch pop } bind def /xym { x y moveto } bind def\n");
+  out_printf("/dn { x currentpoint exch pop 3 -1 roll sub moveto } bind def\n");
+  for (i=0;i<n_columns;++i)
+    out_printf("/col%d { /x %lg def %lg %lg moveto } bind def\n",
+           i+1,col1_left+i*col_width,col1_left+i*col_width,col_top-line_spacing);
+  out_printf("/l { show x currentpoint exch pop %lg sub moveto } bind def\n",
+             line_spacing);
+  out_printf("/nl { x currentpoint exch pop %lg sub moveto } bind def\n",
+             line_spacing);
+  out_printf("/US (");
+  for (i=0;i<=2*chars_per_line;++i) out_putc('_');
+  out_printf(") def\n");
+  out_printf("/shu { dup show length dup %lg mul 0 rmoveto US exch 0 exch getinterval show } bind def\n",
+         -char_width);
+  out_printf("/lu { shu x currentpoint exch pop %lg sub moveto } bind def\n",
+             line_spacing);
+  out_printf("/nlu { nl } bind def\n");
+  out_printf("/bar { gsave 0.4 setlinewidth currentpoint exch pop %lg add\n",
+             line_spacing*.5);
+  out_printf("       dup x 2 sub exch mt 0 %lg rlineto stroke\n",line_spacing);
+  out_printf("       x 3 sub exch mt 0 %lg rlineto stroke grestore } bind def\n",
+             line_spacing);
+  out_printf("/rbar { gsave 0.8 setlinewidth x %lg add currentpoint exch pop mt\n",
+             col_text_width+2);
+  out_printf("        0 %lg rlineto stroke grestore } bind def\n",line_spacing);
+  out_printf("/lnum { currentfont exch lf setfont dup stringwidth pop neg %lg rmoveto\n",
+             line_spacing);
+  out_printf("        show x currentpoint exch pop %lg sub moveto setfont } bind def\n",
+             line_spacing);
+}
+
+/* The same, as they used to be.
+ */
+static void prologue_old_lines(void) {
+  int i;
+  out_printf("/mt {moveto} bind def /s {show} bind def /rmt {rmoveto} bind def\n");
+  out_printf("/sw {stringwidth} bind def /st {stroke} bind def /np {newpath} bind def\n");
+  out_printf("/slw {setlinewidth} bind def /sg {setgray} bind def\n");
+  out_printf("/del { %lg 0 rmoveto } bind def\n",-char_width);
+  out_printf("/xym { x y moveto } bind def\n");
+  for (i=0;i<n_columns;++i)
+    out_printf("/col%d { /x %lg def /y %lg def xym } bind def\n",
+           i+1,col1_left+i*col_width,col_top-line_spacing);
+  out_printf("/l { show /y y %lg sub def xym } bind def\n",line_spacing);
+  out_printf("/nl { /y y %lg sub def xym } bind def\n",line_spacing);
+  out_printf("/shu { dup show length dup %lg mul 0 rmoveto -1 1 { pop (_) show } for } bind def\n",
+         -char_width);
+  out_printf("/lu { shu /y y %lg sub def xym } bind def\n",line_spacing);
+  out_printf("/nlu { /nl } bind def\n");
+  out_printf("/bar { 0.4 setlinewidth x 2 sub y %lg add mt 0 %lg rlineto stroke\n",
+         line_spacing*.5,line_spacing);
+  out_printf("                        x 3 sub y %lg add mt 0 %lg rlineto stroke\n",
+         line_spacing*.5,line_spacing);
+  out_printf("                        xym } bind def\n");
+  out_printf("/rbar { 0.8 setlinewidth x %lg add y mt 0 %lg rlineto stroke\n",
+         col_text_width+2,line_spacing);
+  out_printf("        xym } bind def\n");
+  out_printf("/lnum { /cf currentfont def lf setfont\n");
+  out_printf("        dup stringwidth pop neg %lg rmoveto show\n",line_spacing);
+  out_printf("        xym cf setfont } bind def\n");
+}
+
 /* Emit definitions of operators we need.
  * Non-obvious ones:
  *   <f0..f3> are fonts: normal, bold, italic, bold-italic
@@ -1219,128 +2117,2357 @@ static void prologue_findfont(void) {
  *   <l> displays a single line and moves on to the next.
  *   <shu> is like <show>, but underlines what it displays.
  *   <bar> displays a double bar in the LH margin to indicate an overrun.
+ *   <D> fetches a repeated string from the array <DS>.
+ *   <hl> puts a grey background behind the next so many characters.
+ *   <EB> and <EE> go around an included EPS file; <EP> draws one
+ *     from a reusable stream, for a form's PaintProc.
  */
 static void prologue_procset(void) {
+  Highlight *h;
   int i;
-  printf("%%%%BeginProcSet: 3col 2.0 1\n");
-  printf("%% Fonts:\n");
+  if (old_procset) out_printf("%%%%BeginProcSet: 3col 2.0 1\n");
+  else out_printf("%%%%BeginProcSet: 3col 2.1 0\n");
+  out_printf("%% Fonts:\n");
   prologue_findfont();
-  printf("/sf { [%lg 0 0 %lg 0 0] makefont } bind def\n",
+  out_printf("/sf { [%lg 0 0 %lg 0 0] makefont } bind def\n",
          font_size*font_desc.aspect/100,font_size);
-  printf("/f0 /%s ff sf def /F0 { f0 setfont } bind def\n",font_desc.normal);
-  printf("/f1 /%s ff sf def /F1 { f1 setfont } bind def\n",font_desc.bold);
-  printf("/f2 /%s ff sf def /F2 { f2 setfont } bind def\n",font_desc.italic);
-  printf("/f3 /%s ff sf def /F3 { f3 setfont } bind def\n",font_desc.bolditalic);
-  printf("/fn /%s ff %lg scalefont def\n",file_name_font,file_name_font_size);
-  printf("/ti /%s ff %lg scalefont def\n",title_font,title_font_size);
-  printf("/lf /%s ff %lg scalefont def\n",line_number_font,line_number_font_size);
+  out_printf("/f0 /%s ff sf def /F0 { f0 setfont } bind def\n",font_desc.normal);
+  out_printf("/f1 /%s ff sf def /F1 { f1 setfont } bind def\n",font_desc.bold);
+  out_printf("/f2 /%s ff sf def /F2 { f2 setfont } bind def\n",font_desc.italic);
+  out_printf("/f3 /%s ff sf def /F3 { f3 setfont } bind def\n",font_desc.bolditalic);
+  out_printf("/fn /%s ff %lg scalefont def\n",file_name_font,file_name_font_size);
+  out_printf("/ti /%s ff %lg scalefont def\n",title_font,title_font_size);
+  out_printf("/lf /%s ff %lg scalefont def\n",line_number_font,line_number_font_size);
   if (show_date)
-    printf("/df /%s ff %lg scalefont def\n",date_font,date_font_size);
-  printf("%% Other things:\n");
-  printf("/mt {moveto} bind def /s {show} bind def /rmt {rmoveto} bind def\n");
-  printf("/sw {stringwidth} bind def /st {stroke} bind def /np {newpath} bind def\n");
-  printf("/slw {setlinewidth} bind def /sg {setgray} bind def\n");
-  printf("/del { %lg 0 rmoveto } bind def\n",-char_width);
-  printf("/xym { x y moveto } bind def\n");
-  for (i=0;i<n_columns;++i)
-    printf("/col%d { /x %lg def /y %lg def xym } bind def\n",
-           i+1,col1_left+i*col_width,col_top-line_spacing);
-  printf("/l { show /y y %lg sub def xym } bind def\n",line_spacing);
-  printf("/nl { /y y %lg sub def xym } bind def\n",line_spacing);
-  printf("/shu { dup show length dup %lg mul 0 rmoveto -1 1 { pop (_) show } for } bind def\n",
-         -char_width);
-  printf("/lu { shu /y y %lg sub def xym } bind def\n",line_spacing);
-  printf("/nlu { /nl } bind def\n");
-  printf("/bar { 0.4 setlinewidth x 2 sub y %lg add mt 0 %lg rlineto stroke\n",
-         line_spacing*.5,line_spacing);
-  printf("                        x 3 sub y %lg add mt 0 %lg rlineto stroke\n",
-         line_spacing*.5,line_spacing);
-  printf("                        xym } bind def\n");
-  printf("/rbar { 0.8 setlinewidth x %lg add y mt 0 %lg rlineto stroke\n",
-         col_text_width+2,line_spacing);
-  printf("        xym } bind def\n");
-  printf("/lnum { /cf currentfont def lf setfont\n");
-  printf("        dup stringwidth pop neg %lg rmoveto show\n",line_spacing);
-  printf("        xym cf setfont } bind def\n");
-  printf("%% The newpage operator -- (1 of 3) newpage :\n");
-  printf(
+    out_printf("/df /%s ff %lg scalefont def\n",date_font,date_font_size);
+  out_printf("%% Other things:\n");
+  if (old_procset) prologue_old_lines(); else prologue_lines();
+  if (n_numbered) out_printf("/D { DS exch get } bind def\n");
+  for (h=highlights;h;h=h->next) if (h->style&hl_grey) break;
+  if (h) {
+    out_printf("/hl { gsave currentpoint newpath %lg sub moveto %lg setgray\n",
+               line_spacing*.25,highlight_grey);
+    out_printf("      %lg mul dup 0 rlineto 0 %lg rlineto neg 0 rlineto\n",
+               char_width,line_spacing);
+    out_printf("      closepath fill grestore } bind def\n");
+  }
+  if (mark_up) {
+    out_printf("/EB { /Es save def /Ed countdictstack def /Eo count def\n");
+    out_printf("      userdict begin /showpage {} def 0 setgray 0 setlinecap\n");
+    out_printf("      1 setlinewidth 0 setlinejoin 10 setmiterlimit [] 0 setdash\n");
+    out_printf("      newpath } bind def\n");
+    out_printf("/EE { count Eo sub {pop} repeat countdictstack Ed sub {end} repeat\n");
+    out_printf("      Es restore } bind def\n");
+    /* Which string a form's data has got to is kept in global VM, where
+     * a save and restore in the picture can't take it back. */
+    out_printf("/Ex 1 dict def currentglobal true setglobal /Ei 1 dict def"
+               " setglobal\n");
+    out_printf("/EP { //Ex /a 3 -1 roll put //Ei /i 0 put\n");
+    out_printf("      { //Ex /a get //Ei /i get get //Ei /i 2 copy get 1 add put }\n");
+    out_printf("      0 (%s) /SubFileDecode filter /Ef exch def\n",EPS_EOD);
+    out_printf("      EB Ef cvx exec EE } bind def\n");
+  }
+  out_printf("%% The newpage operator -- (1 of 3) newpage :\n");
+  out_printf(
 "/newpage {\n"
 "  dup ( of) search pop print pop pop (...) print flush\n"
 "  /cf currentfont def\n"
 "  currentscreen 3 -1 roll 2 mul 3 1 roll setscreen\n"	/* Que? */
 );
-  if (paper_desc.rotated) printf("  %lg 0 translate [0 1 -1 0 0 0] concat\n",
+  if (paper_desc.rotated) out_printf("  %lg 0 translate [0 1 -1 0 0 0] concat\n",
                                  paper_desc.Ysize);
   /* Column-separating rules */
-  printf("  %lg setlinewidth %lg setgray newpath\n",divider_width,divider_grey);
+  out_printf("  %lg setlinewidth %lg setgray newpath\n",divider_width,divider_grey);
   for (i=1;i<n_columns;++i)
-    printf("  %lg %lg mt 0 %lg rlineto\n",
+    out_printf("  %lg %lg mt 0 %lg rlineto\n",
            col1_left-cgap/2+i*col_width,col_bottom,col_top-col_bottom);
-  printf("  stroke\n");
+  out_printf("  stroke\n");
   /* Title bar */
-  printf("  %lg setlinewidth 0 setgray newpath\n",title_rule);
-  printf("  %lg %lg mt %lg %lg lineto %lg %lg lineto %lg %lg lineto closepath\n",
+  out_printf("  %lg setlinewidth 0 setgray newpath\n",title_rule);
+  out_printf("  %lg %lg mt %lg %lg lineto %lg %lg lineto %lg %lg lineto closepath\n",
          title_bar_left,title_bar_bottom, title_bar_right,title_bar_bottom,
          title_bar_right,title_bar_top, title_bar_left,title_bar_top);
-  printf("  gsave %lg setgray fill grestore stroke newpath\n",title_grey);
-  printf("  ti setfont %lg %lg mt (",title_start_x,title_start_y);
-  emit_string(title); printf(") show\n");
+  out_printf("  gsave %lg setgray fill grestore stroke newpath\n",title_grey);
+  out_printf("  ti setfont %lg %lg mt (",title_start_x,title_start_y);
+  emit_string(title); out_printf(") show\n");
   if (show_page_numbers) {
-    if (!show_n_pages) printf("  ( of) search pop 3 1 roll pop pop\n");
-    printf("  dup stringwidth pop %lg exch sub %lg mt show\n",pageno_end_x,pageno_end_y); }
-  else printf("  pop\n");
+    if (!show_n_pages) out_printf("  ( of) search pop 3 1 roll pop pop\n");
+    out_printf("  dup stringwidth pop %lg exch sub %lg mt show\n",pageno_end_x,pageno_end_y); }
+  else out_printf("  pop\n");
   /* Date, if necessary */
   if (show_date) {
-    printf("  df setfont ("); emit_string(the_date); printf(") dup stringwidth pop\n");
-    printf("  %lg exch sub %lg moveto show\n",
+    out_printf("  df setfont ("); emit_string(the_date); out_printf(") dup stringwidth pop\n");
+    out_printf("  %lg exch sub %lg moveto show\n",
            title_bar_right,title_bar_bottom-date_font_size);
   }
-  printf("  cf setfont\n");
-  printf("} bind def\n");
-  printf("%%%%EndProcSet\n");
+  out_printf("  cf setfont\n");
+  out_printf("} bind def\n");
+  out_printf("%%%%EndProcSet\n");
+}
+
+/* Where each page starts in the output, for |strict_DSC|; and where
+ * the trailer starts.
+ */
+static long *page_offsets;
+static int page_offsets_size;
+static long trailer_offset;
+
+/* Start page |n|. Without |strict_DSC| all we need is a save, which
+ * is followed by |sep|; with it, there's rather more.
+ */
+static void begin_page(int n, const char *sep) {
+  out_piece(n-1);
+  if (!strict_DSC) { out_printf("%%%%Page: %d %d\nsave%s",n,n,sep); return; }
+  if (n>page_offsets_size) {
+    page_offsets_size = page_offsets_size ? 2*page_offsets_size : 256;
+    page_offsets=realloc(page_offsets,page_offsets_size*sizeof(long));
+    if (!page_offsets) fatal("Out of memory, recording where pages start");
+  }
+  page_offsets[n-1]=out_tell();
+  out_printf("%%%%Page: %d %d\n",n,n);
+  DSC_bbox("PageBoundingBox");
+  out_printf("%%%%BeginPageSetup\nsave\n%%%%EndPageSetup\n");
+}
+
+/* Emit the rest of the prologue.
+ */
+static void prologue_end(void) {
+  out_printf("%%%%EndProlog\n\n");
+  if (n_numbered || n_forms || strict_DSC) {
+    out_printf("%%%%BeginSetup\n");
+    if (n_numbered) emit_shared_strings();
+    emit_forms();
+    if (!strict_DSC) out_printf("%%%%EndSetup\n\n");
+  }
+  if (show_n_pages)
+    out_printf("(Output from 3COL, user %s, total %d pages...\n) print flush\n",
+           user_name,n_pages);
+  else
+    out_printf("(Output from 3COL, user %s...\n) print flush\n",user_name);
+  if (strict_DSC) out_printf("%%%%EndSetup\n");
+  out_printf("\n");
+  begin_page(1,"\n");
+}
+
+
+/* -------------------------- Putting it together -------------------------- */
+
+/* Output the whole prologue.
+ */
+static void emit_prologue(void) {
+  prologue_DSC();
+  prologue_procset();
+  prologue_end();
+}
+
+
+/* ============================= The trailer ============================= */
+
+/*****************************************************************************
+**                                                                          **
+**  The following sections are concerned with the PostScript trailer that   **
+**  goes at the end of the output file.                                     **
+**                                                                          **
+*****************************************************************************/
+
+/* Emit the trailer.
+ */
+static void emit_trailer(void) {
+  int i;
+  out_printf("\n");
+  out_piece(page_num);
+  trailer_offset=out_tell();
+  out_printf("%%%%Trailer\n");
+  if (!show_n_pages) out_printf("%%%%Pages: %d\n",n_pages);
+  if (strict_DSC) {
+    out_printf("%%3col-Setup: 0 %ld\n",page_offsets[0]);
+    for (i=0;i<page_num;++i)
+      out_printf("%%3col-Page: %d %ld %ld\n",i+1,page_offsets[i],
+                 (i+1<page_num ? page_offsets[i+1] : trailer_offset)
+                 -page_offsets[i]);
+  }
+  out_printf("(done.\n) print flush\n");
+  out_printf("%%%%EOF\n");
+}
+
+
+/* ============================= The preview ============================= */
+
+/*****************************************************************************
+**                                                                          **
+**  The following sections are concerned with drawing each page as a       **
+**  picture as well, if |preview_file| says so. We know where everything    **
+**  goes, so we don't need a PostScript interpreter to do it: just a crude  **
+**  monospaced font of our own.                                             **
+**                                                                          **
+*****************************************************************************/
+
+
+/* --------------------------------- Font --------------------------------- */
+
+/* Each character is 8 rows of 8 dots, the bottom bit of each row being
+ * the leftmost dot. Row 7 is below the baseline. Anything we haven't got
+ * a shape for comes out as the last one, which is an empty box.
+ */
+static const unsigned char pv_font[96][8] = {
+  { 0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00 },	/* space */
+  { 0x18,0x3C,0x3C,0x18,0x18,0x00,0x18,0x00 },	/* ! */
+  { 0x36,0x36,0x00,0x00,0x00,0x00,0x00,0x00 },	/* " */
+  { 0x36,0x36,0x7F,0x36,0x7F,0x36,0x36,0x00 },	/* # */
+  { 0x0C,0x3E,0x03,0x1E,0x30,0x1F,0x0C,0x00 },	/* $ */
+  { 0x00,0x63,0x33,0x18,0x0C,0x66,0x63,0x00 },	/* % */
+  { 0x1C,0x36,0x1C,0x6E,0x3B,0x33,0x6E,0x00 },	/* & */
+  { 0x06,0x06,0x03,0x00,0x00,0x00,0x00,0x00 },	/* ' */
+  { 0x18,0x0C,0x06,0x06,0x06,0x0C,0x18,0x00 },	/* ( */
+  { 0x06,0x0C,0x18,0x18,0x18,0x0C,0x06,0x00 },	/* ) */
+  { 0x00,0x66,0x3C,0xFF,0x3C,0x66,0x00,0x00 },	/* * */
+  { 0x00,0x0C,0x0C,0x3F,0x0C,0x0C,0x00,0x00 },	/* + */
+  { 0x00,0x00,0x00,0x00,0x00,0x0C,0x0C,0x06 },	/* , */
+  { 0x00,0x00,0x00,0x3F,0x00,0x00,0x00,0x00 },	/* - */
+  { 0x00,0x00,0x00,0x00,0x00,0x0C,0x0C,0x00 },	/* . */
+  { 0x60,0x30,0x18,0x0C,0x06,0x03,0x01,0x00 },	/* / */
+  { 0x3E,0x63,0x73,0x7B,0x6F,0x67,0x3E,0x00 },	/* 0 */
+  { 0x0C,0x0E,0x0C,0x0C,0x0C,0x0C,0x3F,0x00 },	/* 1 */
+  { 0x1E,0x33,0x30,0x1C,0x06,0x33,0x3F,0x00 },	/* 2 */
+  { 0x1E,0x33,0x30,0x1C,0x30,0x33,0x1E,0x00 },	/* 3 */
+  { 0x38,0x3C,0x36,0x33,0x7F,0x30,0x78,0x00 },	/* 4 */
+  { 0x3F,0x03,0x1F,0x30,0x30,0x33,0x1E,0x00 },	/* 5 */
+  { 0x1C,0x06,0x03,0x1F,0x33,0x33,0x1E,0x00 },	/* 6 */
+  { 0x3F,0x33,0x30,0x18,0x0C,0x0C,0x0C,0x00 },	/* 7 */
+  { 0x1E,0x33,0x33,0x1E,0x33,0x33,0x1E,0x00 },	/* 8 */
+  { 0x1E,0x33,0x33,0x3E,0x30,0x18,0x0E,0x00 },	/* 9 */
+  { 0x00,0x0C,0x0C,0x00,0x00,0x0C,0x0C,0x00 },	/* : */
+  { 0x00,0x0C,0x0C,0x00,0x00,0x0C,0x0C,0x06 },	/* ; */
+  { 0x18,0x0C,0x06,0x03,0x06,0x0C,0x18,0x00 },	/* < */
+  { 0x00,0x00,0x3F,0x00,0x00,0x3F,0x00,0x00 },	/* = */
+  { 0x06,0x0C,0x18,0x30,0x18,0x0C,0x06,0x00 },	/* > */
+  { 0x1E,0x33,0x30,0x18,0x0C,0x00,0x0C,0x00 },	/* ? */
+  { 0x3E,0x63,0x7B,0x7B,0x7B,0x03,0x1E,0x00 },	/* @ */
+  { 0x0C,0x1E,0x33,0x33,0x3F,0x33,0x33,0x00 },	/* A */
+  { 0x3F,0x66,0x66,0x3E,0x66,0x66,0x3F,0x00 },	/* B */
+  { 0x3C,0x66,0x03,0x03,0x03,0x66,0x3C,0x00 },	/* C */
+  { 0x1F,0x36,0x66,0x66,0x66,0x36,0x1F,0x00 },	/* D */
+  { 0x7F,0x46,0x16,0x1E,0x16,0x46,0x7F,0x00 },	/* E */
+  { 0x7F,0x46,0x16,0x1E,0x16,0x06,0x0F,0x00 },	/* F */
+  { 0x3C,0x66,0x03,0x03,0x73,0x66,0x7C,0x00 },	/* G */
+  { 0x33,0x33,0x33,0x3F,0x33,0x33,0x33,0x00 },	/* H */
+  { 0x1E,0x0C,0x0C,0x0C,0x0C,0x0C,0x1E,0x00 },	/* I */
+  { 0x78,0x30,0x30,0x30,0x33,0x33,0x1E,0x00 },	/* J */
+  { 0x67,0x66,0x36,0x1E,0x36,0x66,0x67,0x00 },	/* K */
+  { 0x0F,0x06,0x06,0x06,0x46,0x66,0x7F,0x00 },	/* L */
+  { 0x63,0x77,0x7F,0x7F,0x6B,0x63,0x63,0x00 },	/* M */
+  { 0x63,0x67,0x6F,0x7B,0x73,0x63,0x63,0x00 },	/* N */
+  { 0x1C,0x36,0x63,0x63,0x63,0x36,0x1C,0x00 },	/* O */
+  { 0x3F,0x66,0x66,0x3E,0x06,0x06,0x0F,0x00 },	/* P */
+  { 0x1E,0x33,0x33,0x33,0x3B,0x1E,0x38,0x00 },	/* Q */
+  { 0x3F,0x66,0x66,0x3E,0x36,0x66,0x67,0x00 },	/* R */
+  { 0x1E,0x33,0x07,0x0E,0x38,0x33,0x1E,0x00 },	/* S */
+  { 0x3F,0x2D,0x0C,0x0C,0x0C,0x0C,0x1E,0x00 },	/* T */
+  { 0x33,0x33,0x33,0x33,0x33,0x33,0x3F,0x00 },	/* U */
+  { 0x33,0x33,0x33,0x33,0x33,0x1E,0x0C,0x00 },	/* V */
+  { 0x63,0x63,0x63,0x6B,0x7F,0x77,0x63,0x00 },	/* W */
+  { 0x63,0x63,0x36,0x1C,0x1C,0x36,0x63,0x00 },	/* X */
+  { 0x33,0x33,0x33,0x1E,0x0C,0x0C,0x1E,0x00 },	/* Y */
+  { 0x7F,0x63,0x31,0x18,0x4C,0x66,0x7F,0x00 },	/* Z */
+  { 0x1E,0x06,0x06,0x06,0x06,0x06,0x1E,0x00 },	/* [ */
+  { 0x03,0x06,0x0C,0x18,0x30,0x60,0x40,0x00 },	/* \ */
+  { 0x1E,0x18,0x18,0x18,0x18,0x18,0x1E,0x00 },	/* ] */
+  { 0x08,0x1C,0x36,0x63,0x00,0x00,0x00,0x00 },	/* ^ */
+  { 0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xFF },	/* _ */
+  { 0x0C,0x0C,0x18,0x00,0x00,0x00,0x00,0x00 },	/* ` */
+  { 0x00,0x00,0x1E,0x30,0x3E,0x33,0x6E,0x00 },	/* a */
+  { 0x07,0x06,0x06,0x3E,0x66,0x66,0x3B,0x00 },	/* b */
+  { 0x00,0x00,0x1E,0x33,0x03,0x33,0x1E,0x00 },	/* c */
+  { 0x38,0x30,0x30,0x3E,0x33,0x33,0x6E,0x00 },	/* d */
+  { 0x00,0x00,0x1E,0x33,0x3F,0x03,0x1E,0x00 },	/* e */
+  { 0x1C,0x36,0x06,0x0F,0x06,0x06,0x0F,0x00 },	/* f */
+  { 0x00,0x00,0x6E,0x33,0x33,0x3E,0x30,0x1F },	/* g */
+  { 0x07,0x06,0x36,0x6E,0x66,0x66,0x67,0x00 },	/* h */
+  { 0x0C,0x00,0x0E,0x0C,0x0C,0x0C,0x1E,0x00 },	/* i */
+  { 0x30,0x00,0x30,0x30,0x30,0x33,0x33,0x1E },	/* j */
+  { 0x07,0x06,0x66,0x36,0x1E,0x36,0x67,0x00 },	/* k */
+  { 0x0E,0x0C,0x0C,0x0C,0x0C,0x0C,0x1E,0x00 },	/* l */
+  { 0x00,0x00,0x33,0x7F,0x7F,0x6B,0x63,0x00 },	/* m */
+  { 0x00,0x00,0x1F,0x33,0x33,0x33,0x33,0x00 },	/* n */
+  { 0x00,0x00,0x1E,0x33,0x33,0x33,0x1E,0x00 },	/* o */
+  { 0x00,0x00,0x3B,0x66,0x66,0x3E,0x06,0x0F },	/* p */
+  { 0x00,0x00,0x6E,0x33,0x33,0x3E,0x30,0x78 },	/* q */
+  { 0x00,0x00,0x3B,0x6E,0x66,0x06,0x0F,0x00 },	/* r */
+  { 0x00,0x00,0x3E,0x03,0x1E,0x30,0x1F,0x00 },	/* s */
+  { 0x08,0x0C,0x3E,0x0C,0x0C,0x2C,0x18,0x00 },	/* t */
+  { 0x00,0x00,0x33,0x33,0x33,0x33,0x6E,0x00 },	/* u */
+  { 0x00,0x00,0x33,0x33,0x33,0x1E,0x0C,0x00 },	/* v */
+  { 0x00,0x00,0x63,0x6B,0x7F,0x7F,0x36,0x00 },	/* w */
+  { 0x00,0x00,0x63,0x36,0x1C,0x36,0x63,0x00 },	/* x */
+  { 0x00,0x00,0x33,0x33,0x33,0x3E,0x30,0x1F },	/* y */
+  { 0x00,0x00,0x3F,0x19,0x0C,0x26,0x3F,0x00 },	/* z */
+  { 0x38,0x0C,0x0C,0x07,0x0C,0x0C,0x38,0x00 },	/* { */
+  { 0x18,0x18,0x18,0x00,0x18,0x18,0x18,0x00 },	/* | */
+  { 0x07,0x0C,0x0C,0x38,0x0C,0x0C,0x07,0x00 },	/* } */
+  { 0x6E,0x3B,0x00,0x00,0x00,0x00,0x00,0x00 },	/* ~ */
+  { 0x00,0x3F,0x21,0x21,0x21,0x21,0x3F,0x00 }	/* anything else */
+};
+
+/* Our font pretends to be bold (1) and/or italic (2) like this.
+ */
+static void pv_shape(int c, int style, unsigned char rows[8]) {
+  int i;
+  c=(unsigned char)c;
+  if (c<32 || c>126) c=127;
+  for (i=0;i<8;++i) {
+    rows[i]=pv_font[c-32][i];
+    if (style&1) rows[i]|=rows[i]<<1;
+    if ((style&2) && i<6) rows[i]<<=(6-i)/3;
+  }
+}
+
+/* Guess the style of a PostScript font from its name.
+ */
+static int pv_style(const char *font) {
+  return (strstr(font,"Bold")!=0)
+         | (strstr(font,"Italic") || strstr(font,"Oblique")) << 1;
+}
+
+
+/* ---------------------------- Recording pages ---------------------------- */
+
+/* While we lay out a page we note down everything that goes on it, in
+ * the order the PostScript draws it: text and filled rectangles. All
+ * positions are in points, with the page the right way up (so that
+ * rotated paper isn't rotated here).
+ */
+enum { pv_text, pv_fill };
+
+typedef struct Pv_op {
+  int what;
+  float x,y;		/* bottom left; for text, the start of the baseline */
+  float w,h;		/* size; for text, of one character */
+  int style;		/* font, for text; or greyness, 0..255, for a fill */
+  int text,len;		/* where in |chars| the text is */
+} Pv_op;
+
+typedef struct Pv_page {
+  int num;
+  Pv_op *ops;
+  int n_ops, ops_size;
+  char *chars;
+  int n_chars, chars_size;
+  struct Pv_page *next;
+} Pv_page;
+
+static Pv_page *pv_cur;	/* the page we're laying out, if we're drawing it */
+
+/* Where we are on it: the PostScript's <x> and <y>, and its current
+ * point.
+ */
+static double pv_x, pv_y;
+static double pv_cx, pv_cy;
+
+static Pv_op *pv_op(int what, double x, double y, double w, double h,
+                    int style) {
+  Pv_op *o;
+  if (pv_cur->n_ops>=pv_cur->ops_size) {
+    pv_cur->ops_size*=2;
+    pv_cur->ops=realloc(pv_cur->ops,pv_cur->ops_size*sizeof(Pv_op));
+    if (!pv_cur->ops) fatal("Out of memory, drawing page %d",pv_cur->num);
+  }
+  o=&pv_cur->ops[pv_cur->n_ops++];
+  o->what=what; o->x=(float)x; o->y=(float)y; o->w=(float)w; o->h=(float)h;
+  o->style=style; o->text=o->len=0;
+  return o;
+}
+
+/* Fill a rectangle with grey |g|.
+ */
+static void pv_rect(double x, double y, double w, double h, double g) {
+  if (!pv_cur) return;
+  if (g<0) g=0; else if (g>1) g=1;
+  pv_op(pv_fill,x,y,w,h,(int)(g*255+.5));
+}
+
+/* Show |n| characters of |s| at the current point, |w| apart, in a font
+ * of size |h|, and move along.
+ */
+static void pv_show(const char *s, int n, double w, double h, int style) {
+  Pv_op *o;
+  if (!pv_cur || n<=0) return;
+  while (pv_cur->n_chars+n>pv_cur->chars_size) {
+    pv_cur->chars_size*=2;
+    pv_cur->chars=realloc(pv_cur->chars,pv_cur->chars_size);
+    if (!pv_cur->chars) fatal("Out of memory, drawing page %d",pv_cur->num);
+  }
+  o=pv_op(pv_text,pv_cx,pv_cy,w,h,style);
+  o->text=pv_cur->n_chars; o->len=n;
+  memcpy(pv_cur->chars+pv_cur->n_chars,s,n);
+  pv_cur->n_chars+=n;
+  pv_cx+=n*w;
+}
+
+/* The equivalents of <xym>, <colN> and <rmoveto>.
+ */
+static void pv_xym(void) { pv_cx=pv_x; pv_cy=pv_y; }
+
+static void pv_col(int i) {
+  pv_x=col1_left+(i-1)*col_width; pv_y=col_top-line_spacing; pv_xym();
+}
+
+static void pv_move(double dx, double dy) { pv_cx+=dx; pv_cy+=dy; }
+
+/* Move down |n| lines (or up, if it's negative), back to the start
+ * of the line.
+ */
+static void pv_lines(double n) { pv_y-=n*line_spacing; pv_xym(); }
+
+/* We can't draw an included picture, but we can show where it goes:
+ * a light grey box, just where |emit_picture| puts the picture.
+ */
+static void pv_picture(Picture *p, int n) {
+  double w=p->bbox[2]-p->bbox[0], h=p->bbox[3]-p->bbox[1];
+  double k=col_text_width/w, y;
+  if (n*line_spacing/h<k) k=n*line_spacing/h;
+  w*=k; h*=k; y=pv_y-(n-.75)*line_spacing;
+  pv_rect(pv_x,y,w,h,.9);
+  pv_rect(pv_x,y,w,.4,0); pv_rect(pv_x,y+h-.4,w,.4,0);
+  pv_rect(pv_x,y,.4,h,0); pv_rect(pv_x+w-.4,y,.4,h,0);
+}
+
+
+/* ---------------------------- Drawing pages ---------------------------- */
+
+/* A page being drawn: |w| by |h| dots, 0 black and 255 white, with |k|
+ * dots to the point.
+ */
+typedef struct Raster {
+  int w,h;
+  double k;
+  unsigned char *dots;
+} Raster;
+
+/* Fill the rectangle from |x0|,|y0| to |x1|,|y1| (in dots, from the top
+ * left) with |g|, mixing it in at the edges with what's there already.
+ * Anything thinner than a dot is widened to a dot, so that rules don't
+ * fade away altogether.
+ */
+static void pv_paint(Raster *r, double x0, double y0, double x1, double y1,
+                     int g) {
+  int i,j;
+  double cx,cy,c;
+  unsigned char *d;
+  if (x1-x0<1) { x0=(x0+x1-1)/2; x1=x0+1; }
+  if (y1-y0<1) { y0=(y0+y1-1)/2; y1=y0+1; }
+  for (j=(int)y0;j<y1;++j) {
+    if (j<0 || j>=r->h) continue;
+    cy=(j+1<y1 ? j+1 : y1)-(j>y0 ? j : y0);
+    d=r->dots+(size_t)j*r->w;
+    for (i=(int)x0;i<x1;++i) {
+      if (i<0 || i>=r->w) continue;
+      cx=(i+1<x1 ? i+1 : x1)-(i>x0 ? i : x0);
+      c=cx*cy;
+      d[i]=(unsigned char)(d[i]+(g-d[i])*c+.5);
+    }
+  }
+}
+
+static void pv_draw_rect(Raster *r, double x, double y, double w, double h,
+                         int g) {
+  double top=r->h/r->k;
+  pv_paint(r,x*r->k,(top-y-h)*r->k,(x+w)*r->k,(top-y)*r->k,g);
+}
+
+/* Draw character |c| with its baseline starting at |x|,|y| (in points),
+ * squashed into a box |w| wide and |h| high. Each dot gets as dark as
+ * the part of the character it covers.
+ */
+static void pv_draw_char(Raster *r, int c, int style, double x, double y,
+                         double w, double h) {
+  unsigned char rows[8];
+  double x0,y0,x1,y1,sx,sy;
+  double gx0,gx1,gy0,gy1,sum,oy;
+  int i,j,a,b;
+  unsigned char *d;
+  if (c==' ') return;
+  pv_shape(c,style,rows);
+  x0=x*r->k; x1=(x+w)*r->k;
+  y0=(r->h/r->k-y-.7*h)*r->k; y1=y0+.8*h*r->k;
+  sx=8/(x1-x0); sy=8/(y1-y0);
+  for (j=(int)y0;j<y1;++j) {
+    if (j<0 || j>=r->h) continue;
+    gy0=(j-y0)*sy; if (gy0<0) gy0=0;
+    gy1=(j+1-y0)*sy; if (gy1>8) gy1=8;
+    d=r->dots+(size_t)j*r->w;
+    for (i=(int)x0;i<x1;++i) {
+      if (i<0 || i>=r->w) continue;
+      gx0=(i-x0)*sx; if (gx0<0) gx0=0;
+      gx1=(i+1-x0)*sx; if (gx1>8) gx1=8;
+      sum=0;
+      for (b=(int)gy0;b<gy1;++b) {
+        if (!rows[b]) continue;
+        oy=(b+1<gy1 ? b+1 : gy1)-(b>gy0 ? b : gy0);
+        for (a=(int)gx0;a<gx1;++a)
+          if (rows[b]>>a&1)
+            sum+=oy*((a+1<gx1 ? a+1 : gx1)-(a>gx0 ? a : gx0));
+      }
+      if (sum>0) {
+        sum/=sx*sy;
+        if (sum>1) sum=1;
+        d[i]=(unsigned char)(d[i]*(1-sum)+.5);
+      }
+    }
+  }
+}
+
+static void pv_draw_text(Raster *r, const char *s, int n, int style,
+                         double x, double y, double w, double h) {
+  int i;
+  for (i=0;i<n;++i) pv_draw_char(r,s[i],style,x+i*w,y,w,h);
+}
+
+/* Draw a string in a proportional font, which our font's characters
+ * are about .6 as wide as, right-justified if |right|.
+ */
+static void pv_draw_label(Raster *r, const char *s, const char *font,
+                          double size, double x, double y, int right) {
+  int n=strlen(s);
+  if (right) x-=n*size*.6;
+  pv_draw_text(r,s,n,pv_style(font),x,y,size*.6,size);
+}
+
+/* Draw what <newpage> draws: the dividers and the title bar.
+ */
+static void pv_draw_furniture(Raster *r, int num) {
+  char s[64];
+  int i, g=(int)(divider_grey*255+.5);
+  for (i=1;i<n_columns;++i)
+    pv_draw_rect(r,col1_left-cgap/2+i*col_width-divider_width/2,col_bottom,
+                 divider_width,col_top-col_bottom,g);
+  pv_draw_rect(r,title_bar_left,title_bar_bottom,
+               title_bar_right-title_bar_left,title_height,
+               (int)(title_grey*255+.5));
+  pv_draw_rect(r,title_bar_left-title_rule/2,title_bar_bottom-title_rule/2,
+               title_bar_right-title_bar_left+title_rule,title_rule,0);
+  pv_draw_rect(r,title_bar_left-title_rule/2,title_bar_top-title_rule/2,
+               title_bar_right-title_bar_left+title_rule,title_rule,0);
+  pv_draw_rect(r,title_bar_left-title_rule/2,title_bar_bottom-title_rule/2,
+               title_rule,title_height+title_rule,0);
+  pv_draw_rect(r,title_bar_right-title_rule/2,title_bar_bottom-title_rule/2,
+               title_rule,title_height+title_rule,0);
+  pv_draw_label(r,title,title_font,title_font_size,
+                title_start_x,title_start_y,0);
+  if (show_page_numbers) {
+    if (show_n_pages) sprintf(s,"%d of %d",num,n_pages);
+    else sprintf(s,"%d",num);
+    pv_draw_label(r,s,title_font,title_font_size,
+                  pageno_end_x,pageno_end_y,1);
+  }
+  if (show_date)
+    pv_draw_label(r,the_date,date_font,date_font_size,
+                  title_bar_right,title_bar_bottom-date_font_size,1);
+}
+
+/* Draw page |p| in |r|.
+ */
+static void pv_draw_page(Raster *r, Pv_page *p) {
+  Pv_op *o;
+  int i;
+  memset(r->dots,255,(size_t)r->w*r->h);
+  pv_draw_furniture(r,p->num);
+  for (i=0,o=p->ops;i<p->n_ops;++i,++o) {
+    if (o->what==pv_fill) pv_draw_rect(r,o->x,o->y,o->w,o->h,o->style);
+    else pv_draw_text(r,p->chars+o->text,o->len,o->style,o->x,o->y,o->w,o->h);
+  }
+}
+
+
+/* ---------------------------- Writing pages ---------------------------- */
+
+/* A PBM file has only black and white, so we dither the greys.
+ */
+static void pv_write_PBM(Raster *r, FILE *f) {
+  static const unsigned char dither[4][4] = {
+    { 8,136, 40,168 }, { 200, 72,232,104 },
+    { 56,184, 24,152 }, { 248,120,216, 88 } };
+  unsigned char *row=xmalloc((r->w+7)/8,"a row of dots");
+  unsigned char *d;
+  int i,j;
+  fprintf(f,"P4\n%d %d\n",r->w,r->h);
+  for (j=0;j<r->h;++j) {
+    d=r->dots+(size_t)j*r->w;
+    memset(row,0,(r->w+7)/8);
+    for (i=0;i<r->w;++i)
+      if (d[i]<dither[j&3][i&3]) row[i>>3]|=0x80>>(i&7);
+    fwrite(row,1,(r->w+7)/8,f);
+  }
+  free(row);
+}
+
+#ifdef HAVE_ZLIB
+
+static void pv_put32(unsigned char *p, unsigned long n) {
+  p[0]=(unsigned char)(n>>24); p[1]=(unsigned char)(n>>16);
+  p[2]=(unsigned char)(n>>8); p[3]=(unsigned char)n;
+}
+
+/* Write a PNG chunk: the 4-byte name is at the start of |data|.
+ */
+static void pv_chunk(FILE *f, unsigned char *data, size_t len) {
+  unsigned char b[4];
+  pv_put32(b,(unsigned long)len); fwrite(b,1,4,f);
+  fwrite(data,1,len+4,f);
+  pv_put32(b,crc32(crc32(0,0,0),data,(uInt)(len+4))); fwrite(b,1,4,f);
+}
+
+/* A PNG file can have greys. Each row is stored as differences from
+ * the dot to its left, which deflate squashes rather better.
+ */
+static void pv_write_PNG(Raster *r, FILE *f) {
+  static const unsigned char sig[8] = { 137,'P','N','G',13,10,26,10 };
+  unsigned char head[17];
+  size_t raw_len=(size_t)(r->w+1)*r->h;
+  unsigned char *raw=xmalloc(raw_len,"a PNG picture");
+  uLongf z_len=compressBound((uLong)raw_len);
+  unsigned char *z=xmalloc(z_len+4,"a compressed PNG picture");
+  unsigned char *d,*q;
+  int i,j;
+  for (j=0,q=raw;j<r->h;++j) {
+    d=r->dots+(size_t)j*r->w;
+    *q++=1;
+    *q++=d[0];
+    for (i=1;i<r->w;++i) *q++=(unsigned char)(d[i]-d[i-1]);
+  }
+  if (compress2(z+4,&z_len,raw,(uLong)raw_len,Z_BEST_SPEED)!=Z_OK)
+    fatal("zlib wouldn't compress a page");
+  fwrite(sig,1,8,f);
+  memcpy(head,"IHDR",4); pv_put32(head+4,r->w); pv_put32(head+8,r->h);
+  head[12]=8; head[13]=0; head[14]=0; head[15]=0; head[16]=0;
+  pv_chunk(f,head,13);
+  memcpy(z,"IDAT",4); pv_chunk(f,z,z_len);
+  memcpy(head,"IEND",4); pv_chunk(f,head,0);
+  free(z); free(raw);
+}
+
+#endif
+
+/* Draw page |p| and write it to its file; then we've finished with it.
+ * |r| has room for a page's worth of dots.
+ */
+static void pv_finish_page(Raster *r, Pv_page *p) {
+  char name[1024];
+  FILE *f;
+  pv_draw_page(r,p);
+  snprintf(name,1024,preview_file,p->num);
+  f=fopen(name,"wb");
+  if (!f) error("I couldn't make the picture file `%s'",name);
+  else {
+#ifdef HAVE_ZLIB
+    if (preview_png) pv_write_PNG(r,f); else
+#endif
+    pv_write_PBM(r,f);
+    if (ferror(f) | fclose(f))
+      error("Something went wrong writing the picture file `%s'",name);
+  }
+  free(p->ops); free(p->chars); free(p);
+}
+
+static void pv_new_raster(Raster *r) {
+  r->k=preview_dpi/72;
+  r->w=(int)(paper_desc.Xsize*r->k+.999);
+  r->h=(int)(paper_desc.Ysize*r->k+.999);
+  r->dots=xmalloc((size_t)r->w*r->h,"a page's worth of dots");
+}
+
+
+/* ------------------------- Drawing in parallel ------------------------- */
+
+/* With threads, a few of them draw pages while we get on with laying
+ * out the next; finished pages wait for them in a queue. We don't let
+ * it get too long, in case the pages come faster than they can draw.
+ * Without threads, we draw each page as soon as it's finished.
+ */
+#ifdef USE_THREADS
+
+#define PV_MAX_THREADS 16
+
+static pthread_mutex_t pv_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pv_changed=PTHREAD_COND_INITIALIZER;
+static Pv_page *pv_queue, **pv_queue_end=&pv_queue;
+static int pv_queued, pv_stopping;
+static pthread_t pv_threads[PV_MAX_THREADS];
+static int pv_n_threads;
+
+static void *pv_main(void *arg) {
+  Raster r;
+  Pv_page *p;
+  arg=arg;	/* pacify compiler */
+  pv_new_raster(&r);
+  for (;;) {
+    pthread_mutex_lock(&pv_lock);
+    while (!pv_queue && !pv_stopping) pthread_cond_wait(&pv_changed,&pv_lock);
+    p=pv_queue;
+    if (p) {
+      if (!(pv_queue=p->next)) pv_queue_end=&pv_queue;
+      --pv_queued;
+      pthread_cond_broadcast(&pv_changed);
+    }
+    pthread_mutex_unlock(&pv_lock);
+    if (!p) break;
+    pv_finish_page(&r,p);
+  }
+  free(r.dots);
+  return 0;
+}
+
+static void pv_begin(void) {
+  long n;
+  if (!preview_file) return;
+  pv_stopping=0;
+  n=sysconf(_SC_NPROCESSORS_ONLN);
+  if (n<1) n=1; else if (n>PV_MAX_THREADS) n=PV_MAX_THREADS;
+  for (pv_n_threads=0;pv_n_threads<n;++pv_n_threads)
+    if (pthread_create(&pv_threads[pv_n_threads],0,pv_main,0)) break;
+  if (!pv_n_threads) fatal("I couldn't start any threads to draw pages with");
+}
+
+static void pv_send(Pv_page *p) {
+  p->next=0;
+  pthread_mutex_lock(&pv_lock);
+  while (pv_queued>=2*pv_n_threads) pthread_cond_wait(&pv_changed,&pv_lock);
+  *pv_queue_end=p; pv_queue_end=&p->next;
+  ++pv_queued;
+  pthread_cond_broadcast(&pv_changed);
+  pthread_mutex_unlock(&pv_lock);
+}
+
+static void pv_end(void) {
+  int i;
+  if (!preview_file) return;
+  pthread_mutex_lock(&pv_lock);
+  pv_stopping=1;
+  pthread_cond_broadcast(&pv_changed);
+  pthread_mutex_unlock(&pv_lock);
+  for (i=0;i<pv_n_threads;++i) pthread_join(pv_threads[i],0);
+}
+
+#else
+
+static Raster pv_raster;
+
+static void pv_begin(void) {
+  if (preview_file) pv_new_raster(&pv_raster);
+}
+
+static void pv_send(Pv_page *p) {
+  pv_finish_page(&pv_raster,p);
+}
+
+static void pv_end(void) {
+  if (preview_file) free(pv_raster.dots);
+}
+
+#endif
+
+/* Start laying out page |n|, if we're drawing pages.
+ */
+static void pv_begin_page(int n) {
+  if (!preview_file) return;
+  pv_cur=xmalloc(sizeof(Pv_page),"a page to draw");
+  pv_cur->num=n;
+  pv_cur->ops_size=256; pv_cur->n_ops=0;
+  pv_cur->ops=xmalloc(pv_cur->ops_size*sizeof(Pv_op),"a page to draw");
+  pv_cur->chars_size=8192; pv_cur->n_chars=0;
+  pv_cur->chars=xmalloc(pv_cur->chars_size,"a page to draw");
+}
+
+/* We've finished laying out the page: send it off to be drawn.
+ */
+static void pv_end_page(void) {
+  if (!pv_cur) return;
+  pv_send(pv_cur);
+  pv_cur=0;
+}
+
+
+/* ================================ Input ================================ */
+
+/*****************************************************************************
+**                                                                          **
+**  The following sections are concerned with getting the input files off   **
+**  the disc and into the main loop, preferably before it asks for them.    **
+**                                                                          **
+*****************************************************************************/
+
+
+/* ------------------------------ Read-ahead ------------------------------ */
+
+/* Given a whole tree's worth of files, 3col used to spend most of its time
+ * waiting: for each file to be opened, and then for its first block to
+ * come off the disc. So now we keep a window of files ahead of the one
+ * we're working on which have already been opened, and whose first blocks
+ * have already been read (or are being read), by the time we get to them.
+ * Each file in the window lives in a |Slot|; file number |i| always uses
+ * slot number |i%n_slots|.
+ * How the opening and reading get done depends on what we have: io_uring
+ * if we were compiled with USE_IO_URING and the kernel will let us have it,
+ * a separate read-ahead thread if we were compiled with USE_THREADS, and
+ * otherwise just doing it when we're asked.
+ */
+#define READ_BLOCK 262144	/* how much we read at a time */
+
+typedef struct Slot {
+  int file;		/* which input file is in it, or -1 */
+  int state;		/* see below */
+  FILE *f;		/* the file, once it's open */
+  unsigned char *buf;	/* its first (or most recent) block */
+  size_t len;		/* how much of |buf| is valid */
+} Slot;
+
+enum {
+  s_free=0,	/* nothing in it */
+  s_busy=1,	/* being opened or read */
+  s_ready=2,	/* open, first block in |buf| */
+  s_failed=3	/* couldn't open it */
+};
+
+static Slot *slots;
+static int n_slots;
+static int next_to_start;	/* first file we haven't started on yet */
+static int next_to_use;		/* first file the main loop hasn't had yet */
+
+/* Which of the above methods are we actually using?
+ */
+enum { ra_sync=0, ra_thread=1, ra_uring=2 };
+static int ra_method;
+
+/* Open file |i| and read its first block into slot |s|, returning
+ * the state the slot should then be in. This is the plain, synchronous
+ * way; the read-ahead thread does it this way too.
+ */
+static int ra_fill_slot(Slot *s, int i) {
+  s->f=fopen(input_filenames[i],"rb");
+  if (!s->f) return s_failed;
+  s->len=fread(s->buf,1,READ_BLOCK,s->f);
+  return s_ready;
+}
+
+#ifdef USE_THREADS
+
+/* The read-ahead thread just goes through the files in order, doing
+ * the above for each one as soon as there is a free slot for it.
+ * Everything in |slots| and |next_to_*| is protected by |ra_lock|.
+ */
+static pthread_t ra_thread_id;
+static pthread_mutex_t ra_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_changed=PTHREAD_COND_INITIALIZER;
+static int ra_stopping;
+
+static void *ra_thread_main(void *arg) {
+  Slot *s;
+  int i;
+  arg=arg;	/* pacify compiler */
+  pthread_mutex_lock(&ra_lock);
+  for (;;) {
+    while (!ra_stopping && (next_to_start>=n_input_files
+                            || next_to_start>=next_to_use+n_slots))
+      pthread_cond_wait(&ra_changed,&ra_lock);
+    if (ra_stopping) break;
+    i=next_to_start++;
+    s=&slots[i%n_slots];
+    s->file=i; s->state=s_busy;
+    pthread_mutex_unlock(&ra_lock);
+    i=ra_fill_slot(s,i);
+    pthread_mutex_lock(&ra_lock);
+    s->state=i;
+    pthread_cond_broadcast(&ra_changed);
+  }
+  pthread_mutex_unlock(&ra_lock);
+  return 0;
+}
+
+#endif
+
+#ifdef USE_IO_URING
+
+/* With io_uring we can have the kernel open and read a whole window's
+ * worth of files at once. There's no library to help here, so this is
+ * the bare system-call interface: a submission ring and a completion
+ * ring shared with the kernel, with the actual requests in |uring_sqes|.
+ * The |user_data| of a request is its slot number, times 2 for an
+ * open and times 2 plus 1 for a read.
+ */
+static int uring_fd=-1;
+static unsigned *uring_sq_head, *uring_sq_tail, *uring_sq_mask, *uring_sq_array;
+static unsigned *uring_cq_head, *uring_cq_tail, *uring_cq_mask;
+static struct io_uring_sqe *uring_sqes;
+static struct io_uring_cqe *uring_cqes;
+static unsigned uring_to_submit;
+
+/* Set the rings up. Return 0 if we can't (old kernel, or something
+ * that forbids io_uring), in which case we'll do without.
+ */
+static int uring_init(unsigned entries) {
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t sq_size,cq_size,probe_size;
+  char *sq,*cq;
+  int ok;
+  memset(&p,0,sizeof(p));
+  uring_fd=(int)syscall(__NR_io_uring_setup,entries,&p);
+  if (uring_fd<0) return 0;
+  /* Make sure the kernel knows how to open files, not just read them. */
+  probe_size=sizeof(*probe)+256*sizeof(struct io_uring_probe_op);
+  probe=xmalloc(probe_size,"an io_uring probe");
+  memset(probe,0,probe_size);
+  ok=syscall(__NR_io_uring_register,uring_fd,IORING_REGISTER_PROBE,probe,256)>=0
+     && probe->last_op>=IORING_OP_OPENAT
+     && (probe->ops[IORING_OP_OPENAT].flags&IO_URING_OP_SUPPORTED)
+     && (probe->ops[IORING_OP_READ].flags&IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (!ok) { close(uring_fd); uring_fd=-1; return 0; }
+  sq_size=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  cq_size=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features&IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size>sq_size) sq_size=cq_size;
+    cq_size=sq_size;
+  }
+  sq=mmap(0,sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+          uring_fd,IORING_OFF_SQ_RING);
+  if (sq==MAP_FAILED) { close(uring_fd); uring_fd=-1; return 0; }
+  if (p.features&IORING_FEAT_SINGLE_MMAP) cq=sq;
+  else cq=mmap(0,cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+               uring_fd,IORING_OFF_CQ_RING);
+  uring_sqes=mmap(0,p.sq_entries*sizeof(struct io_uring_sqe),
+                  PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                  uring_fd,IORING_OFF_SQES);
+  if (cq==MAP_FAILED || uring_sqes==MAP_FAILED) {
+    close(uring_fd); uring_fd=-1; return 0; }
+  uring_sq_head=(unsigned *)(sq+p.sq_off.head);
+  uring_sq_tail=(unsigned *)(sq+p.sq_off.tail);
+  uring_sq_mask=(unsigned *)(sq+p.sq_off.ring_mask);
+  uring_sq_array=(unsigned *)(sq+p.sq_off.array);
+  uring_cq_head=(unsigned *)(cq+p.cq_off.head);
+  uring_cq_tail=(unsigned *)(cq+p.cq_off.tail);
+  uring_cq_mask=(unsigned *)(cq+p.cq_off.ring_mask);
+  uring_cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+  return 1;
+}
+
+/* Queue up a request; it doesn't go to the kernel until |uring_wait|.
+ * We never have more than two requests per slot outstanding, and the
+ * rings are bigger than that, so there's always room.
+ */
+static struct io_uring_sqe *uring_get_sqe(void) {
+  unsigned tail=*uring_sq_tail;
+  unsigned idx=tail&*uring_sq_mask;
+  struct io_uring_sqe *sqe=&uring_sqes[idx];
+  memset(sqe,0,sizeof(*sqe));
+  uring_sq_array[idx]=idx;
+  __atomic_store_n(uring_sq_tail,tail+1,__ATOMIC_RELEASE);
+  ++uring_to_submit;
+  return sqe;
+}
+
+static void uring_open(int slot, const char *name) {
+  struct io_uring_sqe *sqe=uring_get_sqe();
+  sqe->opcode=IORING_OP_OPENAT;
+  sqe->fd=AT_FDCWD;
+  sqe->addr=(unsigned long)name;
+  sqe->open_flags=O_RDONLY;
+  sqe->user_data=2*slot;
+}
+
+static void uring_read(int slot, int fd) {
+  struct io_uring_sqe *sqe=uring_get_sqe();
+  sqe->opcode=IORING_OP_READ;
+  sqe->fd=fd;
+  sqe->addr=(unsigned long)slots[slot].buf;
+  sqe->len=READ_BLOCK;
+  sqe->off=0;
+  sqe->user_data=2*slot+1;
+}
+
+/* Submit whatever's queued, wait for at least one thing to finish,
+ * and deal with everything that has. A finished open leads to a read;
+ * a finished read makes the slot ready. The read doesn't move the
+ * file position, so we do that by hand for whoever reads the rest.
+ */
+static void uring_wait(void) {
+  unsigned head,tail;
+  struct io_uring_cqe *cqe;
+  Slot *s;
+  int n;
+  n=(int)syscall(__NR_io_uring_enter,uring_fd,uring_to_submit,1,
+                 IORING_ENTER_GETEVENTS,0,0);
+  if (n<0 && errno!=EINTR) fatal("io_uring_enter failed");
+  if (n>0) uring_to_submit-=n;
+  head=*uring_cq_head;
+  tail=__atomic_load_n(uring_cq_tail,__ATOMIC_ACQUIRE);
+  while (head!=tail) {
+    cqe=&uring_cqes[head&*uring_cq_mask];
+    s=&slots[cqe->user_data>>1];
+    if (!(cqe->user_data&1)) {
+      if (cqe->res<0) s->state=s_failed;
+      else {
+        s->f=fdopen(cqe->res,"rb");
+        if (!s->f) { close(cqe->res); s->state=s_failed; }
+        else uring_read((int)(cqe->user_data>>1),cqe->res);
+      }
+    }
+    else {
+      s->len = cqe->res<0 ? 0 : (size_t)cqe->res;
+      fseek(s->f,(long)s->len,SEEK_SET);
+      s->state=s_ready;
+    }
+    ++head;
+  }
+  __atomic_store_n(uring_cq_head,head,__ATOMIC_RELEASE);
+}
+
+#endif
+
+/* Start on as many files as the window allows.
+ * (Not used by the read-ahead thread, which does this for itself.)
+ */
+static void ra_top_up(void) {
+#ifdef USE_IO_URING
+  Slot *s;
+  if (ra_method!=ra_uring) return;
+  while (next_to_start<n_input_files && next_to_start<next_to_use+n_slots) {
+    s=&slots[next_to_start%n_slots];
+    s->file=next_to_start; s->state=s_busy;
+    uring_open(next_to_start%n_slots,input_filenames[next_to_start]);
+    ++next_to_start;
+  }
+#endif
+}
+
+/* Get ready to go through the input files from the start.
+ */
+static void ra_begin(void) {
+  int i;
+  if (!slots) {
+    n_slots=read_ahead<1 ? 1 : read_ahead;
+    slots=xmalloc(n_slots*sizeof(Slot),"read-ahead slots");
+    for (i=0;i<n_slots;++i)
+      slots[i].buf=xmalloc(READ_BLOCK,"a read-ahead buffer");
+    ra_method=ra_sync;
+#ifdef USE_THREADS
+    if (n_slots>1) ra_method=ra_thread;
+#endif
+#ifdef USE_IO_URING
+    if (n_slots>1 && uring_init(4*n_slots)) ra_method=ra_uring;
+#endif
+  }
+  for (i=0;i<n_slots;++i) {
+    slots[i].file=-1; slots[i].state=s_free; slots[i].f=0;
+  }
+  next_to_start=next_to_use=0;
+#ifdef USE_THREADS
+  if (ra_method==ra_thread) {
+    ra_stopping=0;
+    if (pthread_create(&ra_thread_id,0,ra_thread_main,0)) ra_method=ra_sync;
+    return;
+  }
+#endif
+  ra_top_up();
+}
+
+/* Wait for file |i| (which is always the next one) to be opened and
+ * for its first block to arrive. Return its slot; the caller must
+ * give it back with |ra_release| when it's finished with it.
+ */
+static Slot *ra_get(int i) {
+  Slot *s=&slots[i%n_slots];
+  switch(ra_method) {
+#ifdef USE_THREADS
+    case ra_thread:
+      pthread_mutex_lock(&ra_lock);
+      while (s->file!=i || (s->state!=s_ready && s->state!=s_failed))
+        pthread_cond_wait(&ra_changed,&ra_lock);
+      pthread_mutex_unlock(&ra_lock);
+      break;
+#endif
+#ifdef USE_IO_URING
+    case ra_uring:
+      while (s->state!=s_ready && s->state!=s_failed) uring_wait();
+      break;
+#endif
+    default:
+      s->file=i; s->state=ra_fill_slot(s,i);
+  }
+  return s;
+}
+
+/* We've finished with this file; let its slot be used for another.
+ */
+static void ra_release(Slot *s) {
+  if (s->f) fclose(s->f);
+  s->f=0;
+#ifdef USE_THREADS
+  if (ra_method==ra_thread) {
+    pthread_mutex_lock(&ra_lock);
+    s->file=-1; s->state=s_free; ++next_to_use;
+    pthread_cond_broadcast(&ra_changed);
+    pthread_mutex_unlock(&ra_lock);
+    return;
+  }
+#endif
+  s->file=-1; s->state=s_free; ++next_to_use;
+  ra_top_up();
+}
+
+/* We've been through all the files.
+ */
+static void ra_end(void) {
+#ifdef USE_THREADS
+  if (ra_method==ra_thread) {
+    pthread_mutex_lock(&ra_lock);
+    ra_stopping=1;
+    pthread_cond_broadcast(&ra_changed);
+    pthread_mutex_unlock(&ra_lock);
+    pthread_join(ra_thread_id,0);
+  }
+#endif
+}
+
+
+/* ----------------------------- Decompression ----------------------------- */
+
+/* Rotated logs are usually compressed. Rather than have people decompress
+ * them into a pipe (which we would then have to copy into a temporary
+ * file, since we read everything twice), we recognise compressed files
+ * by their first few bytes and decompress them ourselves, on each pass.
+ * gzip needs zlib (compile with HAVE_ZLIB); zstd needs libzstd (compile
+ * with HAVE_ZSTD).
+ */
+enum { z_none=0, z_gzip=1, z_zstd=2 };
+
+static int compression_of(const unsigned char *p, size_t n) {
+  if (n>=2 && p[0]==0x1f && p[1]==0x8b) return z_gzip;
+  if (n>=4 && p[0]==0x28 && p[1]==0xb5 && p[2]==0x2f && p[3]==0xfd)
+    return z_zstd;
+  return z_none;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+#define DECOMPRESSION
+#endif
+
+#ifdef DECOMPRESSION
+
+/* Only one file is ever being decompressed at once, so the state
+ * can live here.
+ */
+static struct {
+  int kind;		/* z_gzip or z_zstd */
+  int clean;		/* nothing produced since the last stream ended? */
+  int failed;		/* did the data turn out to be bad? */
+  int ended;		/* have we stopped (at some trailing rubbish)? */
+#ifdef HAVE_ZLIB
+  z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zd;
+#endif
+} dec;
+
+/* Get ready to decompress a new file. Return 0 if we can't.
+ */
+static int dec_begin(int kind) {
+  dec.kind=kind; dec.clean=0; dec.failed=0; dec.ended=0;
+  switch(kind) {
+#ifdef HAVE_ZLIB
+    case z_gzip:
+      memset(&dec.z,0,sizeof(dec.z));
+      return inflateInit2(&dec.z,15+16)==Z_OK;
+#endif
+#ifdef HAVE_ZSTD
+    case z_zstd:
+      if (!dec.zd && !(dec.zd=ZSTD_createDStream())) return 0;
+      return !ZSTD_isError(ZSTD_initDStream(dec.zd));
+#endif
+  }
+  return 0;
+}
+
+/* Decompress some of the |len| bytes at |in|, starting at |*used|, into
+ * |out|, which holds |READ_BLOCK| bytes of which |*out_len| are already
+ * full. Update |*used| and |*out_len|.
+ * After one stream there may be another (from "cat a.gz b.gz"); anything
+ * else that turns up where a new stream should start is trailing rubbish,
+ * which gzip ignores too.
+ */
+static void dec_step(const unsigned char *in, size_t len, size_t *used,
+                     unsigned char *out, size_t *out_len) {
+  size_t before=*out_len;
+  int bad=0;
+  if (dec.failed || dec.ended) { *used=len; return; }
+#ifdef HAVE_ZLIB
+  if (dec.kind==z_gzip) {
+    int r;
+    dec.z.next_in=(Bytef *)(in+*used);
+    dec.z.avail_in=(uInt)(len-*used);
+    dec.z.next_out=out+*out_len;
+    dec.z.avail_out=(uInt)(READ_BLOCK-*out_len);
+    r=inflate(&dec.z,Z_NO_FLUSH);
+    *used=len-dec.z.avail_in;
+    *out_len=READ_BLOCK-dec.z.avail_out;
+    if (r==Z_STREAM_END) { inflateReset(&dec.z); dec.clean=1; return; }
+    bad=(r!=Z_OK && r!=Z_BUF_ERROR);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (dec.kind==z_zstd) {
+    ZSTD_inBuffer zi;
+    ZSTD_outBuffer zo;
+    size_t r;
+    zi.src=in; zi.size=len; zi.pos=*used;
+    zo.dst=out; zo.size=READ_BLOCK; zo.pos=*out_len;
+    r=ZSTD_decompressStream(dec.zd,&zo,&zi);
+    *used=zi.pos;
+    *out_len=zo.pos;
+    if (!ZSTD_isError(r) && !r) { dec.clean=1; return; }
+    bad=ZSTD_isError(r);
+  }
+#endif
+  if (bad) {
+    if (dec.clean) dec.ended=1; else dec.failed=1;
+    *used=len;
+  }
+  else if (*out_len>before) dec.clean=0;
+}
+
+/* We've come to the end of the compressed data.
+ * Return 0 if it was bad, or stopped in the middle of a stream.
+ */
+static int dec_end(void) {
+#ifdef HAVE_ZLIB
+  if (dec.kind==z_gzip) inflateEnd(&dec.z);
+#endif
+  return !dec.failed && dec.clean;
+}
+
+#endif
+
+
+#ifdef USE_THREADS
+
+/* ------------------------------- Pipeline ------------------------------- */
+
+/* With threads, reading the input is a pipeline: a reader thread takes
+ * each file in turn from the read-ahead slots and reads it block by block;
+ * a decoder thread decompresses the blocks that need it and passes the
+ * rest straight on; and the main loop lays out what comes out of the end.
+ * (And a writer thread, further along, deals with the main loop's output.)
+ * Blocks go along the pipeline through rings, and come back to be reused
+ * through more rings. Each stage only has so many blocks, so none of them
+ * can get too far ahead of the others.
+ */
+typedef struct Block {
+  int file;		/* which input file it came from */
+  int what;		/* see below */
+  int pool;		/* whose it is: p_reader or p_decoder */
+  size_t len;		/* how much of |data| is full */
+  unsigned char *data;	/* READ_BLOCK bytes */
+} Block;
+
+enum {
+  b_data,	/* some of the file */
+  b_undecoded,	/* the first bit of a file that we couldn't decompress */
+  b_end,	/* the end of the file */
+  b_bad,	/* the end of a file that didn't decompress properly */
+  b_failed,	/* a file that couldn't be opened */
+  b_spare,	/* nothing; just give it back */
+  b_done	/* no more files */
+};
+
+enum { p_reader, p_decoder };
+
+#define READER_BLOCKS 8
+#define DECODER_BLOCKS 4
+
+static Block reader_blocks[READER_BLOCKS], decoder_blocks[DECODER_BLOCKS];
+
+static Ring read_ring=NEW_RING;		/* reader -> decoder */
+static Ring decoded_ring=NEW_RING;	/* decoder -> main loop */
+static Ring reader_free=NEW_RING;	/* main loop -> reader */
+static Ring decoder_free=NEW_RING;	/* main loop -> decoder */
+
+static pthread_t reader_id, decoder_id;
+
+/* Go through the files, putting their contents into |read_ring|.
+ */
+static void *reader_main(void *arg) {
+  Slot *s;
+  Block *b;
+  int i;
+  arg=arg;	/* pacify compiler */
+  for (i=0;i<n_input_files;++i) {
+    s=ra_get(i);
+    b=ring_get(&reader_free);
+    b->file=i;
+    if (s->state==s_failed) {
+      b->what=b_failed; b->len=0;
+      ring_put(&read_ring,b);
+      ra_release(s);
+      continue;
+    }
+    b->what=b_data;
+    memcpy(b->data,s->buf,s->len); b->len=s->len;
+    while (b->len) {
+      ring_put(&read_ring,b);
+      b=ring_get(&reader_free);
+      b->file=i; b->what=b_data;
+      b->len=abandoned() ? 0 : fread(b->data,1,READ_BLOCK,s->f);
+    }
+    b->what=b_end;
+    ring_put(&read_ring,b);
+    ra_release(s);
+  }
+  b=ring_get(&reader_free);
+  b->what=b_done; b->len=0;
+  ring_put(&read_ring,b);
+  return 0;
+}
+
+/* Take blocks from |read_ring|; if they're compressed, decompress them
+ * into blocks of our own; pass everything on through |decoded_ring|.
+ * Compressed blocks we've finished with go that way too, so that the
+ * main loop is the only one giving blocks back to the reader.
+ * If a block of ours was filled right up, the decompressor may still be
+ * holding some output back, which it only hands over when asked again;
+ * so at the end of the file we keep asking, with no more input, until
+ * a block comes back with room to spare.
+ */
+static void *decoder_main(void *arg) {
+  Block *b;
+  int z=z_none;
+  int file=-1;
+#ifdef DECOMPRESSION
+  Block *o=0;
+  size_t used;
+  int full=0;		/* did the last block we sent fill up? */
+#endif
+  arg=arg;	/* pacify compiler */
+  for (;;) {
+    b=ring_get(&read_ring);
+    if (b->what==b_done) { ring_put(&decoded_ring,b); break; }
+    if (b->file!=file) {	/* first block of a file */
+      file=b->file;
+      z = b->what==b_data ? compression_of(b->data,b->len) : z_none;
+#ifdef DECOMPRESSION
+      full=0;
+#endif
+      if (z!=z_none) {
+#ifdef DECOMPRESSION
+        if (!dec_begin(z))
+#endif
+        { z=z_none; b->what=b_undecoded; }
+      }
+    }
+    if (z==z_none) { ring_put(&decoded_ring,b); continue; }
+#ifdef DECOMPRESSION
+    if (b->what==b_end) {
+      while (full && !o) {
+        o=ring_get(&decoder_free);
+        o->file=file; o->what=b_data; o->len=0;
+        used=0;
+        dec_step(b->data,0,&used,o->data,&o->len);
+        full=(o->len==READ_BLOCK);
+        if (full) { ring_put(&decoded_ring,o); o=0; }
+        else if (!o->len) o->what=b_spare;
+      }
+      if (o) { ring_put(&decoded_ring,o); o=0; }
+      if (!dec_end()) b->what=b_bad;
+      ring_put(&decoded_ring,b);
+      z=z_none;
+      continue;
+    }
+    used=0;
+    while (used<b->len) {
+      if (!o) {
+        o=ring_get(&decoder_free);
+        o->file=file; o->what=b_data; o->len=0;
+      }
+      dec_step(b->data,b->len,&used,o->data,&o->len);
+      full=(o->len==READ_BLOCK);
+      if (full) { ring_put(&decoded_ring,o); o=0; }
+    }
+    b->what=b_spare;
+    ring_put(&decoded_ring,b);
+#endif
+  }
+  return 0;
+}
+
+/* The main loop has finished with block |b|.
+ */
+static void give_back(Block *b) {
+  ring_put(b->pool==p_reader ? &reader_free : &decoder_free,b);
+}
+
+/* Get the next block of real interest from the pipeline.
+ */
+static Block *next_block(void) {
+  Block *b;
+  while ((b=ring_get(&decoded_ring))->what==b_spare) give_back(b);
+  return b;
+}
+
+/* Start the pipeline going for a pass through the files.
+ */
+static void pipeline_begin(void) {
+  int i;
+  static int initialised=0;
+  if (!initialised) {
+    for (i=0;i<READER_BLOCKS;++i) {
+      reader_blocks[i].pool=p_reader;
+      reader_blocks[i].data=xmalloc(READ_BLOCK,"an input block");
+    }
+    for (i=0;i<DECODER_BLOCKS;++i) {
+      decoder_blocks[i].pool=p_decoder;
+      decoder_blocks[i].data=xmalloc(READ_BLOCK,"a decompression block");
+    }
+    initialised=1;
+  }
+  ring_init(&read_ring); ring_init(&decoded_ring);
+  ring_init(&reader_free); ring_init(&decoder_free);
+  for (i=0;i<READER_BLOCKS;++i) ring_put(&reader_free,&reader_blocks[i]);
+  for (i=0;i<DECODER_BLOCKS;++i) ring_put(&decoder_free,&decoder_blocks[i]);
+  if (pthread_create(&reader_id,0,reader_main,0)
+      || pthread_create(&decoder_id,0,decoder_main,0))
+    fatal("I couldn't start the threads to read the input with");
+}
+
+/* Finish off a pass: wait for the end of the pipeline to come through.
+ */
+static void pipeline_end(void) {
+  Block *b;
+  while ((b=next_block())->what!=b_done) give_back(b);
+  give_back(b);
+  pthread_join(reader_id,0);
+  pthread_join(decoder_id,0);
+}
+
+#endif
+
+
+/* ------------------------------- Patterns ------------------------------- */
+
+/* Highlighting patterns are regular expressions of the usual sort:
+ * characters, ".", "[...]" and "[^...]", "\d", "\w", "\s", "*", "+",
+ * "?", "|" and parentheses, with "^" and "$" at the very start and end
+ * of a pattern meaning the start and end of a line. They're all
+ * compiled together into one NFA, which we turn into a DFA a state at a
+ * time as the input needs it. Each line is first run through a
+ * "floating" version of the DFA, which can start a match anywhere; most
+ * lines don't match at all, and for those that's all we do.
+ * Matches are leftmost-longest, and earlier patterns win ties.
+ */
+#define MAX_PATTERNS 32
+
+enum { n_set, n_split, n_eps, n_match };
+
+typedef struct Nstate {
+  int what;		/* see above */
+  int out,out1;		/* where to go next (|out1| only for n_split) */
+  int set;		/* for n_set: which character set */
+  int pattern;		/* for n_match: which pattern */
+} Nstate;
+
+static Nstate *nfa;
+static int n_nfa, nfa_size;
+static unsigned char (*char_sets)[32];
+static int n_char_sets, char_sets_size;
+static int nfa_start;	/* a split into all the patterns */
+
+static int pattern_style[MAX_PATTERNS];
+static unsigned long anchored_start, anchored_end;	/* bit per pattern */
+static int n_patterns;
+
+static int new_nstate(int what, int out, int out1) {
+  if (n_nfa>=nfa_size) {
+    nfa_size = nfa_size ? 2*nfa_size : 256;
+    nfa=realloc(nfa,nfa_size*sizeof(Nstate));
+    if (!nfa) fatal("Out of memory, compiling patterns");
+  }
+  nfa[n_nfa].what=what; nfa[n_nfa].out=out; nfa[n_nfa].out1=out1;
+  nfa[n_nfa].set=0; nfa[n_nfa].pattern=0;
+  return n_nfa++;
+}
+
+static unsigned char *new_char_set(void) {
+  if (n_char_sets>=char_sets_size) {
+    char_sets_size = char_sets_size ? 2*char_sets_size : 64;
+    char_sets=realloc(char_sets,char_sets_size*32);
+    if (!char_sets) fatal("Out of memory, compiling patterns");
+  }
+  memset(char_sets[n_char_sets],0,32);
+  return char_sets[n_char_sets++];
+}
+
+#define set_has(s,c) ((s)[(unsigned char)(c)>>3] & (1<<((c)&7)))
+#define set_add(s,c) ((s)[(unsigned char)(c)>>3] |= (1<<((c)&7)))
+
+/* A piece of NFA under construction: where it starts, and the n_eps
+ * state at its end whose |out| still needs filling in.
+ */
+typedef struct { int start, end; } Frag;
+
+static const char *pat;		/* what we're parsing */
+static const char *pat_whole;	/* all of it, for error messages */
+static int pat_bad;
+
+static Frag parse_alt(void);
+
+/* Add the class escape |c| (d, w or s) to |s|; return 0 if it isn't one.
+ */
+static int class_escape(unsigned char *s, int c) {
+  int i;
+  switch(c) {
+    case 'd': for (i='0';i<='9';++i) set_add(s,i); return 1;
+    case 's': set_add(s,' '); set_add(s,'\t'); set_add(s,'\r');
+              set_add(s,'\f'); set_add(s,'\v'); return 1;
+    case 'w': for (i=0;i<256;++i) if (isalnum(i) || i=='_') set_add(s,i);
+              return 1;
+  }
+  return 0;
+}
+
+static int plain_escape(int c) {
+  switch(c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+  }
+  return c;
+}
+
+static Frag parse_atom(void) {
+  Frag f;
+  unsigned char *s;
+  int c,d,i,negate=0;
+  if (*pat=='(') {
+    ++pat;
+    f=parse_alt();
+    if (*pat==')') ++pat; else pat_bad=1;
+    return f;
+  }
+  s=new_char_set();
+  f.start=new_nstate(n_set,0,0);
+  nfa[f.start].set=n_char_sets-1;
+  switch(c=(unsigned char)*pat++) {
+    case '.':
+      for (i=0;i<256;++i) if (i!='\n') set_add(s,i);
+      break;
+    case '\\':
+      if (!*pat) { pat_bad=1; break; }
+      c=(unsigned char)*pat++;
+      if (!class_escape(s,c)) set_add(s,plain_escape(c));
+      break;
+    case '[':
+      if (*pat=='^') { negate=1; ++pat; }
+      if (*pat==']') { set_add(s,']'); ++pat; }
+      while (*pat && *pat!=']') {
+        c=(unsigned char)*pat++;
+        if (c=='\\' && *pat) {
+          c=(unsigned char)*pat++;
+          if (class_escape(s,c)) continue;
+          c=plain_escape(c);
+        }
+        if (*pat=='-' && pat[1] && pat[1]!=']') {
+          d=(unsigned char)pat[1]; pat+=2;
+          if (d=='\\' && *pat) d=plain_escape((unsigned char)*pat++);
+          for (i=c;i<=d;++i) set_add(s,i);
+        }
+        else set_add(s,c);
+      }
+      if (*pat==']') ++pat; else pat_bad=1;
+      if (negate) for (i=0;i<32;++i) s[i]=~s[i];
+      break;
+    default:
+      set_add(s,c);
+  }
+  f.end=new_nstate(n_eps,-1,0);
+  nfa[f.start].out=f.end;
+  return f;
+}
+
+static Frag parse_repeat(void) {
+  Frag f=parse_atom(),g;
+  int s;
+  for (;;) {
+    switch(*pat) {
+      case '*':
+        g.end=new_nstate(n_eps,-1,0);
+        s=new_nstate(n_split,f.start,g.end);
+        nfa[f.end].out=s;
+        f.start=s; f.end=g.end;
+        break;
+      case '+':
+        g.end=new_nstate(n_eps,-1,0);
+        s=new_nstate(n_split,f.start,g.end);
+        nfa[f.end].out=s;
+        f.end=g.end;
+        break;
+      case '?':
+        s=new_nstate(n_split,f.start,f.end);
+        f.start=s;
+        break;
+      default:
+        return f;
+    }
+    ++pat;
+  }
+}
+
+static Frag parse_concat(void) {
+  Frag f,g;
+  f.start=f.end=new_nstate(n_eps,-1,0);
+  while (*pat && *pat!='|' && *pat!=')') {
+    if (*pat=='$' && !pat[1]) break;
+    g=parse_repeat();
+    nfa[f.end].out=g.start;
+    f.end=g.end;
+  }
+  return f;
+}
+
+static Frag parse_alt(void) {
+  Frag f=parse_concat(),g;
+  int e;
+  while (*pat=='|') {
+    ++pat;
+    g=parse_concat();
+    e=new_nstate(n_eps,-1,0);
+    f.start=new_nstate(n_split,f.start,g.start);
+    nfa[f.end].out=e; nfa[g.end].out=e;
+    f.end=e;
+  }
+  return f;
+}
+
+/* Add pattern |p|, whose matches should be shown in style |style|.
+ */
+static void add_pattern(const char *p, int style) {
+  Frag f;
+  int m;
+  if (n_patterns>=MAX_PATTERNS) {
+    error("Too many highlighting patterns: ignoring `%s'",p);
+    return;
+  }
+  pat=pat_whole=p; pat_bad=0;
+  if (*pat=='^') { anchored_start|=1UL<<n_patterns; ++pat; }
+  f=parse_alt();
+  if (*pat=='$') { anchored_end|=1UL<<n_patterns; ++pat; }
+  if (*pat || pat_bad) {
+    error("I can't make sense of the pattern `%s'",pat_whole);
+    return;
+  }
+  m=new_nstate(n_match,0,0);
+  nfa[m].pattern=n_patterns;
+  nfa[f.end].out=m;
+  nfa_start = n_patterns ? new_nstate(n_split,nfa_start,f.start) : f.start;
+  pattern_style[n_patterns++]=style;
+}
+
+
+/* The DFA. Each state is a set of NFA states of type n_set or n_match;
+ * its transitions are worked out when they're first needed. State 0 is
+ * the dead state, from which there is no escape.
+ */
+#define DFA_MAX 4096	/* start again if we get more states than this */
+
+typedef struct Dstate {
+  int *nstates, n;
+  unsigned long accepts;	/* bit per pattern */
+  int next[256];		/* -1 if we don't know yet */
+} Dstate;
+
+typedef struct Dfa {
+  int floating;		/* can a match start anywhere? */
+  Dstate *states;
+  int n_states;
+  int start;
+  int resets;		/* how often we've had to start again */
+} Dfa;
+
+static Dfa dfa_anchored, dfa_floating;
+
+static int *closure_mark, closure_gen;
+static int *dfa_list;		/* room for a list of all the NFA states */
+
+/* Add NFA state |i|, and everything reachable from it without reading
+ * a character, to the list |l| (of length |*n|).
+ */
+static void closure(int i, int *l, int *n) {
+  while (i>=0 && closure_mark[i]!=closure_gen) {
+    closure_mark[i]=closure_gen;
+    switch(nfa[i].what) {
+      case n_split: closure(nfa[i].out1,l,n); i=nfa[i].out; break;
+      case n_eps: i=nfa[i].out; break;
+      default: l[(*n)++]=i; return;
+    }
+  }
+}
+
+static int cmp_int(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/* Find (or make) the DFA state for the |n| NFA states in |l|.
+ */
+static int dfa_state(Dfa *d, int *l, int n) {
+  int i;
+  Dstate *s;
+  qsort(l,n,sizeof(int),cmp_int);
+  for (i=0;i<d->n_states;++i)
+    if (d->states[i].n==n && !memcmp(d->states[i].nstates,l,n*sizeof(int)))
+      return i;
+  s=&d->states[d->n_states];
+  s->nstates=xmalloc((n?n:1)*sizeof(int),"a DFA state");
+  memcpy(s->nstates,l,n*sizeof(int));
+  s->n=n; s->accepts=0;
+  for (i=0;i<n;++i)
+    if (nfa[l[i]].what==n_match) s->accepts|=1UL<<nfa[l[i]].pattern;
+  for (i=0;i<256;++i) s->next[i]=-1;
+  return d->n_states++;
+}
+
+/* Forget all the states of |d| and start again.
+ */
+static void dfa_reset(Dfa *d) {
+  int i,n=0;
+  int *l=xmalloc((n_nfa+1)*sizeof(int),"a DFA state");
+  if (!d->states) d->states=xmalloc(DFA_MAX*sizeof(Dstate),"a DFA");
+  for (i=0;i<d->n_states;++i) free(d->states[i].nstates);
+  d->n_states=0; ++d->resets;
+  dfa_state(d,l,0);	/* the dead state */
+  ++closure_gen; closure(nfa_start,l,&n);
+  d->start=dfa_state(d,l,n);
+  free(l);
+}
+
+/* Work out where state |s| goes on reading |c|.
+ */
+static int dfa_next(Dfa *d, int s, int c) {
+  int *l=dfa_list;
+  int i,j,n=0;
+  Dstate *st;
+  if (d->n_states>=DFA_MAX) {
+    /* Keep only the state we're in. */
+    n=d->states[s].n;
+    memcpy(l,d->states[s].nstates,n*sizeof(int));
+    dfa_reset(d);
+    s=dfa_state(d,l,n);
+    n=0;
+  }
+  st=&d->states[s];
+  ++closure_gen;
+  for (i=0;i<st->n;++i) {
+    j=st->nstates[i];
+    if (nfa[j].what==n_set && set_has(char_sets[nfa[j].set],c))
+      closure(nfa[j].out,l,&n);
+  }
+  if (d->floating && c!='\n') closure(nfa_start,l,&n);
+  i=dfa_state(d,l,n);
+  d->states[s].next[c]=i;
+  return i;
+}
+
+#define dfa_step(d,s,c) \
+  ((d)->states[s].next[c]>=0 ? (d)->states[s].next[c] : dfa_next(d,s,c))
+
+/* Get the patterns ready to use.
+ */
+static void compile_patterns(void) {
+  closure_mark=xmalloc(n_nfa*sizeof(int),"the NFA");
+  memset(closure_mark,0,n_nfa*sizeof(int));
+  dfa_list=xmalloc((n_nfa+1)*sizeof(int),"a DFA state");
+  dfa_floating.floating=1;
+  dfa_reset(&dfa_anchored);
+  dfa_reset(&dfa_floating);
+}
+
+static void forget_dfa(Dfa *d) {
+  int i;
+  for (i=0;i<d->n_states;++i) free(d->states[i].nstates);
+  free(d->states);
+  d->states=0; d->n_states=0;
+}
+
+/* The document is finished: forget the patterns, since the next one
+ * may have others.
+ */
+static void forget_patterns(void) {
+  forget_dfa(&dfa_anchored); forget_dfa(&dfa_floating);
+  free(nfa); free(char_sets); free(closure_mark); free(dfa_list);
+  nfa=0; char_sets=0; closure_mark=0; dfa_list=0;
+  n_nfa=nfa_size=n_char_sets=char_sets_size=0;
+  n_patterns=0; anchored_start=anchored_end=0;
+}
+
+
+/* The matches in one line.
+ */
+typedef struct Span {
+  size_t start, end;
+  int style;
+} Span;
+
+static Span *spans;
+static int n_spans, spans_size;
+
+/* Trying the anchored DFA from each place in turn could take time
+ * proportional to the square of the length of the line: if a pattern
+ * like "a.*b" finds no "b", each "a" reads on to the end. But two tries
+ * that are in the same state at the same place will do the same from
+ * there on, so each try notes, for each place it passes, its state there
+ * and where its longest match ended (if that's further on); a later try
+ * that finds itself in the same state can stop and use that. The try at
+ * the very start of the line is left out, since it's the only one that
+ * "^" patterns can match. |memo_gen| says which entries are for this
+ * line, and for the DFA as it is now.
+ */
+typedef struct Memo {
+  unsigned gen;
+  int state;
+  size_t end;		/* or 0 */
+  int best;
+} Memo;
+
+static Memo *memo;
+static size_t memo_size;
+static unsigned memo_gen;
+
+static void add_span(size_t start, size_t end, int style) {
+  if (n_spans>=spans_size) {
+    spans_size = spans_size ? 2*spans_size : 16;
+    spans=realloc(spans,spans_size*sizeof(Span));
+    if (!spans) fatal("Out of memory, highlighting");
+  }
+  spans[n_spans].start=start; spans[n_spans].end=end;
+  spans[n_spans++].style=style;
+}
+
+/* Find all the matches in the |n| characters at |s|, putting them in
+ * |spans|.
+ */
+static void find_spans(const unsigned char *s, size_t n) {
+  Dfa *d=&dfa_floating;
+  size_t i,j,k,end;
+  int st,best,resets;
+  unsigned long a;
+  Memo *m;
+  n_spans=0;
+  if (!n_patterns) return;
+  /* Is there anything here at all? */
+  st=d->start;
+  for (i=0;i<n && !d->states[st].accepts;++i) st=dfa_step(d,st,s[i]);
+  if (!d->states[st].accepts) return;
+  /* Yes: find the matches. */
+  if (n>=memo_size) {
+    free(memo);
+    memo_size=n+1;
+    memo=xmalloc(memo_size*sizeof(Memo),"the highlighting memo");
+    memset(memo,0,memo_size*sizeof(Memo));
+  }
+  d=&dfa_anchored;
+  ++memo_gen; resets=d->resets;
+  for (i=0;i<n;) {
+    st=d->start; end=0; best=0;
+    for (j=i;j<n;) {
+      st=dfa_step(d,st,s[j]);
+      if (d->resets!=resets) { ++memo_gen; resets=d->resets; }
+      if (!st) break;
+      ++j;
+      a=d->states[st].accepts;
+      if (i) a&=~anchored_start;
+      if (j<n) a&=~anchored_end;
+      if (a) {
+        end=j;
+        for (best=0;!(a&1);a>>=1) ++best;
+      }
+      if (!i) continue;
+      m=&memo[j];
+      if (m->gen==memo_gen && m->state==st) {
+        if (m->end) { end=m->end; best=m->best; }
+        break;
+      }
+      m->gen=memo_gen; m->state=st;
+    }
+    for (k=i+1;k<=j && k<=n;++k) {
+      m=&memo[k];
+      if (m->gen!=memo_gen) continue;
+      if (end>k) { m->end=end; m->best=best; }
+      else m->end=0;
+    }
+    if (!end) { ++i; continue; }
+    add_span(i,end,pattern_style[best]);
+    i=end;
+  }
+}
+
+
+/* ---------------------------- Reading a file ---------------------------- */
+
+/* The main loop reads characters with |in_getc()|, which is just like
+ * |getc| except that it takes them from the current block. With threads,
+ * that's whatever came out of the pipeline; without, it's the current
+ * file's slot, or the decompressed data from it. When the block runs out,
+ * |in_fill| gets another one. |in_ungetc| can only put back the character
+ * just read, which is all anyone wants to do anyway.
+ */
+static unsigned char *in_buf;
+static size_t in_pos, in_len;
+static int in_file;		/* which file we're reading */
+static int in_bad;		/* did it fail to decompress properly? */
+
+#define in_getc() (in_pos<in_len ? in_buf[in_pos++] : in_fill())
+#define in_ungetc(c) (--in_pos)
+
+#ifdef USE_THREADS
+
+static Block *in_block;		/* or 0 at the end of the file */
+
+/* Get the next block of the file into |in_buf|. Return 0 if there
+ * isn't one.
+ */
+static int in_next_block(void) {
+  Block *b;
+  in_pos=in_len=0;
+  if (!in_block) return 0;
+  give_back(in_block);
+  b=next_block();
+  if (b->what!=b_data) {
+    in_bad=(b->what==b_bad);
+    give_back(b);
+    in_block=0;
+    return 0;
+  }
+  in_block=b; in_buf=b->data; in_len=b->len;
+  return 1;
+}
+
+/* Start reading input file |i|. Return 0 if we can't.
+ */
+static int in_start(int i) {
+  Block *b=next_block();
+  in_file=i; in_bad=0; in_pos=in_len=0; in_block=0;
+  if (b->file!=i) fatal("Gareth screwed up: file %d != %d",b->file,i);
+  switch(b->what) {
+    case b_failed:
+      give_back(b);
+      return 0;
+    case b_undecoded:
+      error("`%s' looks compressed, but I can't decompress it",
+            input_filenames[i]);
+      /* fall through */
+    case b_data:
+      in_block=b; in_buf=b->data; in_len=b->len;
+      return 1;
+  }
+  in_bad=(b->what==b_bad);	/* empty file */
+  give_back(b);
+  return 1;
+}
+
+#else
+
+static Slot *in_slot;
+
+#ifdef DECOMPRESSION
+static int in_decompressing;
+static size_t in_slot_used;	/* how much of the slot's block we've used */
+static unsigned char *in_dec_buf;
+#endif
+
+static int in_next_block(void) {
+  in_pos=in_len=0;
+  if (!in_slot || !in_slot->f) return 0;
+#ifdef DECOMPRESSION
+  if (in_decompressing) {
+    while (in_len<READ_BLOCK && !dec.failed && !dec.ended) {
+      if (in_slot_used>=in_slot->len) {
+        in_slot->len=fread(in_slot->buf,1,READ_BLOCK,in_slot->f);
+        in_slot_used=0;
+        if (!in_slot->len) {
+          /* The decompressor may still be holding some output back
+           * (see |decoder_main|): ask once more, with no more input. */
+          size_t before=in_len;
+          dec_step(in_slot->buf,0,&in_slot_used,in_dec_buf,&in_len);
+          if (in_len==before) break;
+          continue;
+        }
+      }
+      dec_step(in_slot->buf,in_slot->len,&in_slot_used,in_dec_buf,&in_len);
+    }
+    in_buf=in_dec_buf;
+    return in_len>0;
+  }
+#endif
+  in_slot->len=fread(in_slot->buf,1,READ_BLOCK,in_slot->f);
+  in_buf=in_slot->buf; in_len=in_slot->len;
+  return in_len>0;
 }
 
-/* Emit the rest of the prologue.
+/* Start reading input file |i|. Return 0 if we can't.
+ * If it's compressed, what we read is what comes out of the
+ * decompressor.
  */
-static void prologue_end(void) {
-  printf("%%%%EndProlog\n\n");
-  if (show_n_pages)
-    printf("(Output from 3COL, user %s, total %d pages...\n) print flush\n",
-           user_name,n_pages);
-  else
-    printf("(Output from 3COL, user %s...\n) print flush\n",user_name);
-  printf("\n%%%%Page: 1 1\n");
-  printf("save\n");
+static int in_start(int i) {
+  int z;
+  in_file=i; in_bad=0;
+  in_slot=ra_get(i);
+  in_buf=in_slot->buf; in_len=0; in_pos=0;
+  if (in_slot->state==s_failed) return 0;
+  in_len=in_slot->len;
+  z=compression_of(in_buf,in_len);
+  if (z!=z_none) {
+#ifdef DECOMPRESSION
+    if (dec_begin(z)) {
+      if (!in_dec_buf) in_dec_buf=xmalloc(READ_BLOCK,"a decompression buffer");
+      in_decompressing=1; in_slot_used=0; in_len=0;
+      return 1;
+    }
+#endif
+    error("`%s' looks compressed, but I can't decompress it",
+          input_filenames[i]);
+  }
+  return 1;
 }
 
+#endif
 
-/* -------------------------- Putting it together -------------------------- */
+/* With |utf_8|, each block is decoded into |utf_buf| before anyone else
+ * sees it, one byte per character, so that everything after this can go
+ * on counting bytes as columns. A character split between two blocks is
+ * kept in |utf_carry| until the next. Most blocks of most files are all
+ * ASCII, though, and those we can use just as they are.
+ */
+static unsigned char utf_buf[READ_BLOCK+4];
+static unsigned char utf_carry[4];
+static int utf_n_carry;
 
-/* Output the whole prologue.
+/* How many of the |n| bytes at |p| are ASCII before the first that isn't?
  */
-static void emit_prologue(void) {
-  prologue_DSC();
-  prologue_procset();
-  prologue_end();
+static size_t ascii_run(const unsigned char *p, size_t n) {
+  size_t i=0;
+#ifdef __SSE2__
+  int m;
+  for (;i+16<=n;i+=16) {
+    m=_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p+i)));
+    if (m) return i+__builtin_ctz(m);
+  }
+#else
+  unsigned long w;
+  for (;i+sizeof(w)<=n;i+=sizeof(w)) {
+    memcpy(&w,p+i,sizeof(w));
+    if (w & ((unsigned long)-1/255*128)) break;
+  }
+#endif
+  while (i<n && p[i]<128) ++i;
+  return i;
 }
 
+/* Decode the character at |p| (of which there are |n| bytes) into |*u|,
+ * and return how many bytes it took; or 0 if it goes beyond |n|. A byte
+ * that isn't the start of a proper UTF-8 sequence is taken to be
+ * ISO-Latin-1 all by itself, so that old files still come out right.
+ */
+static int utf_char(const unsigned char *p, size_t n, unsigned long *u) {
+  int c=p[0], len, i;
+  *u=c;
+  if (c<0xC2 || c>0xF4) return 1;
+  len = c<0xE0 ? 2 : c<0xF0 ? 3 : 4;
+  for (i=1;i<len;++i) {
+    if ((size_t)i>=n) return 0;
+    if ((p[i]&0xC0)!=0x80) return 1;
+  }
+  if ((c==0xE0 && p[1]<0xA0) || (c==0xED && p[1]>=0xA0)
+      || (c==0xF0 && p[1]<0x90) || (c==0xF4 && p[1]>=0x90)) return 1;
+  *u=c&(0x7F>>len);
+  for (i=1;i<len;++i) *u=(*u<<6)|(p[i]&0x3F);
+  return len;
+}
 
-/* ============================= The trailer ============================= */
+/* Characters outside ISO-Latin-1 that the encoding in |prologue_findfont|
+ * has room for anyway, and where.
+ */
+static const struct { unsigned long u; unsigned char c; } utf_extras[] = {
+  { 0x0131,   3 }, { 0x0152, 154 }, { 0x0153, 155 }, { 0x0174, 129 },
+  { 0x0175, 130 }, { 0x0176, 133 }, { 0x0177, 134 }, { 0x02C6,   1 },
+  { 0x02DC,   2 }, { 0x2013, 151 }, { 0x2014, 152 }, { 0x2018, 144 },
+  { 0x2019, 145 }, { 0x201C, 148 }, { 0x201D, 149 }, { 0x201E, 150 },
+  { 0x2020, 156 }, { 0x2021, 157 }, { 0x2022, 143 }, { 0x2026, 140 },
+  { 0x2030, 142 }, { 0x2039, 146 }, { 0x203A, 147 }, { 0x2122, 141 },
+  { 0x2212, 153 }, { 0xFB01, 158 }, { 0xFB02, 159 }
+};
 
-/*****************************************************************************
-**                                                                          **
-**  The following sections are concerned with the PostScript trailer that   **
-**  goes at the end of the output file.                                     **
-**                                                                          **
-*****************************************************************************/
+/* Put character |u| at |out|, as best we can, and return where the next
+ * goes. Things that take up no room at all, like combining accents and
+ * byte-order marks, are left out; anything else we can't show is "?".
+ */
+static unsigned char *utf_put(unsigned char *out, unsigned long u) {
+  int lo=0, hi=sizeof(utf_extras)/sizeof(utf_extras[0]), m;
+  if (u<0x80 || (u>=0xA0 && u<0x100)) { *out++=(unsigned char)u; return out; }
+  if ((u>=0x300 && u<0x370) || (u>=0x200B && u<0x2010) || u==0xFEFF)
+    return out;
+  while (lo<hi) {
+    m=(lo+hi)/2;
+    if (utf_extras[m].u==u) { *out++=utf_extras[m].c; return out; }
+    if (utf_extras[m].u<u) lo=m+1; else hi=m;
+  }
+  *out++='?';
+  return out;
+}
 
-/* Emit the trailer.
+/* Decode the block in |in_buf|, if it needs it.
  */
-static void emit_trailer(void) {
-  printf("\n%%%%Trailer\n");
-  if (!show_n_pages) printf("%%%%Pages: %d\n",n_pages);
-  printf("(done.\n) print flush\n");
-  printf("%%%%EOF\n");
+static void utf_decode(void) {
+  const unsigned char *p=in_buf;
+  unsigned char *out=utf_buf;
+  unsigned long u;
+  size_t n=in_len, k;
+  int r;
+  if (!utf_n_carry && ascii_run(p,n)==n) return;
+  for (;;) {
+    while (utf_n_carry && (r=utf_char(utf_carry,utf_n_carry,&u))!=0) {
+      out=utf_put(out,u);
+      utf_n_carry-=r;
+      memmove(utf_carry,utf_carry+r,utf_n_carry);
+    }
+    if (!utf_n_carry || !n) break;
+    utf_carry[utf_n_carry++]=*p++; --n;
+  }
+  while (n) {
+    k=ascii_run(p,n);
+    memcpy(out,p,k); out+=k; p+=k; n-=k;
+    if (!n) break;
+    if (!(r=utf_char(p,n,&u))) {
+      memcpy(utf_carry,p,n); utf_n_carry=(int)n;
+      break;
+    }
+    out=utf_put(out,u); p+=r; n-=r;
+  }
+  in_buf=utf_buf; in_len=out-utf_buf;
+}
+
+/* Get the next block of the file, decoded if need be. Return 0 if
+ * there isn't one, or if nobody wants any more output. A block can
+ * decode to nothing at all (a byte-order mark, say, or the start of a
+ * character that goes on into the next block), so we keep going until
+ * there's something to read.
+ */
+static int in_more(void) {
+  if (abandoned()) return 0;
+  if (!utf_8) return in_next_block();
+  do {
+    if (!in_next_block()) {
+      if (!utf_n_carry) return 0;
+      /* The file ended in the middle of a character. */
+      utf_buf[0]='?';
+      in_buf=utf_buf; in_len=1; in_pos=0;
+      utf_n_carry=0;
+      return 1;
+    }
+    utf_decode();
+  } while (!in_len);
+  return 1;
+}
+
+/* With highlighting, there's another layer in between: we gather each
+ * line from the blocks into |hl_line|, find the matches in it, and the
+ * main loop reads from that instead. Where a match starts or ends,
+ * |in_getc()| returns |HL_EVENT| rather than a character, and |in_hl|
+ * says what the highlighting should now be. (Not in the middle of a
+ * mark-up directive, though: |in_suspend()| holds the events back until
+ * |in_resume()|.) Very long lines are treated in pieces of |HL_MAX|.
+ */
+#define HL_EVENT 256
+#define HL_MAX 65536
+
+static int hl_on;		/* are we doing it at all? */
+static unsigned char *hl_line;
+static size_t hl_len, hl_size;
+static size_t hl_text;		/* how much of it is before the newline */
+static unsigned char *raw_buf;	/* the block we're gathering lines from */
+static size_t raw_pos, raw_len;
+static int hl_span;		/* the next span to start or finish */
+static int hl_count;		/* how many spans we've started */
+static int hl_changed;		/* has |in_hl| changed since we last said? */
+static int hl_suspended;
+
+static int in_hl;		/* the current span's number, or 0 */
+static int in_hl_style;		/* its style */
+
+#define in_suspend() (hl_suspended=1)
+#define in_resume() (hl_suspended=0, hl_on ? (void)(in_len=in_pos) : (void)0)
+
+/* Start on a new file.
+ */
+static void hl_begin(void) {
+  raw_buf=in_buf; raw_pos=0; raw_len=in_len;
+  if (!hl_line) {
+    hl_size=1024;
+    hl_line=xmalloc(hl_size,"the highlighting buffer");
+  }
+  in_buf=hl_line; in_pos=in_len=hl_len=0;
+  n_spans=hl_span=0;
+  in_hl=0; hl_changed=0;
+}
+
+/* Gather the next line into |hl_line|, and find the matches in it.
+ * Return 0 at the end of the file.
+ */
+static int hl_read_line(void) {
+  unsigned char *p;
+  size_t k;
+  if (n_spans || in_hl) hl_changed=1;	/* make sure it's all tidied up */
+  in_hl=0; hl_len=0; hl_span=0; n_spans=0;
+  for (;;) {
+    if (raw_pos>=raw_len) {
+      if (!in_more()) break;
+      raw_buf=in_buf; raw_pos=0; raw_len=in_len;
+      in_buf=hl_line;
+      continue;		/* it might have been empty */
+    }
+    p=memchr(raw_buf+raw_pos,'\n',raw_len-raw_pos);
+    k = p ? (size_t)(p-raw_buf)+1-raw_pos : raw_len-raw_pos;
+    if (hl_len+k>HL_MAX) { k=HL_MAX-hl_len; p=0; }
+    if (hl_len+k>hl_size) {
+      while (hl_len+k>hl_size) hl_size*=2;
+      hl_line=realloc(hl_line,hl_size);
+      if (!hl_line) fatal("Out of memory, reading a long line");
+    }
+    memcpy(hl_line+hl_len,raw_buf+raw_pos,k);
+    hl_len+=k; raw_pos+=k;
+    if (p || hl_len==HL_MAX) break;
+  }
+  in_buf=hl_line;
+  if (!hl_len) return 0;
+  hl_text = hl_line[hl_len-1]=='\n' ? hl_len-1 : hl_len;
+  find_spans(hl_line,hl_text);
+  return 1;
+}
+
+/* Bring |in_hl| up to date for position |pos| in the line, and return
+ * the position of the next thing that will change it. A match that
+ * goes up to the end of the line lasts until after the newline.
+ */
+static size_t hl_update(size_t pos) {
+  Span *sp;
+  size_t end;
+  while (hl_span<n_spans) {
+    sp=&spans[hl_span];
+    if (in_hl) {
+      end = sp->end==hl_text ? hl_len : sp->end;
+      if (end>pos) return end;
+      in_hl=0; hl_changed=1; ++hl_span;
+      continue;
+    }
+    if (sp->start>pos) return sp->start;
+    if (sp->end<=pos) { ++hl_span; continue; }	/* missed it */
+    in_hl=++hl_count; in_hl_style=sp->style;
+    hl_changed=1;
+  }
+  return hl_len;
+}
+
+/* How many columns the rest of the current span, from where we've got
+ * to in the line, will take if it starts in column |col|.
+ */
+static int hl_columns(int col) {
+  size_t i,end;
+  int c0=col;
+  if (!hl_on || !in_hl || hl_span>=n_spans) return 0;
+  end=spans[hl_span].end;
+  for (i=in_pos;i<end;++i)
+    col = hl_line[i]=='\t' ? col+tab_width-col%tab_width : col+1;
+  return col-c0;
+}
+
+static int hl_fill(void) {
+  if (in_pos>=hl_len) {
+    hl_update(hl_len);
+    if (hl_changed && !hl_suspended) { hl_changed=0; return HL_EVENT; }
+    if (!hl_read_line()) { in_pos=in_len=0; return EOF; }
+    in_pos=0;
+  }
+  in_len=hl_update(in_pos);
+  if (hl_changed && !hl_suspended) { hl_changed=0; return HL_EVENT; }
+  return in_buf[in_pos++];
+}
+
+static int in_fill(void) {
+  if (hl_on) return hl_fill();
+  do if (!in_more()) return EOF; while (in_pos>=in_len);
+  return in_buf[in_pos++];
+}
+
+/* Start reading input file |i|. Return 0 if we can't.
+ */
+static int in_open(int i) {
+  if (!in_start(i)) return 0;
+  if (utf_8) { utf_n_carry=0; utf_decode(); }
+  if (hl_on) hl_begin();
+  return 1;
+}
+
+/* Finish with the current input file.
+ */
+static void in_close(void) {
+#ifdef USE_THREADS
+  while (in_block) in_next_block();	/* in case we stopped early */
+#else
+# ifdef DECOMPRESSION
+  if (in_decompressing) {
+    in_decompressing=0;
+    in_bad=!dec_end();
+  }
+# endif
+  if (in_slot) ra_release(in_slot);
+  in_slot=0;
+#endif
+  in_len=in_pos=0;
+  if (in_bad && !abandoned())
+    error("Something went wrong decompressing `%s'",input_filenames[in_file]);
+}
+
+/* Get ready to go through the input files from the start.
+ */
+static void in_begin(void) {
+  Highlight *h;
+  if (highlights && !nfa) {
+    for (h=highlights;h;h=h->next) add_pattern(h->pattern,h->style);
+    if (n_patterns) compile_patterns();
+  }
+  hl_on=(n_patterns>0);
+  ra_begin();
+#ifdef USE_THREADS
+  pipeline_begin();
+#endif
+}
+
+/* We've been through all the files.
+ */
+static void in_end(void) {
+#ifdef USE_THREADS
+  pipeline_end();
+#endif
+  ra_end();
+}
+
+/* Read a line (or as much of it as will fit) into |buf|, like |fgets|.
+ */
+static char *in_gets(char *buf, int n) {
+  int c=0,i=0;
+  while (i<n-1 && (c=in_getc())!=EOF) {
+    buf[i++]=(char)c;
+    if (c=='\n') break;
+  }
+  if (!i) return 0;
+  buf[i]=0;
+  return buf;
 }
 
 
@@ -1362,11 +4489,14 @@ static void emit_trailer(void) {
 static void newpage(void) {
   line_num=0; col_num=1; ++page_num;
   if (for_real) {
-    if (page_num>1)
-      printf("restore showpage\n\n%%%%Page: %d %d\nsave ",page_num,page_num);
-    if (show_n_pages) printf("(%d of %d) newpage\n",page_num,n_pages);
-    else printf("(%d of \?\?) newpage\n",page_num);
-    printf("col1 F%d\n",output_font);
+    if (page_num>1) {
+      out_printf("restore showpage\n\n");
+      begin_page(page_num," ");
+    }
+    if (show_n_pages) out_printf("(%d of %d) newpage\n",page_num,n_pages);
+    else out_printf("(%d of \?\?) newpage\n",page_num);
+    out_printf("col1 F%d\n",output_font);
+    pv_end_page(); pv_begin_page(page_num); pv_col(1);
   }
 }
 
@@ -1376,7 +4506,7 @@ static void newpage(void) {
 static void newcol(void) {
   if (col_num>=n_columns) { newpage(); return; }
   line_num=0; col_num++;
-  if (for_real) printf("col%d\n",col_num);
+  if (for_real) { out_printf("col%d\n",col_num); pv_col(col_num); }
 }
 
 /* Send the contents of |current_line| to the output file.
@@ -1386,28 +4516,48 @@ static void newcol(void) {
  *   if 2, that we should start a new line and mark it as overrun.
  */
 static void flush_line(int why) {
+  char s[32];
+  int n=next_char-current_line;
   *next_char=0;
-  if (for_real && *current_line) {
-    putchar('(');
-    emit_string(current_line);
-    putchar(')'); putchar(' ');
+  if (*current_line) {
+    if (for_real) emit_line_string(current_line,underlining);
+    else if (share_strings) count_string(current_line);
+    if (pv_cur) {
+      pv_show(current_line,n,char_width,font_size,output_font);
+      if (underlining) {
+        pv_move(-n*char_width,0);
+        while (n--) pv_show("_",1,char_width,font_size,output_font);
+      }
+    }
   }
   next_char=current_line;
   switch(why) {
     case 0:
-      if (for_real && *current_line) printf("s%s\n",underlining?"hu":"");
+      if (for_real && *current_line) out_printf("s%s\n",underlining?"hu":"");
       break;
     case 1:
-      if (for_real) printf(*current_line ? "l%s\n" : "nl%s\n",
+      if (for_real) out_printf(*current_line ? "l%s\n" : "nl%s\n",
                            underlining?"u":"");
+      pv_lines(1);
       if (for_real && show_line_numbers && line_number_interval
-          && !(input_line_num%line_number_interval))
-        printf("(%d ) lnum\n",input_line_num);
+          && !(input_line_num%line_number_interval)) {
+        out_printf("(%d ) lnum\n",input_line_num);
+        if (pv_cur) {
+          n=sprintf(s,"%d ",input_line_num);
+          pv_move(-n*line_number_font_size*.6,line_spacing);
+          pv_show(s,n,line_number_font_size*.6,line_number_font_size,
+                  pv_style(line_number_font));
+          pv_xym();
+        }
+      }
       current_pos=0; if (++line_num>=lines_per_col) newcol();
       break;
     case 2:
-      if (for_real) printf(*current_line ? "l%s bar\n" : "nl%s bar\n",
+      if (for_real) out_printf(*current_line ? "l%s bar\n" : "nl%s bar\n",
                            underlining?"u":"");
+      pv_lines(1);
+      pv_rect(pv_x-2.2,pv_y+line_spacing*.5,.4,line_spacing,0);
+      pv_rect(pv_x-3.2,pv_y+line_spacing*.5,.4,line_spacing,0);
       current_pos=0; if (++line_num>=lines_per_col) newcol();
       break;
   }
@@ -1416,6 +4566,64 @@ static void flush_line(int why) {
 
 /* ------------------------- Various useful things ------------------------- */
 
+/* Make sure there are at least |n| lines left in this column,
+ * unless |n| is more than the number of lines per column (in
+ * which case, just start a new column anyway).
+ * When this happens, we have always just done a |flush_line|.
+ */
+static void ensure_lines(int n) {
+  if (line_num+n>lines_per_col) newcol();
+}
+
+/* The highlighting we're actually showing (the number of the span, as
+ * for |in_hl|), and how things were before it started.
+ */
+static int hl_shown;
+static int hl_old_font, hl_old_underlining;
+
+/* Shade the next |left| columns, or as many of them as are on this
+ * line.
+ */
+static void hl_box(int left) {
+  int n=chars_per_line-current_pos;
+  if (left<n) n=left;
+  if (n>0) {
+    out_printf("%d hl ",n);
+    pv_rect(pv_cx,pv_cy-line_spacing*.25,n*char_width,line_spacing,
+            highlight_grey);
+  }
+}
+
+/* We've been told that the highlighting may have changed: make what
+ * we're showing match |in_hl|.
+ */
+static void highlight(void) {
+  int old_font=output_font;
+  if (hl_shown==in_hl) return;
+  flush_line(0);
+  if (hl_shown) { output_font=hl_old_font; underlining=hl_old_underlining; }
+  else { hl_old_font=output_font; hl_old_underlining=underlining; }
+  if (in_hl) {
+    if (in_hl_style&hl_bold) output_font|=1;
+    if (in_hl_style&hl_italic) output_font|=2;
+    if (in_hl_style&hl_underline) underlining=1;
+  }
+  if (for_real) {
+    if (output_font!=old_font) out_printf("F%d ",output_font);
+    if (in_hl && (in_hl_style&hl_grey)) hl_box(hl_columns(current_pos));
+  }
+  hl_shown=in_hl;
+}
+
+/* A line has just overrun onto the next one, where the character just
+ * read will take the first |n| columns: if it's in the middle of a grey
+ * span, the rest of the span needs shading there too.
+ */
+static void highlight_overrun(int n) {
+  if (for_real && hl_shown && hl_shown==in_hl && (in_hl_style&hl_grey))
+    hl_box(n+hl_columns(n));
+}
+
 /* We just read a tab character. Insert the right number of spaces
  * into the output buffer, doing the right thing if we overrun.
  * NB that underlined tabs that overrun are only underlined as of
@@ -1423,25 +4631,22 @@ static void flush_line(int why) {
  */
 static void do_tab(void) {
   int n=current_pos+tab_width-(current_pos%tab_width);
-  if (n>chars_per_line) { n-=chars_per_line; flush_line(2); }
+  if (n>chars_per_line) {
+    n-=chars_per_line; flush_line(2); highlight_overrun(n);
+  }
   n-=current_pos;
   while (n-->0) { *next_char++=' '; ++current_pos; }
 }
 
-/* Make sure there are at least |n| lines left in this column,
- * unless |n| is more than the number of lines per column (in
- * which case, just start a new column anyway).
- * When this happens, we have always just done a |flush_line|.
- */
-static void ensure_lines(int n) {
-  if (line_num+n>lines_per_col) newcol();
-}
-
 /* Skip over |n| lines (i.e., fill them with blanks).
  */
 static void skip_lines(int n) {
   while (line_num+n>lines_per_col) { newcol(); n-=lines_per_col; }
-  if (for_real) printf("/y y %lg sub def xym\n",n*line_spacing);
+  if (for_real) {
+    if (old_procset) out_printf("/y y %lg sub def xym\n",n*line_spacing);
+    else out_printf("%lg dn\n",n*line_spacing);
+  }
+  pv_lines(n);
   line_num+=n;
 }
 
@@ -1457,19 +4662,19 @@ static char *read_string(void) {
   char *s;
   int n=0;
   int l=256;
-  while ((c=getc(input_file))!=EOF && isspace(c)) {
-    if (c=='\n') { ungetc(c,input_file); return copy_string(""); }
+  while ((c=in_getc())!=EOF && isspace(c)) {
+    if (c=='\n') { in_ungetc(c); return copy_string(""); }
   }
   s=xmalloc(257,"a string");
   s[n++]=c;
-  while ((c=getc(input_file))!=EOF && !isspace(c)) {
+  while ((c=in_getc())!=EOF && !isspace(c)) {
     if (n>=l) {
       s=realloc(s,(l<<=1)+1);
       if (!s) fatal("Out of memory, expanding a string");
     }
     s[n++]=c;
   }
-  if (c=='\n') ungetc(c,input_file);
+  if (c=='\n') in_ungetc(c);
   s[n]=0;
   return s;
 }
@@ -1482,14 +4687,14 @@ static double read_double(void) {
   int n=0;
   double x;
   char *cp;
-  while ((c=getc(input_file))!=EOF && isspace(c)) {
-    if (c=='\n') { ungetc(c,input_file); return 0; }
+  while ((c=in_getc())!=EOF && isspace(c)) {
+    if (c=='\n') { in_ungetc(c); return 0; }
   }
   s[n++]=c;
-  while ((c=getc(input_file))!=EOF && !isspace(c)) {
+  while ((c=in_getc())!=EOF && !isspace(c)) {
     if (n<255) s[n++]=c;
   }
-  if (c=='\n') ungetc(c,input_file);
+  if (c=='\n') in_ungetc(c);
   s[n]=0;
   x=strtod(s,&cp);
   if (*cp) {
@@ -1507,14 +4712,14 @@ static int read_int(void) {
   int n=0;
   int x;
   char *cp;
-  while ((c=getc(input_file))!=EOF && isspace(c)) {
-    if (c=='\n') { ungetc(c,input_file); return 0; }
+  while ((c=in_getc())!=EOF && isspace(c)) {
+    if (c=='\n') { in_ungetc(c); return 0; }
   }
   s[n++]=c;
-  while ((c=getc(input_file))!=EOF && !isspace(c)) {
+  while ((c=in_getc())!=EOF && !isspace(c)) {
     if (n<255) s[n++]=c;
   }
-  if (c=='\n') ungetc(c,input_file);
+  if (c=='\n') in_ungetc(c);
   s[n]=0;
   x=(int)strtol(s,&cp,10);
   if (*cp) {
@@ -1548,18 +4753,24 @@ static int read_int(void) {
  *     reserved for it (and a new column is begun if there aren't
  *     that many already). Be careful. NB lines longer than 254 chars
  *     may cause confusion here.
+ *   %E <n> <file> includes the EPS file <file>, scaled to fit into
+ *     the width of the column and <n> lines, which are reserved for it
+ *     just as for %P. If it turns up more than once, and we make two
+ *     passes, it only goes into the output once.
  *   %x, for any other character x, produces undefined results, which
  *     may include destroying your computer.
  * Case is significant.
  */
 static void do_markup(char c) {
-  double p,q;
+  double p,q,r;
+  char t[256];
+  int n=0;
   int i,j;
   int x0=0,x1=chars_per_line;
   char *s;
   switch(c) {
-    case 'B': output_font^=1; if (for_real) printf("F%d ",output_font); break;
-    case 'I': output_font^=2; if (for_real) printf("F%d ",output_font); break;
+    case 'B': output_font^=1; if (for_real) out_printf("F%d ",output_font); break;
+    case 'I': output_font^=2; if (for_real) out_printf("F%d ",output_font); break;
     case 'U': underlining=!underlining; break;
     case 'N': ensure_lines(read_int()); break;
     case 'H':
@@ -1567,9 +4778,11 @@ static void do_markup(char c) {
       if (for_real) {
         if (p<0) p=0; else if (p>chars_per_line) p=chars_per_line;
         if (q<0) q=0; else if (q>chars_per_line) q=chars_per_line;
-        printf("gsave %lg slw 0 sg ",read_double());
-        printf("np xym %lg %lg rmoveto ",p*char_width,font_size/2);
-        printf("%lg 0 rlineto st grestore\n",(q-p)*char_width); }
+        out_printf("gsave %lg slw 0 sg ",r=read_double());
+        out_printf("%sxym %lg %lg rmoveto ",old_procset?"np ":"",
+                   p*char_width,font_size/2);
+        out_printf("%lg 0 rlineto st grestore\n",(q-p)*char_width);
+        pv_rect(pv_x+p*char_width,pv_y+font_size/2-r/2,(q-p)*char_width,r,0); }
       else (void)read_double();
       break;
     case 't': case 'r': case 'c':
@@ -1577,42 +4790,62 @@ static void do_markup(char c) {
     case 'T': case 'R': case 'C':
       if (current_pos) flush_line(1);
       s=read_string(); p=read_double(); i=read_int();
-      while ((j=getc(input_file))!=EOF && j!='\n') ;
+      while ((j=in_getc())!=EOF && j!='\n') ;
       ensure_lines(i);
       skip_lines(i-1);
       if (for_real) {
-        if (x0) printf("%lg 0 rmoveto\n",x0*char_width);
-        printf("/%s ff %lg scalefont setfont\n(",s,p);
-        while ((j=getc(input_file))!=EOF && j!='\n') {
-          if (j=='(' || j==')' || j=='\\') putchar('\\');
-          putchar(j);
+        if (x0) out_printf("%lg 0 rmoveto\n",x0*char_width);
+        out_printf("/%s ff %lg scalefont setfont\n(",s,p);
+        while ((j=in_getc())!=EOF && j!='\n') {
+          if (j=='(' || j==')' || j=='\\') out_putc('\\');
+          out_putc(j);
+          if (n<256) t[n++]=(char)j;
         }
         switch(c) {
-          case 'T': case 't': printf(") s\n"); break;
-          case 'R': case 'r': printf(") dup sw pop %lg exch sub 0 rmoveto s\n",
-                           (x1-x0)*char_width); break;
-          case 'C': case 'c': printf(") dup sw pop 2 div %lg exch sub 0 rmoveto s\n",
-                           (x1-x0)*char_width/2); break;
+          case 'T': case 't': out_printf(") s\n"); break;
+          case 'R': case 'r': out_printf(") dup sw pop %lg exch sub 0 rmoveto s\n",
+                           (x1-x0)*char_width);
+            pv_move((x1-x0)*char_width-n*p*.6,0); break;
+          case 'C': case 'c': out_printf(") dup sw pop 2 div %lg exch sub 0 rmoveto s\n",
+                           (x1-x0)*char_width/2);
+            pv_move(((x1-x0)*char_width-n*p*.6)/2,0); break;
         }
+        pv_move(x0*char_width,0);
+        pv_show(t,n,p*.6,p,pv_style(s));
       }
       else
-        while ((j=getc(input_file))!=EOF && j!='\n') ;
+        while ((j=in_getc())!=EOF && j!='\n') ;
       if (i) skip_lines(1);
-      if (for_real) printf("F%d\n",output_font);
+      if (for_real) out_printf("F%d\n",output_font);
       free(s);
       break;
     case 'P': {
       char buf[256];
       i=read_int();
       ensure_lines(i);
-      if (for_real) printf("gsave %% EMBEDDED OBJECT BEGINS\n");
-      while ((j=getc(input_file))!=EOF && j!='\n') ;
-      while (fgets(buf,256,input_file)) {
+      if (for_real) out_printf("gsave %% EMBEDDED OBJECT BEGINS\n");
+      while ((j=in_getc())!=EOF && j!='\n') ;
+      while (in_gets(buf,256)) {
         if (!buf[1]) break;
-        if (for_real) printf("%s",buf);
+        if (for_real) out_printf("%s",buf);
+      }
+      if (for_real) out_printf("grestore %% EMBEDDED OBJECT ENDS\n");
+      if (i) skip_lines(i);
+      break; }
+    case 'E': {
+      Picture *pic;
+      i=read_int(); s=read_string();
+      while ((j=in_getc())!=EOF && j!='\n') ;
+      ensure_lines(i);
+      if ((pic=find_picture(s))!=0) {
+        if (for_real) {
+          emit_picture(pic,i<1 ? 1 : i);
+          pv_picture(pic,i<1 ? 1 : i);
+        }
+        else ++pic->count;
       }
-      if (for_real) printf("grestore %% EMBEDDED OBJECT ENDS\n");
       if (i) skip_lines(i);
+      free(s);
       break; }
     default:
       error("Unknown mark-up directive: %%%c",c);
@@ -1626,12 +4859,15 @@ static void do_markup(char c) {
 static void process_files(void) {
   int i;
   int c;
+  char *s;
   page_num=0; current_pos=0; next_char=current_line;
+  in_begin();
   newpage();
-  for (i=0;i<n_input_files;++i) {
+  for (i=0;i<n_input_files && !abandoned();++i) {
     output_font=0;
     underlining=0;
-    if (for_real) printf("F0\n");
+    hl_shown=0;
+    if (for_real) out_printf("F0\n");
     if (i) {
       switch(new_file_action) {
         case ignore: break;
@@ -1643,27 +4879,33 @@ static void process_files(void) {
     if (n_input_files>1 && new_file_title) {
       ensure_lines(file_name_skip_lines);
       if (for_real) {
-        printf("fn setfont (");
-        if (input_filenames[i]==tempfile_name) emit_string("<stdin>");
-        else emit_string(input_filenames[i]);
-        printf(") show xym F%d\n",output_font);
+        out_printf("fn setfont (");
+        s=input_filenames[i]==tempfile_name ? "<stdin>" : input_filenames[i];
+        emit_string(s);
+        out_printf(") show xym F%d\n",output_font);
+        pv_show(s,strlen(s),file_name_font_size*.6,file_name_font_size,
+                pv_style(file_name_font));
+        pv_xym();
       }
       skip_lines(file_name_skip_lines);
     }
-    input_file=fopen(input_filenames[i],"r");
-    if (!input_file) {
+    if (!in_open(i)) {
       error("I couldn't open the file `%s'",input_filenames[i]);
+      in_close();
       continue;
     }
     input_line_num=0;
-    while ((c=getc(input_file))!=EOF) {
+    while ((c=in_getc())!=EOF) {
       switch(c) {
         case '\n': ++input_line_num; flush_line(1); break;
         case '\t': do_tab(); break;
         case '\b':
           if (current_pos) {
             flush_line(0);
-            if (for_real) { printf("del "); --current_pos; }
+            if (for_real) {
+              out_printf("del "); --current_pos;
+              pv_move(-char_width,0);
+            }
           }
           else error("\\b at start of line -- ignoring it");
           break;
@@ -1676,61 +4918,493 @@ static void process_files(void) {
           break;
         case '\r':
           flush_line(1);
-          if (for_real)
-            printf("/y y %lg add def xym\n",line_spacing);
+          if (for_real) {
+            if (old_procset) out_printf("/y y %lg add def xym\n",line_spacing);
+            else out_printf("0 %lg rmoveto\n",line_spacing);
+          }
+          pv_lines(-1);
           --line_num;
           break;
+        case HL_EVENT: highlight(); break;
         case '%':
           if (!mark_up) goto def;
-          c=getc(input_file);
+          in_suspend();
+          c=in_getc();
           if (c==EOF) {
+            in_resume();
             error("Markup character at end of file");
             c='%'; goto def; }
-          if (c=='%') goto def;
+          if (c=='%') { in_resume(); goto def; }
           flush_line(0);
           do_markup(c);
+          in_resume();
           break;
         default:
 def:      if (current_pos>=chars_per_line) {
             if (truncating) {
               flush_line(1);
-              if (for_real) printf("rbar\n");
-              while ((c=getc(input_file))!=EOF && c!='\n') ;
+              if (for_real) out_printf("rbar\n");
+              pv_rect(pv_x+col_text_width+1.6,pv_y,.8,line_spacing,0);
+              while ((c=in_getc())!=EOF && c!='\n') ;
               break; }
-            else flush_line(2);
+            else { flush_line(2); highlight_overrun(1); }
           }
           *next_char++=c; ++current_pos;
       }
     }
     flush_line(0);
+    in_close();
   }
-  if (for_real) printf("restore showpage\n");
+  in_end();
+  if (for_real) out_printf("restore showpage\n");
+  pv_end_page();
 }
 
 
 /* ============================== At the end ============================== */
 
-/* Do whatever is necessary before we die.
+/* Do whatever is necessary before we die; or, as a library, before the
+ * next document.
  */
 static void tidy_up(void) {
   if (tempfile_name) remove(tempfile_name);
+  forget_shared();
+  forget_pictures();
+  forget_patterns();
 }
 
 
 /* =========================== The main program =========================== */
 
-int main(int argc, char *argv[]) {
-  do_config_files();
-  do_command_line(argc,argv);
-  grok_things();
-  if (show_n_pages) {
+/* ----------------------------- One document ----------------------------- */
+
+/* Make a document out of the input files, writing it to stdout.
+ */
+static void make_document(void) {
+  if (show_n_pages || share_strings) {
     for_real=0; process_files();
     n_pages=page_num;
-    fprintf(stderr,"%d page%s in total.\n",n_pages,n_pages>1?"s":"");
+    if (show_n_pages)
+      fprintf(stderr,"%d page%s in total.\n",n_pages,n_pages>1?"s":"");
+    if (share_strings) number_strings();
+    number_pictures();
   }
+  out_begin();
   emit_prologue();
+  pv_begin();
   for_real=1; process_files();
+  pv_end();
   emit_trailer();
+  out_end();
   tidy_up();
+}
+
+
+/* -------------------------------- Batches -------------------------------- */
+
+/* With -batch <manifest>, we make lots of documents in one go. Each line
+ * of the manifest has three fields separated by tabs:
+ *   <output file> <options> <input files>
+ * where the options and input files are separated by spaces, just as on
+ * the command line. (There may be no options, but the tabs must still be
+ * there.) Blank lines and lines starting with "#" are ignored. Options on
+ * our own command line apply to all the documents.
+ *
+ * Nearly all our state is in global variables, so a document can only be
+ * made by a process of its own; but starting 3col afresh for each one is
+ * slow, and we don't have to. Having read the config files once, we take
+ * the documents with the same options together, and for each such group
+ * fork a process which obeys the options and works out the dimensions;
+ * that forks a process for each document, and they just have to read
+ * their input and write their output.
+ * At most |batch_jobs| documents are made at once, whichever groups they
+ * are in, so that a manifest where every document has options of its own
+ * (a title, say) goes as fast as any other. To start a document a group
+ * must first take a byte out of the pipe |job_tokens|, which starts with
+ * |batch_jobs| bytes in it, and it puts the byte back when the document
+ * is finished. There are never more than |batch_jobs| groups at once
+ * either, since a group can't do anything without a byte.
+ * (We don't share any of the prologue between documents, only the
+ * dimensions: the procset has each document's title and date in it, and
+ * the rest of it takes next to no time to write.)
+ */
+#if defined(USE_FORK) && !defined(THREECOL_LIBRARY)
+
+typedef struct Job {
+  int line;		/* in the manifest */
+  char *output;
+  char *options;
+  char *inputs;
+} Job;
+
+static int job_tokens[2];	/* a pipe; see above */
+#define MAX_BATCH_JOBS 512
+
+/* Split |s| into words, separated by spaces, putting them in |words|
+ * (which has room for |n|) after the |first| that are there already.
+ * Return how many there are now, or -1 if there are too many.
+ */
+static int split_words(char *s, char **words, int first, int n) {
+  while (*s) {
+    while (*s==' ') *s++=0;
+    if (!*s) break;
+    if (first>=n) return -1;
+    words[first++]=s;
+    while (*s && *s!=' ') ++s;
+  }
+  return first;
+}
+
+/* Read the manifest into an array of Jobs, and return how many there
+ * are.
+ */
+static int read_manifest(Job **jobs) {
+  FILE *f=fopen(batch_file,"r");
+  char *l,*t,*e;
+  int n=0, size=256;
+  Job *j;
+  if (!f) fatal("I couldn't open the manifest `%s'",batch_file);
+  *jobs=xmalloc(size*sizeof(Job),"the manifest");
+  config_file_name=batch_file; config_line_no=0;
+  while ((l=get_line(f))!=0) {
+    for (e=l+strlen(l); e>l && isspace(e[-1]); --e) ;
+    *e=0;
+    if (!*l || *l=='#') continue;
+    if (!(t=strchr(l,'\t')) || !(e=strchr(t+1,'\t'))) {
+      config_err("I expected <output>, <options> and <inputs>, "
+                 "separated by tabs");
+      err_status=1;
+      continue;
+    }
+    if (n>=size) {
+      *jobs=realloc(*jobs,(size*=2)*sizeof(Job));
+      if (!*jobs) fatal("Out of memory, reading the manifest");
+    }
+    *t++=0; *e++=0;
+    j=&(*jobs)[n++];
+    j->line=config_line_no;
+    j->output=copy_string(l);
+    j->options=copy_string(t);
+    j->inputs=copy_string(e);
+  }
+  fclose(f);
+  config_file_name="<unknown>";
+  return n;
+}
+
+/* Jobs with the same options go together; otherwise, they stay in the
+ * order they were in.
+ */
+static int job_order(const void *a, const void *b) {
+  const Job *x=a, *y=b;
+  int c=strcmp(x->options,y->options);
+  return c ? c : x->line-y->line;
+}
+
+/* In a process of its own: make the document for |j|.
+ */
+static void do_job(Job *j) {
+  int n=strlen(j->inputs)/2+1;
+  input_filenames=xmalloc(n*sizeof(char *),"input filenames");
+  n_input_files=split_words(j->inputs,input_filenames,0,n);
+  if (n_input_files<=0) {
+    fprintf(stderr,"%s (line %d): no input files.\n",batch_file,j->line);
+    exit(1);
+  }
+  if (!freopen(j->output,"wb",stdout)) {
+    error("I couldn't write to `%s'",j->output);
+    exit(1);
+  }
+  /* We write in big blocks anyway, so there's no point copying them. */
+  setvbuf(stdout,0,_IONBF,0);
+  tempfile_name=0; err_status=0;
+  grok_document();
+  make_document();
+  exit(err_status);
+}
+
+/* Wait for one of the |n| processes in |pids| to finish, and see how
+ * it got on. Return which one it was.
+ */
+static int wait_job(pid_t *pids, Job **running, int n) {
+  int status, i;
+  pid_t p;
+  for (;;) {
+    p=waitpid(-1,&status,0);
+    if (p<0) fatal("Gareth screwed up waiting for a document");
+    for (i=0;i<n;++i) if (pids[i]==p) break;
+    if (i<n) break;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    error("There were problems making `%s' (line %d of `%s')",
+          running[i]->output,running[i]->line,batch_file);
+  }
+  return i;
+}
+
+/* Take a byte out of |job_tokens|, and return 1; or, if there's none
+ * there and |n_running| of our own documents are being made, return 0,
+ * and the caller will wait for one of those and use its byte. (Waiting
+ * for a byte while we had our own would be a bad idea: everyone else
+ * might be doing the same.)
+ */
+static int take_token(int n_running) {
+  struct pollfd p;
+  char c;
+  for (;;) {
+    if (read(job_tokens[0],&c,1)==1) return 1;
+    if (errno!=EAGAIN && errno!=EINTR)
+      fatal("Gareth screwed up counting the documents being made");
+    if (n_running) return 0;
+    p.fd=job_tokens[0]; p.events=POLLIN;
+    poll(&p,1,-1);
+  }
+}
+
+/* Put a byte back in |job_tokens|.
+ */
+static void give_token(void) {
+  while (write(job_tokens[1],"",1)!=1)
+    if (errno!=EINTR)
+      fatal("Gareth screwed up counting the documents being made");
+}
+
+/* In a process of its own: make the documents for the |n| jobs in |jobs|,
+ * which all have the same options.
+ */
+static void do_group(Job *jobs, int n) {
+  char **args;
+  pid_t *pids;
+  Job **running;
+  int n_args=strlen(jobs->options)/2+2;
+  int i, k, n_running=0;
+  args=xmalloc(n_args*sizeof(char *),"some options");
+  args[0]="3col"; err_status=0;
+  n_args=split_words(copy_string(jobs->options),args,1,n_args);
+  n_input_files=0;
+  do_command_line(n_args,args);
+  if (n_input_files) error("Ignoring input files among the options on "
+                           "line %d of `%s'",jobs->line,batch_file);
+  grok_dimensions();
+  pids=xmalloc(batch_jobs*sizeof(pid_t),"a list of processes");
+  running=xmalloc(batch_jobs*sizeof(Job *),"a list of processes");
+  for (i=0;i<n;++i) {
+    if (take_token(n_running)) k=n_running++;
+    else k=wait_job(pids,running,n_running);
+    running[k]=&jobs[i];
+    if ((pids[k]=fork())<0) fatal("I couldn't start a process to make `%s'",
+                                  jobs[i].output);
+    if (!pids[k]) do_job(&jobs[i]);
+  }
+  while (n_running) {
+    k=wait_job(pids,running,n_running);
+    pids[k]=pids[--n_running]; running[k]=running[n_running];
+    give_token();
+  }
+  exit(err_status);
+}
+
+/* Wait for any one of our groups to finish.
+ */
+static void wait_group(void) {
+  int status;
+  if (waitpid(-1,&status,0)<0)
+    fatal("Gareth screwed up waiting for some documents");
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) err_status=1;
+}
+
+/* Make all the documents in the manifest.
+ */
+static void do_batch(void) {
+  Job *jobs;
+  int n=read_manifest(&jobs);
+  int i, j, n_groups=0;
+  pid_t p;
+  if (n_input_files) error("Ignoring input files on the command line, "
+                           "since there's a manifest");
+  if (batch_jobs<1) {
+    long k=sysconf(_SC_NPROCESSORS_ONLN);
+    batch_jobs = k<1 ? 1 : (int)k;
+  }
+  /* The bytes must all fit in the pipe at once. */
+  if (batch_jobs>MAX_BATCH_JOBS) batch_jobs=MAX_BATCH_JOBS;
+  if (pipe(job_tokens)<0 || fcntl(job_tokens[0],F_SETFL,O_NONBLOCK)<0)
+    fatal("I couldn't make a pipe to keep count of documents with");
+  for (i=0;i<batch_jobs;++i) give_token();
+  qsort(jobs,n,sizeof(Job),job_order);
+  for (i=0;i<n;i=j) {
+    for (j=i+1;j<n && !strcmp(jobs[j].options,jobs[i].options);++j) ;
+    if (n_groups==batch_jobs) { wait_group(); --n_groups; }
+    if ((p=fork())<0) fatal("I couldn't start a process to make documents");
+    if (!p) do_group(jobs+i,j-i);
+    ++n_groups;
+  }
+  while (n_groups--) wait_group();
+}
+
+#elif !defined(THREECOL_LIBRARY)
+
+static void do_batch(void) {
+  fatal("This 3col can't do batches: it was compiled without USE_FORK");
+}
+
+#endif
+
+
+/* ------------------------------ As a library ------------------------------ */
+
+/* Compiled with -DTHREECOL_LIBRARY, 3col has no |main|; instead, another
+ * program can get a document out of it one piece at a time through the
+ * functions in "3col.h", and stop whenever it likes. The layout happens
+ * on a thread of its own, which is suspended between pieces (see
+ * |out_piece|), so it never gets ahead of what has been asked for.
+ * Our state is all in global variables, so there can only be one
+ * document at a time; but when it's closed, another can be opened.
+ * Buffers, the read-ahead slots and so on are kept for it; the patterns,
+ * pictures and repeated strings are thrown away by |tidy_up|; and the
+ * settings below, which the config files, the command line and the
+ * making of a document all change, are put back as they were before
+ * the first one.
+ */
+#ifdef THREECOL_LIBRARY
+
+static pthread_t lib_thread_id;
+static int lib_opened, lib_started;
+
+#define Setting(v) { &(v), sizeof(v) }
+static const struct { void *place; size_t size; } lib_settings[] = {
+  Setting(paper_descs), Setting(paper_desc), Setting(font_descs),
+  Setting(font_desc), Setting(mgap), Setting(cgap), Setting(font_size),
+  Setting(leading), Setting(title_height), Setting(title_grey),
+  Setting(title_rule), Setting(title_font), Setting(divider_width),
+  Setting(divider_grey), Setting(ff_behaviour), Setting(show_page_numbers),
+  Setting(show_n_pages), Setting(mark_up), Setting(truncating),
+  Setting(highlights), Setting(highlight_grey), Setting(share_strings),
+  Setting(strict_DSC), Setting(old_procset), Setting(preview_file),
+  Setting(preview_dpi), Setting(preview_png), Setting(show_line_numbers),
+  Setting(line_number_interval), Setting(line_number_continuously),
+  Setting(line_number_font), Setting(line_number_font_size),
+  Setting(new_file_action), Setting(new_file_title),
+  Setting(file_name_font), Setting(file_name_font_size),
+  Setting(file_name_skip_lines), Setting(read_ahead), Setting(tab_width),
+  Setting(n_columns), Setting(latinise), Setting(utf_8),
+  Setting(show_date), Setting(date_font), Setting(date_font_size),
+  Setting(title), Setting(batch_file), Setting(batch_jobs),
+  Setting(date_format), Setting(n_pages), Setting(err_status),
+  Setting(n_input_files), Setting(tempfile_name)
+};
+#define N_SETTINGS (sizeof(lib_settings)/sizeof(lib_settings[0]))
+
+static char *lib_defaults;	/* what they all were to start with */
+
+/* Put the settings back as they were before the first document (or,
+ * before it, note what they are).
+ */
+static void lib_reset(void) {
+  size_t i,n=0;
+  char *p;
+  Highlight *h;
+  if (!lib_defaults) {
+    for (i=0;i<N_SETTINGS;++i) n+=lib_settings[i].size;
+    lib_defaults=xmalloc(n,"the default settings");
+    for (i=0,p=lib_defaults;i<N_SETTINGS;p+=lib_settings[i++].size)
+      memcpy(p,lib_settings[i].place,lib_settings[i].size);
+    return;
+  }
+  while ((h=highlights)!=0) {
+    highlights=h->next;
+    free(h->pattern); free(h);
+  }
+  for (i=0,p=lib_defaults;i<N_SETTINGS;p+=lib_settings[i++].size)
+    memcpy(lib_settings[i].place,p,lib_settings[i].size);
+  free(input_filenames); input_filenames=0;
+  free(current_line); current_line=0;
+}
+
+static void *lib_main(void *arg) {
+  arg=arg;	/* pacify compiler */
+  make_document();
+  pthread_mutex_lock(&lib_lock);
+  lib_state=l_done;
+  pthread_cond_broadcast(&lib_changed);
+  pthread_mutex_unlock(&lib_lock);
+  return 0;
+}
+
+/* Get ready to make a document, given arguments just like the command
+ * line's. Return 0 if we can't.
+ */
+int threecol_open(int argc, char *argv[]) {
+  if (lib_opened) {
+    error("3col can only make one document at a time");
+    return 0;
+  }
+  lib_opened=1;
+  lib_reset();
+  lib_abandoned=0;
+  do_config_files();
+  do_command_line(argc,argv);
+  if (batch_file) {
+    error("3col can't make a batch of documents as a library");
+    lib_opened=0;
+    return 0;
+  }
+  grok_things();
+  lib_state=l_idle;
+  return 1;
+}
+
+/* Lay out the next piece of the document, and point |*text| at it
+ * and |*len| at its length. Return its number, or -1 if there are no
+ * more.
+ */
+int threecol_next(const char **text, size_t *len) {
+  int n=-1;
+  pthread_mutex_lock(&lib_lock);
+  switch(lib_state) {
+    case l_idle:
+      lib_state=l_working; lib_started=1;
+      if (pthread_create(&lib_thread_id,0,lib_main,0))
+        fatal("I couldn't start the thread to lay out the document with");
+      break;
+    case l_ready:
+      lib_state=l_working;
+      pthread_cond_broadcast(&lib_changed);
+      break;
+  }
+  while (lib_state==l_working) pthread_cond_wait(&lib_changed,&lib_lock);
+  if (lib_state==l_ready) {
+    *text=out_cur->data; *len=out_cur->len; n=lib_piece;
+  }
+  pthread_mutex_unlock(&lib_lock);
+  return n;
+}
+
+/* Finish with the document, whether or not we've had all of it.
+ * Return non-0 if anything went wrong.
+ */
+int threecol_close(void) {
+  pthread_mutex_lock(&lib_lock);
+  __atomic_store_n(&lib_abandoned,1,__ATOMIC_RELEASE);
+  pthread_cond_broadcast(&lib_changed);
+  pthread_mutex_unlock(&lib_lock);
+  if (lib_started) pthread_join(lib_thread_id,0);
+  else tidy_up();
+  lib_state=l_done; lib_started=lib_opened=0;
+  return err_status;
+}
+
+#else
+
+/* ---------------------------- The main program ---------------------------- */
+
+int main(int argc, char *argv[]) {
+  do_config_files();
+  do_command_line(argc,argv);
+  if (batch_file) { do_batch(); return err_status; }
+  grok_things();
+  make_document();
   return err_status;
 }
+
+#endif
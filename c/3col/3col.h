@@ -0,0 +1,54 @@
+/* 3col.h
+ * (c) 1995 Gareth McCaughan
+ * You may distribute this file freely, as long as it remains unchanged.
+ * If you want to do anything else with it, e-mail gjm11@pmms.cam.ac.uk.
+ *
+ * For using 3col from another program, when it has been compiled with
+ * -DTHREECOL_LIBRARY (which needs -DUSE_THREADS too): see "make lib3col.a".
+ *
+ * Rather than writing the whole document to stdout, 3col then hands it
+ * over a piece at a time, as the program asks for them. Piece 0 is the
+ * prologue, pieces 1 to n are the pages, and piece n+1 is the trailer;
+ * put together in that order they are exactly what 3col itself would
+ * have written. Nothing is laid out until it is asked for, so a program
+ * that only wants the first few pages of something huge can have them
+ * quickly, and one that stops asking for a while holds 3col up. (But
+ * with `Page_numbers NofM', which is the default, or `Share_strings yes',
+ * 3col has to go through the whole input once before the first piece;
+ * say `-page_numbers yes' if you want them quickly.)
+ *
+ * Call, in order:
+ *
+ *   threecol_open(argc, argv)
+ *     with arguments just like 3col's command line (argv[0] is ignored).
+ *     The config files are read first, as usual. Returns 0 if it can't
+ *     make the document.
+ *
+ *   threecol_next(&text, &len)
+ *     as many times as you like. Each time it lays out the next piece,
+ *     points |text| at it and sets |len| to its length, and returns its
+ *     number; or returns -1 when there are no more. The text stays put
+ *     until you call threecol_next or threecol_close again.
+ *
+ *   threecol_close()
+ *     when you have had enough, whether or not you've had every piece.
+ *     Returns non-0 if anything went wrong.
+ *
+ * Only one document can be made at a time, but once it's closed you can
+ * open another, with options of its own (the config files are read
+ * afresh, too). The functions must all be called from the same thread.
+ * Errors are reported on stderr, just as they are by 3col itself; and a
+ * fatal error is still fatal, which is to say that it ends the whole
+ * process.
+ */
+
+#ifndef THREECOL_H
+#define THREECOL_H
+
+#include <stddef.h>
+
+int threecol_open(int argc, char *argv[]);
+int threecol_next(const char **text, size_t *len);
+int threecol_close(void);
+
+#endif
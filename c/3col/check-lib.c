@@ -0,0 +1,41 @@
+/* check-lib.c
+ * For "make check": make several documents, one after another, in one
+ * process with lib3col.a, so that they can be compared with what 3col
+ * itself makes of the same options.
+ *
+ *   check-lib <output> <options and files> [ , <output> <options and
+ *   files> ... ]
+ *
+ * Returns non-0 if anything went wrong with any of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "3col.h"
+
+/* Make one document from the |argc| arguments in |argv|, of which the
+ * first is where to put it.
+ */
+static int make_one(int argc, char *argv[]) {
+  FILE *f=fopen(argv[0],"wb");
+  const char *text;
+  size_t len;
+  int bad=0;
+  if (!f) { fprintf(stderr,"! I couldn't write to `%s'.\n",argv[0]); return 1; }
+  /* threecol_open ignores its argv[0], which is just what we want. */
+  if (!threecol_open(argc,argv)) { fclose(f); return 1; }
+  while (threecol_next(&text,&len)>=0)
+    if (fwrite(text,1,len,f)!=len) bad=1;
+  if (threecol_close()) bad=1;
+  if (fclose(f)) bad=1;
+  return bad;
+}
+
+int main(int argc, char *argv[]) {
+  int i,j,bad=0;
+  for (i=1;i<argc;i=j+1) {
+    for (j=i;j<argc && strcmp(argv[j],",");++j) ;
+    if (make_one(j-i,argv+i)) bad=1;
+  }
+  return bad;
+}
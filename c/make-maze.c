@@ -1,15 +1,26 @@
 /* McCaughan's maximally marvellous moby maze making machine
  * (c) 1995 Gareth McCaughan
  *
- * Usage: make-maze <x> <y> [<seed>]
+ * Usage: make-maze [-branchy] [-threads <n>] [-unionfind] [-stream]
+ *                  [-tiles <across>x<down>] [-lines]
+ *                  [-algorithm <name>] [-generators] <x> <y> [<seed>]
  *
  * Make mazes using Olin Shivers's method (actually he didn't invent it):
  * start with our set of cells; randomly knock down walls unless
  * doing so introduces a cycle into the connectivity graph of our
  * cells.
  * Like Shivers, I'll do hexagonal mazes: it's more fun that way.
+ * (But -DSQUARE, -DTORUS, -DTRIANGLES or -DLAYERS=<k> will get you
+ * something else; see "The shape of the grid" below.)
  *
  * If you are compiling under SunOS 4, put -DSUN on the command line.
+ * If you have POSIX threads and more than one processor, put -DUSE_THREADS
+ * (and -lpthread, or whatever your system wants) on the command line, and
+ * big mazes will be made in parallel, using -threads threads (or one
+ * for each processor). It makes no difference to the mazes you get.
+ * Mazes can have up to 2^29 cells (23170x23170, say). If you want
+ * bigger ones than that, and have the memory, put -DBIG_MAZES on the
+ * command line; that makes everything twice as big but lifts the limit.
  * If you're compiling on some other platform, and any changes are
  * needed to the program to make it compile correctly, please let
  * me know and I'll create a Makefile and maybe even a configure script.
@@ -17,19 +28,52 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <time.h>
 
 #ifdef SUN
 # include <memory.h>
 # include <sys/timeb.h>
-# define Random random
-# define SRandom srandom
 # define CLOCKS_PER_SEC 1000000
 # define difftime(x,y) (((double)x)-(double)y)
+typedef int int32_t;	/* no <stdint.h> there */
+typedef unsigned int uint32_t;
+typedef long long int64_t;
+typedef unsigned long long uint64_t;
 #else
 # include <string.h>
-# define Random rand	/* Beware bad random number generators! */
-# define SRandom srand
+# include <stdint.h>
+#endif
+
+#ifdef USE_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(SUN)
+# define CACHE_MISSES
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+/* Cells are numbered with 64-bit integers, so that there's no limit
+ * on the size of a maze except the memory we have to make it in.
+ * Mostly we only need 32 bits for the things we keep a lot of, though:
+ * see |chain| and |wall| below, and |cellref|, which is a cell number
+ * (or something no bigger) kept in one of those big arrays. They are
+ * all 64 bits with -DBIG_MAZES.
+ */
+typedef int64_t cellno;
+#ifdef BIG_MAZES
+typedef int64_t chain;
+typedef uint64_t cellref;
+# define Max_cells ((cellno)1<<56)
+#else
+typedef int32_t chain;
+typedef uint32_t cellref;
+# define Max_cells ((cellno)1<<29)
 #endif
 
 /* The cells are represented by an array pointed to by |cells|.
@@ -44,101 +88,92 @@
  * straight at the final cell, IYSWIM.  This trick is due to
  * Tarjan.
  */
-static int *cells;
+static chain *cells;
 
 /* If |x| is a cell, then |base(x)| is the cell one reaches by
  * chaining along those pointers from |x|.
  */
-static int base(int x) {
-  int y=cells[x],z=x;
+static cellno base(cellno x) {
+  cellno y=cells[x],z=x;
   while (y>=0) { z=y; y=cells[y]; }
   /* Now we could just return |z|, but we snap pointers first. */
-  y=x; while (cells[y]>=0) { x=cells[y]; cells[y]=z; y=x; }
+  y=x; while (cells[y]>=0) { x=cells[y]; cells[y]=(chain)z; y=x; }
   return z;
 }
 
 /* If |x| and |y| are base cells (i.e., |cells[x]<0| and |cells[y]<0|)
  * then |unify(x,y)| puts |x| and |y| in the same component.
  */
-static void unify(int x, int y) {
-  int sx=cells[x],sy=cells[y];
+static void unify(cellno x, cellno y) {
+  chain sx=cells[x],sy=cells[y];
   if (sx<sy) { /* X larger than Y */
-    cells[y]=x;
+    cells[y]=(chain)x;
     cells[x]=sx+sy;
   }
   else {
-    cells[x]=y;
+    cells[x]=(chain)y;
     cells[y]=sx+sy;
   }
 }
 
-/* After making the maze, we need to convert it into a slightly
- * more helpful format. To do this, we need another array of
- * information about cells. Here's the information we need
- * about each cell:
+/* Every wall is the north, northwest or northeast wall of some cell.
+ * So all we need to remember about the maze we make is, for each cell,
+ * which of those three walls have been knocked down: 3 bits. We keep
+ * them in |open_walls|, half a byte per cell; the fourth bit is for
+ * marking cells we have been to when we build the tree.
  */
-typedef struct node {
-  int exits;	/* bitmap representing exits -- see later */
-  int n_kids;	/* number of descendants in tree */
-  struct node *kids[6];	/* and which ones they are */
-  /* The use of the following will become clear when you look
-   * at |analyse_tree|.
-   */
-  struct node *first,*second,*furthest;
-  int length,distance;
-} node;
-
-/* And here's the array.
- */
-node *nodes;
-
-/* Exits from a cell are recorded in a bitmap. It only needs 8 bits,
- * even allowing a little spare space. Thus:
- */
-enum {
-  Up=1, Down=2,		/* (k,l) -> (k,l+-1)    delta=+-1 */
-  LDown=4, RDown=8,	/* (k,l) -> (k+-1,l-1)  delta=+-n_rows -1 */
-  LEq=16, REq=32,	/* (k,l) -> (k+-1,l)    delta=+-n_rows    */
-  LUp=64, RUp=128	/* (k,l) -> (k+-1,l+1)  delta=+-n_rows +1 */
-};
+enum { N_open=1, NW_open=2, NE_open=4, Visited=8 };
+static unsigned char *open_walls;
+#define Open(c) ((open_walls[(c)>>1]>>(((c)&1)<<2))&15)
+#define Set_open(c,b) (open_walls[(c)>>1]|=(unsigned char)((b)<<(((c)&1)<<2)))
 
 /* Set up the |cells| array to contain |n| cells, each in its own
- * component. Also set up the |nodes| array to contain |n| nodes,
- * none of them with any children or any walls.
+ * component.
  */
-static void init_cells(int n) {
-  cells=malloc(n*sizeof(int));
+static void init_cells(cellno n) {
+  cells=malloc(n*sizeof(chain));
   if (!cells) {
     fprintf(stderr,"! I couldn't get enough memory for |cells|.\n");
     exit(1);
   }
-  memset(cells,-1,n*sizeof(int));	/* strictly, this isn't portable... */
-  nodes=calloc(n,sizeof(node));
-  if (!nodes) {
-    fprintf(stderr,"! I couldn't get enough memory for |nodes|.\n");
+  memset(cells,-1,n*sizeof(chain));	/* strictly, this isn't portable... */
+}
+
+/* And |open_walls|, with all their walls up.
+ */
+static void init_open_walls(cellno n) {
+  open_walls=calloc((n+1)>>1,1);
+  if (!open_walls) {
+    fprintf(stderr,"! I couldn't get enough memory for |open_walls|.\n");
     exit(1);
   }
 }
 
 /* We need to go through the walls between the cells in a random order.
- * To do this, we produce an array of structures representing walls,
- * and sort it into random order.
+ * To do this, we produce an array of walls and shuffle it. A wall is
+ * just a number: the cell below or to the left of it, times 8, plus
+ * a number saying which of the cell's walls it is. (That only needs 3
+ * bits, and it would only take 2 if we didn't save ourselves some
+ * arithmetic later by telling odd and even columns apart here.)
+ * Keeping them small and all in a row means that shuffling them and
+ * going through them afterwards both run straight through memory,
+ * rather than hopping about all over it.
  */
-typedef struct wall {
-  struct wall *next;	/* next wall after this one */
-  int lower;	/* one neighbouring cell */
-  int higher;	/* the other neighbouring cell */
-} wall;
+#ifdef BIG_MAZES
+typedef uint64_t wall;
+#else
+typedef uint32_t wall;
+#endif
+#define Wall(cell,kind) (((wall)(cell)<<3) | (kind))
+#define Lower(w) ((cellno)((w)>>3))
+#define Kind(w) ((int)((w)&7))
 
 /* The array of walls is pointed to by |walls|. Amazing.
+ * There are |n_walls| of them; after |create_maze| has done its stuff,
+ * only the ones still standing are left.
  */
 static wall *walls;
-
-/* And the first wall to be dealt with is pointed to by |first_wall|.
- * (The last one is indicated by having a null pointer in its |next|
- * field, of course.)
- */
-static wall *first_wall;
+static cellno n_walls;
 
 /* More than one bit of the program needs to know how big the
  * maze is. Here are the dimensions:
@@ -146,10 +181,126 @@ static wall *first_wall;
 static int n_columns;
 static int n_rows;
 
-/* Set up the |walls| array to represent the walls in an |m| by |n|
- * hexagonal array of cells, and link them all together with their
- * |next| fields.
- * Now is a good time to think about how to describe our cells.
+/* ----- The shape of the grid ----- */
+
+/* The cells are hexagons unless we're compiled with one of these:
+ *   -DSQUARE     squares;
+ *   -DTORUS      squares, with the top joined to the bottom and the
+ *                left side to the right;
+ *   -DTRIANGLES  triangles, pointing up and down alternately;
+ *   -DLAYERS=<k> k layers of squares, one on top of another, with ways
+ *                up and down between them.
+ * Everything that depends on which it is comes from the macros in this
+ * section, so each kind of grid gets loops of its own with the numbers
+ * built in, rather than one loop that asks what kind of grid it is.
+ * Cells are always numbered up the columns first: cell (i,j) is number
+ * |n*i+j|, where |n=n_rows|. The layers of a -DLAYERS maze are just
+ * more columns: layer l is columns |l*w..l*w+w-1|, where |w| is
+ * |layer_width|, and |n_columns| counts the columns in all of them.
+ * A cell owns at most three walls (here called N, NW and NE, whatever
+ * they really are), so they fit into |open_walls| whatever the grid.
+ *
+ * For each kind of grid:
+ * The enum lists the kinds of wall: for each we need to know how far
+ *   it is from the cell on one side of it to the cell on the other
+ *   (which depends on the size of the maze, so |Set_deltas(m,n)| fills
+ *   that in), and which bit to set in |open_walls| when the wall is
+ *   knocked down, which is in |Wall_bits|. We tell apart walls which are the same bit but join
+ *   different cells, to save ourselves some arithmetic later.
+ * |Cell_walls(i,j,m,n,W)| does |W(cond,kind)| for each wall cell (i,j)
+ *   owns: it's there if |cond|.
+ * |Count_walls(m,n)| is how many there are in all.
+ * |Neighbours(i,j,m,n,X)| does |X(cond,delta,owner,bit)| for each cell
+ *   next door, which is |delta| further on, if it's there (|cond|);
+ *   the wall between is |bit| of the cell |owner| further on.
+ * |Grid_name| goes on the page, where we say what the maze is.
+ */
+#if defined(SQUARE)+defined(TORUS)+defined(TRIANGLES)+defined(LAYERS)>1
+# error "Only one of -DSQUARE, -DTORUS, -DTRIANGLES and -DLAYERS, please."
+#endif
+
+#if defined(SQUARE) || defined(TRIANGLES)
+/* Each cell owns the wall above it and the wall to its right. A
+ * triangle in column i, row j points up if i+j is even, and then it
+ * doesn't have anything above it (or, to put it another way, the
+ * triangle above it is the one it touches at its tip).
+ */
+enum { E_open=NW_open };
+enum { North, East, N_kinds };
+# define Wall_bits { 0, N_open }, { 0, E_open }
+# define Set_deltas(m,n) { kinds[North].delta=1; kinds[East].delta=(n); }
+# ifdef SQUARE
+#  define Grid_name "square"
+#  define Has_north(i,j,n) ((j)<(n)-1)
+#  define Has_south(i,j) ((j)>0)
+#  define Count_walls(m,n) ((cellno)(m)*((n)-1)+(cellno)((m)-1)*(n))
+# else
+#  define Grid_name "triangles"
+#  define Has_north(i,j,n) ((j)<(n)-1 && (((i)+(j))&1))
+#  define Has_south(i,j) ((j)>0 && !(((i)+(j))&1))
+#  define Count_walls(m,n) \
+     ((cellno)((m)-1)*(n)+(cellno)((n)/2)*((m)/2)+(cellno)(((n)-1)/2)*(((m)+1)/2))
+# endif
+# define Cell_walls(i,j,m,n,W) \
+  W(Has_north(i,j,n),North) \
+  W((i)<(m)-1,East)
+# define Neighbours(i,j,m,n,X) \
+  X((i)>0,-(n),-(n),E_open) \
+  X(Has_south(i,j),-1,-1,N_open) \
+  X(Has_north(i,j,n),1,0,N_open) \
+  X((i)<(m)-1,(n),0,E_open)
+
+#elif defined(TORUS)
+/* As for squares, but every cell has walls above it and to its right:
+ * the ones at the top and right of the maze wrap round to the bottom
+ * and left.
+ */
+enum { E_open=NW_open };
+enum { North, North_wrap, East, East_wrap, N_kinds };
+# define Grid_name "torus"
+# define Wall_bits { 0, N_open }, { 0, N_open }, { 0, E_open }, { 0, E_open }
+# define Set_deltas(m,n) { \
+  kinds[North].delta=1; kinds[North_wrap].delta=1-(n); \
+  kinds[East].delta=(n); kinds[East_wrap].delta=-(cellno)((m)-1)*(n); }
+# define Cell_walls(i,j,m,n,W) \
+  W(1,(j)<(n)-1 ? North : North_wrap) \
+  W(1,(i)<(m)-1 ? East : East_wrap)
+# define Count_walls(m,n) (2*(cellno)(m)*(n))
+# define Neighbours(i,j,m,n,X) \
+  X(1,(i)>0 ? -(n) : (cellno)((m)-1)*(n),(i)>0 ? -(n) : (cellno)((m)-1)*(n), \
+    E_open) \
+  X(1,(j)>0 ? -1 : (n)-1,(j)>0 ? -1 : (n)-1,N_open) \
+  X(1,(j)<(n)-1 ? 1 : 1-(n),0,N_open) \
+  X(1,(i)<(m)-1 ? (n) : -(cellno)((m)-1)*(n),0,E_open)
+
+#elif defined(LAYERS)
+/* As for squares, and each cell owns the way up to the cell above it
+ * in the next layer too.
+ */
+static int layer_width;
+enum { E_open=NW_open, U_open=NE_open };
+enum { North, East, Up, N_kinds };
+# define Grid_name "layers"
+# define Wall_bits { 0, N_open }, { 0, E_open }, { 0, U_open }
+# define Set_deltas(m,n) { kinds[North].delta=1; kinds[East].delta=(n); \
+  kinds[Up].delta=(cellno)layer_width*(n); }
+# define Cell_walls(i,j,m,n,W) \
+  W((j)<(n)-1,North) \
+  W((i)%layer_width<layer_width-1,East) \
+  W((i)<(m)-layer_width,Up)
+# define Count_walls(m,n) \
+  ((cellno)(m)*((n)-1)+(cellno)((m)-(m)/layer_width)*(n) \
+   +(cellno)((m)-layer_width)*(n))
+# define Neighbours(i,j,m,n,X) \
+  X((i)>=layer_width,-(cellno)layer_width*(n),-(cellno)layer_width*(n),U_open) \
+  X((i)%layer_width>0,-(n),-(n),E_open) \
+  X((j)>0,-1,-1,N_open) \
+  X((j)<(n)-1,1,0,N_open) \
+  X((i)%layer_width<layer_width-1,(n),0,E_open) \
+  X((i)<(m)-layer_width,(cellno)layer_width*(n),0,U_open)
+
+#else
+/* Hexagons. Now is a good time to think about how to describe our cells.
  * I adopt Shivers's terminology: columns are numbered left to right,
  * 0..m-1, and each column contains n cells 0..n-1. Columns 0,2,...
  * are half a cell "lower" than columns 1,3,... .
@@ -160,17 +311,67 @@ static int n_rows;
  * outside their ranges then the relevant cells just aren't there.
  * The total number of walls is (m-1)*(2n-1) horizontally, plus
  * m*(n-1) vertically: that comes to 2mn-m-2n+1+mn-m = 3mn-2m-2n+1.
- * Cell (i,j) is number |n*i+j| in the |cells| array: so we go
- * up the columns first, as it were.
- * This is not efficient code, by the way; but it's not radically
- * inefficient, and I don't think this is where the program spends
- * most of its time.
+ * The neighbours come left to right, and bottom to top in each column:
+ * that's the order |visit_all| has always gone round them in, which
+ * decides which of several equally distant cells it comes to last.
+ */
+# define HEX
+enum { North, NW_even, NW_odd, NE_even, NE_odd, N_kinds };
+# define Grid_name "hexagons"
+# define Wall_bits \
+  { 0, N_open }, { 0, NW_open }, { 0, NW_open }, { 0, NE_open }, { 0, NE_open }
+# define Set_deltas(m,n) { kinds[North].delta=1; \
+  kinds[NW_even].delta=-(n); kinds[NW_odd].delta=-(n)+1; \
+  kinds[NE_even].delta=(n);  kinds[NE_odd].delta=(n)+1; }
+# define Cell_walls(i,j,m,n,W) \
+  W((i)>0 && ((j)<(n)-1 || !((i)&1)),((i)&1) ? NW_odd : NW_even) \
+  W((j)<(n)-1,North) \
+  W((i)<(m)-1 && ((j)<(n)-1 || !((i)&1)),((i)&1) ? NE_odd : NE_even)
+# define Count_walls(m,n) (3*(cellno)(m)*(n)-(m)-(m)-(n)-(n)+1)
+# define Neighbours(i,j,m,n,X) \
+  X((i)>0 && (((i)&1) || (j)>0),((i)&1) ? -(n) : -(n)-1, \
+    ((i)&1) ? -(n) : -(n)-1,NE_open) \
+  X((i)>0 && (!((i)&1) || (j)<(n)-1),((i)&1) ? -(n)+1 : -(n),0,NW_open) \
+  X((j)>0,-1,-1,N_open) \
+  X((j)<(n)-1,1,0,N_open) \
+  X((i)<(m)-1 && (((i)&1) || (j)>0),((i)&1) ? (n) : (n)-1, \
+    ((i)&1) ? (n) : (n)-1,NW_open) \
+  X((i)<(m)-1 && (!((i)&1) || (j)<(n)-1),((i)&1) ? (n)+1 : (n),0,NE_open)
+#endif
+
+#ifdef LAYERS
+# define N_layers LAYERS
+#else
+# define N_layers 1
+#endif
+
+/* The size of the maze: |m| columns (in each layer) and |n| rows.
+ */
+static void set_size(int m, int n) {
+  n_columns=m*N_layers;
+  n_rows=n;
+#ifdef LAYERS
+  layer_width=m;
+#endif
+}
+
+/* The kinds of wall, as above.
+ */
+static struct {
+  cellno delta;	/* |higher-lower| */
+  int bit;	/* for the cell we number the wall by */
+} kinds[N_kinds]={ Wall_bits };
+
+/* Set up the |walls| array to represent the walls in an |m| by |n|
+ * array of cells. (That's |m| columns in all, with -DLAYERS.)
  */
 static void init_walls(int m, int n) {
   int i,j;
-  int this;
+  cellno this;
   wall *e;
-  walls=malloc((3*m*n-m-m-n-n+1)*sizeof(wall));
+  Set_deltas(m,n)
+  n_walls=Count_walls(m,n);
+  walls=malloc(n_walls*sizeof(wall));
   if (!walls) {
     fprintf(stderr,"! I couldn't get enough memory for |walls|.\n");
     exit(1);
@@ -179,41 +380,116 @@ static void init_walls(int m, int n) {
   for (i=0;i<m;++i) {
     for (j=0;j<n;++j) {
       /* Cell (i,j). */
-      if (i>0 && (j<n-1 || !(i&1))) {	/* Northwest: */
-        e->next=e+1;
-        e->lower=this;
-        e->higher=this-n+(i&1);
-        ++e;
-      }
-      if (j<n-1) {	/* North: */
-        e->next=e+1;
-        e->lower=this;
-        e->higher=this+1;
-        ++e;
-      }
-      if (i<m-1 && (j<n-1 || !(i&1))) {	/* Northeast: */
-        e->next=e+1;
-        e->lower=this;
-        e->higher=this+n+(i&1);
-        ++e;
-      }
+#define Add(cond,kind) if (cond) *e++=Wall(this,kind);
+      Cell_walls(i,j,m,n,Add)
+#undef Add
       ++this;
     }
   }
-  if (e!=walls+3*m*n-m-m-n-n+1) {
-    fprintf(stderr,"! Gareth screwed up (%d != %d).\n",e-walls,3*m*n-m-m-n-n+1);
+  if (e!=walls+n_walls) {
+    fprintf(stderr,"! Gareth screwed up (%ld != %ld).\n",
+            (long)(e-walls),(long)n_walls);
     exit(1);
   }
-  (e-1)->next=0;	/* terminate list */
+}
+
+/* We don't use the C library's random number generator: it's slow,
+ * often not very random, and different on every platform, so that
+ * the same seed gives different mazes on different machines. Instead
+ * here is xoshiro128** (Blackman and Vigna), which is quick, good
+ * enough for anything we do, and the same everywhere. Its state is
+ * four 32-bit words, which mustn't all be zero.
+ */
+typedef struct rng {
+  uint32_t s[4];
+} rng;
+
+#define Rotl(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
+
+/* |rng_next(r)| returns the next 32 random bits from |r|.
+ */
+static uint32_t rng_next(rng *r) {
+  uint32_t *s=r->s;
+  uint32_t result=Rotl(s[1]*5,7)*9;
+  uint32_t t=s[1]<<9;
+  s[2]^=s[0]; s[3]^=s[1]; s[1]^=s[2]; s[0]^=s[3];
+  s[2]^=t;
+  s[3]=Rotl(s[3],11);
+  return result;
+}
+
+/* |rng_below(r,n)| returns a random number from 0 to |n-1|, all of them
+ * equally likely. This is Lemire's method: take the top half of a 64-bit
+ * product, and throw away the few draws that would make the low numbers
+ * commoner than the high ones.
+ */
+static uint32_t rng_below(rng *r, uint32_t n) {
+  uint64_t m=(uint64_t)rng_next(r)*n;
+  uint32_t t;
+  if ((uint32_t)m<n) {
+    t=(uint32_t)-n%n;
+    while ((uint32_t)m<t) m=(uint64_t)rng_next(r)*n;
+  }
+  return (uint32_t)(m>>32);
+}
+
+/* |rng_seed(r,x)| starts |r| off from the seed |x|. Similar seeds
+ * ought to give unrelated streams, so we don't use |x| directly:
+ * each word of the state is a scrambled version of |x| plus a
+ * different multiple of the golden ratio, which is what SplitMix
+ * does. (It can't come out as all zeros, but we make sure anyway.)
+ */
+static void rng_seed(rng *r, uint32_t x) {
+  int i;
+  uint32_t z;
+  for (i=0;i<4;++i) {
+    z=(x+=0x9E3779B9u);
+    z=(z^(z>>16))*0x85EBCA6Bu;
+    z=(z^(z>>13))*0xC2B2AE35u;
+    r->s[i]=z^(z>>16);
+  }
+  if (!(r->s[0]|r->s[1]|r->s[2]|r->s[3])) r->s[0]=1;
+}
+
+/* |rng_jump(r)| moves |r| on by 2^64 steps, as if |rng_next| had been
+ * called that many times, only rather faster.
+ */
+static void rng_jump(rng *r) {
+  static const uint32_t jump[4]={
+    0x8764000Bu, 0xF542D2D3u, 0x6FA035C3u, 0x77F2DB5Bu };
+  uint32_t t[4]={0,0,0,0};
+  int i,b;
+  for (i=0;i<4;++i) for (b=0;b<32;++b) {
+    if (jump[i] & ((uint32_t)1<<b)) {
+      t[0]^=r->s[0]; t[1]^=r->s[1]; t[2]^=r->s[2]; t[3]^=r->s[3];
+    }
+    rng_next(r);
+  }
+  memcpy(r->s,t,sizeof(t));
+}
+
+/* |rng_split(r,new)| gives |new| a stream of its own, by handing it the
+ * next 2^64 numbers from |r| and jumping |r| past them. Anything that
+ * wants random numbers in parallel (another generator, or another
+ * thread) should get a generator this way: what it gets depends only on
+ * the seed and on the order of the splits, so the results are the same
+ * every time, and no two streams will overlap unless someone uses more
+ * than 2^64 numbers from one of them.
+ */
+static void rng_split(rng *r, rng *new) {
+  *new=*r;
+  rng_jump(r);
 }
 
 /* If this isn't going to give the exact same maze every time we run it,
  * we'd better start up the random number generator in some way that
  * actually depends on a few things.
- * |init_rand()| does this: it should be called before |init_walls|.
- * If |seed| is non-zero, we use that directly as our seed.
+ * |init_rand()| does this: it should be called before |shuffle_walls|.
+ * If |seed| is non-zero, we use that directly as our seed, so that
+ * the same seed always gives the same maze, whatever we're running on.
  */
 static int seed;
+static rng main_rng;
 static void init_rand(void) {
 #ifdef SUN
   struct timeb t;
@@ -222,205 +498,783 @@ static void init_rand(void) {
     ftime(&t);
     pid=getpid();
     seed=(t.time<<8) + (t.millitm) + (pid<<16);
+    seed=seed&0x7FFFFFFF;
+  }
+#else
+  if (!seed) seed=(clock()+time(0))&0x7FFFFFFF;
+#endif
+  rng_seed(&main_rng,(uint32_t)seed);
+}
+
+/* Some jobs are big enough to be worth sharing out among several
+ * processors. |run_jobs(job,n)| calls |job(0)|, ..., |job(n-1)|, in
+ * no particular order and maybe several at once, and returns when
+ * they have all finished. Each job must do the same thing however
+ * many others are running at the time: that way we get the same maze
+ * whether or not we have threads.
+ * The threads are started the first time they're wanted, and then
+ * wait around for more; |create_maze| calls |run_jobs| thousands of
+ * times, and starting them all up again each time would be silly.
+ * There are |n_threads| of them, counting the main one; -threads
+ * says how many, and otherwise we have one for each processor.
+ */
+static int n_threads=1;
+
+#ifdef USE_THREADS
+#define Max_threads 256
+static void (*the_job)(int);
+static int n_jobs,next_job;
+static int generation;	/* goes up by one for each lot of jobs */
+static int n_busy;	/* threads other than main one still working */
+static pthread_mutex_t job_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_posted=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobs_done=PTHREAD_COND_INITIALIZER;
+
+/* Do jobs until there aren't any left. Called with |job_lock| held.
+ */
+static void do_jobs(void) {
+  int i;
+  while ((i=next_job)<n_jobs) {
+    ++next_job;
+    pthread_mutex_unlock(&job_lock);
+    the_job(i);
+    pthread_mutex_lock(&job_lock);
+  }
+}
+
+static void *job_thread(void *arg) {
+  int seen=0;
+  pthread_mutex_lock(&job_lock);
+  for (;;) {
+    while (generation==seen) pthread_cond_wait(&jobs_posted,&job_lock);
+    seen=generation;
+    do_jobs();
+    if (!--n_busy) pthread_cond_signal(&jobs_done);
   }
+  return arg;
+}
+
+static void run_jobs(void (*job)(int), int n) {
+  static pthread_t threads[Max_threads];
+  static int started=0;
+  int i;
+  if (!started) {
+    /* If we can't have as many threads as we'd like, we make do. */
+    for (i=1;i<n_threads;++i)
+      if (pthread_create(&threads[i],0,job_thread,0)) break;
+    n_threads=i;
+    started=1;
+  }
+  pthread_mutex_lock(&job_lock);
+  the_job=job; n_jobs=n; next_job=0;
+  n_busy=n_threads-1; ++generation;
+  pthread_cond_broadcast(&jobs_posted);
+  do_jobs();
+  while (n_busy) pthread_cond_wait(&jobs_done,&job_lock);
+  pthread_mutex_unlock(&job_lock);
+}
 #else
-  seed=clock()+time(0);
+static void run_jobs(void (*job)(int), int n) {
+  int i;
+  for (i=0;i<n;++i) job(i);
+}
 #endif
-  seed=seed&0x7FFFFFFF;
-  SRandom(seed);
+
+/* To put the walls into random order we use the Fisher-Yates shuffle:
+ * pick a random wall to go last, then a random one of the others to go
+ * next to last, and so on.
+ * For a big maze that means a cache miss for nearly every wall, one
+ * after another. So then we do it in two stages instead. First each
+ * wall is thrown into one of |N_bins| bins at random, taking the walls
+ * |chunk_size| at a time, and then each bin is shuffled on its own. That
+ * still gives every order the same chance; lots of chunks or bins
+ * can be done at once; and a bin is small enough to stay in the cache
+ * while we shuffle it. Every chunk and every bin has a random number
+ * generator of its own, split off from |main_rng| in a fixed order, so
+ * it doesn't matter who does which of them when.
+ */
+#define N_bins 1024
+#define Chunk 65536	/* walls per chunk, to begin with */
+#define Max_chunks 4096	/* and if that makes too many chunks, we double it */
+
+static wall *spare_walls;	/* where the walls go, bin by bin */
+static cellno chunk_size;
+static int n_chunks;
+static rng *chunk_rng;
+static rng bin_rng[N_bins];
+static cellno (*bin_place)[N_bins];	/* count, then place, for each chunk & bin */
+static cellno bin_start[N_bins+1];
+
+/* |fisher_yates(w,n,r)| shuffles the |n| walls at |w|, using |r|.
+ * (|n| is never anywhere near 2^32, which is all |rng_below| can do.)
+ */
+static void fisher_yates(wall *w, cellno n, rng *r) {
+  cellno i,j;
+  wall t;
+  for (i=n-1;i>0;--i) {
+    j=rng_below(r,(uint32_t)i+1);
+    t=w[i]; w[i]=w[j]; w[j]=t;
+  }
 }
 
-/* To sort the walls into order, we do three passes of 1024-way radix sort,
- * putting things into random bins. This is equivalent to giving
- * each wall a random 30-bit key and sorting into order, but doesn't
- * require us to waste space storing keys we don't really want.
- * So, here are the list heads for the sublists:
+/* |bin_chunk(c,0)| works out which bin each wall in chunk |c| goes in,
+ * and counts them; |bin_chunk(c,1)| works it all out again (which is
+ * quicker than remembering) and puts them there. Both use a copy of the
+ * chunk's generator, so they come up with the same bins. Bin numbers
+ * are only 10 bits, so one call of |rng_next| is good for three.
  */
-static wall *head1[1024];	/* initialised to 0, say ANSI */
-static wall *head2[1024];	/* ditto */
+static void bin_chunk(int c, int fill) {
+  rng r=chunk_rng[c];
+  cellno *place=bin_place[c];
+  cellno i=c*chunk_size,end=i+chunk_size;
+  int k=0;
+  uint32_t bits=0;
+  if (end>n_walls) end=n_walls;
+  for (;i<end;++i) {
+    if (k) { bits>>=10; --k; }
+    else { bits=rng_next(&r)>>2; k=2; }
+    if (fill) spare_walls[place[bits&1023]++]=walls[i];
+    else ++place[bits&1023];
+  }
+}
+static void count_chunk(int c) { bin_chunk(c,0); }
+static void fill_chunk(int c) { bin_chunk(c,1); }
+
+static void shuffle_bin(int b) {
+  fisher_yates(spare_walls+bin_start[b],bin_start[b+1]-bin_start[b],
+               &bin_rng[b]);
+}
 
-/* "Sort" the walls into random order.
+/* Shuffle the walls into random order.
  */
 static void shuffle_walls(void) {
-  wall *p,*q;
-  int i,k;
-  /* First pass, into head1[]. */
-  p=walls; while (p) {
-    k=Random()&1023;
-    q=p->next;
-    p->next=head1[k]; head1[k]=p;
-    p=q;
-  }
-  /* Second pass, from head1[] into head2[]. */
-  for (i=0;i<1024;++i) {
-    p=head1[i]; head1[i]=0; while (p) {
-      k=Random()&1023;
-      q=p->next;
-      p->next=head2[k]; head2[k]=p;
-      p=q;
-    }
+  int b,c;
+  cellno n,k;
+  wall *t;
+  if (n_walls<=Chunk) {
+    fisher_yates(walls,n_walls,&main_rng);
+    return;
   }
-  /* Third pass, from head2[] into head1[]. */
-  for (i=0;i<1024;++i) {
-    p=head2[i]; head2[i]=0; while (p) {
-      k=Random()&1023;
-      q=p->next;
-      p->next=head1[k]; head1[k]=p;
-      p=q;
-    }
+  chunk_size=Chunk;
+  while ((n_walls+chunk_size-1)/chunk_size>Max_chunks) chunk_size*=2;
+  n_chunks=(int)((n_walls+chunk_size-1)/chunk_size);
+  spare_walls=malloc(n_walls*sizeof(wall));
+  chunk_rng=malloc(n_chunks*sizeof(rng));
+  bin_place=calloc(n_chunks,sizeof(*bin_place));
+  if (!spare_walls || !chunk_rng || !bin_place) {
+    fprintf(stderr,"! I couldn't get enough memory to shuffle the walls.\n");
+    exit(1);
   }
-  /* Finally, link them all together again. */
-  q=0;
-  for (i=0;i<1024;++i) {
-    p=head1[i];
-    if (!p) continue;
-    if (q) { q->next=p; } else first_wall=p;
-    while (p) { q=p; p=p->next; }
+  for (c=0;c<n_chunks;++c) rng_split(&main_rng,&chunk_rng[c]);
+  for (b=0;b<N_bins;++b) rng_split(&main_rng,&bin_rng[b]);
+  run_jobs(count_chunk,n_chunks);
+  /* Turn the counts into places: bin 0 gets chunk 0's walls, then
+   * chunk 1's, and so on; then bin 1; ...
+   */
+  n=0;
+  for (b=0;b<N_bins;++b) {
+    bin_start[b]=n;
+    for (c=0;c<n_chunks;++c) { k=bin_place[c][b]; bin_place[c][b]=n; n+=k; }
   }
-  /* We're done. */
+  bin_start[N_bins]=n;
+  run_jobs(fill_chunk,n_chunks);
+  run_jobs(shuffle_bin,N_bins);
+  t=walls; walls=spare_walls; free(t);
+  free(chunk_rng); free(bin_place);
 }
 
 /* Create the maze: for each wall, see whether its neighbours are
  * already in the same component. If so, do nothing (removing this
  * wall would mean that there were two paths between some pair of
- * points). If not, remove the wall (by unlinking it from the list)
+ * points). If not, remove the wall (by squeezing it out of the array)
  * and unify the components of the cells on either side.
- * When we remove a wall, we also put an entry in the |exits| field
- * of each corresponding |node|.
+ * When we remove a wall, we also mark it as open in |open_walls|.
  */
-static void create_maze(void) {
-  wall *p=first_wall;
-  wall *q=0;	/* if |q!=0| then |q->next| is waiting to be filled in */
-  int x,y;
-  int delta;
-  while (p) {
-    x=base(p->lower); y=base(p->higher);
+static void knock_down_walls(void) {
+  cellno i,n=0;
+  wall w;
+  cellno lower;
+  int kind;
+  cellno x,y;
+  for (i=0;i<n_walls;++i) {
+    w=walls[i];
+    lower=Lower(w); kind=Kind(w);
+    x=base(lower); y=base(lower+kinds[kind].delta);
     if (x!=y) {
       unify(x,y);	/* not connected: connect them */
-      /* Also, add exits. */
-#define Add_exits(dh,dl) { \
-  nodes[p->higher].exits|=dh; nodes[p->lower].exits|=dl; }
-      delta=p->higher-p->lower;
-      if (delta==1) Add_exits(Down,Up)
-      else if (delta>0) switch(delta-n_rows) {
-        case -1: Add_exits(LUp,RDown); break;
-        case 0: Add_exits(LEq,REq); break;
-        case 1: Add_exits(LDown,RUp); }
-      else /* delta<0 */ switch(delta+n_rows) {
-        case -1: Add_exits(RUp,LDown); break;
-        case 0: Add_exits(REq,LEq); break;
-        case 1: Add_exits(RDown,LUp);
-      }
+      Set_open(lower,kinds[kind].bit);	/* and knock the wall down */
     }
-    else { if (q) q->next=p; else first_wall=p; q=p; }/* connected: refrain from deleting wall */
-    p=p->next;
-  }
-  q->next=0;	/* terminate list */
-}
-
-/* Build a subtree, starting at node |n| and including as much of the
- * full tree as is possible without including anything already visited.
- * Return 0 if this node has in fact already been visited; otherwise 1.
- * Calling this for the first time builds an entire tree, with root at
- * node |n|.
- */
-static int build_tree(node *n) {
-  int exits=n->exits;
-  int nk=0;
-  if (exits&0x80000000) return 0;	/* already visited? */
-  n->exits|=0x80000000;			/* mark as visited */
-  /* Visit all neighbours: */
-  if (exits&LDown) if (build_tree(n-n_rows-1)) n->kids[nk++]=n-n_rows-1;
-  if (exits&LEq)   if (build_tree(n-n_rows))   n->kids[nk++]=n-n_rows;
-  if (exits&LUp)   if (build_tree(n-n_rows+1)) n->kids[nk++]=n-n_rows+1;
-  if (exits&Down)  if (build_tree(n-1))        n->kids[nk++]=n-1;
-  if (exits&Up)    if (build_tree(n+1))        n->kids[nk++]=n+1;
-  if (exits&RDown) if (build_tree(n+n_rows-1)) n->kids[nk++]=n+n_rows-1;
-  if (exits&REq)   if (build_tree(n+n_rows))   n->kids[nk++]=n+n_rows;
-  if (exits&RUp)   if (build_tree(n+n_rows+1)) n->kids[nk++]=n+n_rows+1;
-  n->n_kids=nk;
-  return 1;
+    else walls[n++]=w;	/* connected: refrain from deleting wall */
+  }
+  n_walls=n;
+}
+
+#ifdef USE_THREADS
+/* With threads, we can do the same thing several walls at a time.
+ * We take the walls |Window| at a time, and go round and round all
+ * the ones in the window we haven't decided about yet, as follows.
+ * First, for each wall, find the bases of the cells on either side.
+ * If they're the same, the wall stays. If not, the wall "reserves"
+ * both bases: each base ends up reserved by the earliest wall that
+ * wants it. Then every wall that got either of its bases gets knocked
+ * down, and that base gets hooked on to the other one. Then we forget
+ * the reservations and go round again with the walls that are left.
+ * The wall that got a base would have been knocked down if we'd done
+ * things one at a time, because none of the walls before it touches
+ * that component; and knocking it down doesn't make any difference to
+ * those walls. So we get exactly the same maze, but all of each step
+ * can be done at once. (This is "deterministic reservations", from
+ * Blelloch, Fineman, Gibbons and Shun.)
+ * Meanwhile, other threads are looking for bases in |cells| too, so
+ * |find| does its snapping of pointers a bit at a time (pointing each
+ * cell on the way at its grandparent), in a way that doesn't mind
+ * that, and doesn't keep the sizes of components. It doesn't need to:
+ * a base gets hooked on to whichever it's next to, which happens in a
+ * random order anyway.
+ */
+#define Window 262144	/* walls we think about at once */
+#define Piece 4096	/* walls in one job */
+#define Unreserved 0x7FFFFFFF
+enum { Undecided, Knocked_down, Left_standing };
+
+static cellno window_start;
+static int *pending;		/* walls undecided, by place in window */
+static int n_pending;
+static cellref (*roots)[2];	/* bases found for each wall in window */
+static unsigned char *fate;	/* for each wall in window */
+static int *reserved;		/* by base: wall that has it, or Unreserved */
+
+static cellno find(cellno x) {
+  chain p,g;
+  for (;;) {
+    p=__atomic_load_n(&cells[x],__ATOMIC_RELAXED);
+    if (p<0) return x;
+    g=__atomic_load_n(&cells[p],__ATOMIC_RELAXED);
+    if (g<0) return p;
+    __atomic_compare_exchange_n(&cells[x],&p,g,1,
+                                __ATOMIC_RELAXED,__ATOMIC_RELAXED);
+    x=g;
+  }
+}
+
+static void reserve(cellno x, int r) {
+  int old=__atomic_load_n(&reserved[x],__ATOMIC_RELAXED);
+  while (r<old && !__atomic_compare_exchange_n(&reserved[x],&old,r,1,
+                                  __ATOMIC_RELAXED,__ATOMIC_RELAXED)) ;
+}
+
+static void reserve_piece(int k) {
+  int i,end=(k+1)*Piece,r;
+  wall w;
+  cellno x,y;
+  if (end>n_pending) end=n_pending;
+  for (i=k*Piece;i<end;++i) {
+    r=pending[i]; w=walls[window_start+r];
+    x=find(Lower(w)); y=find(Lower(w)+kinds[Kind(w)].delta);
+    if (x==y) { fate[r]=Left_standing; continue; }
+    roots[r][0]=(cellref)x; roots[r][1]=(cellref)y;
+    reserve(x,r); reserve(y,r);
+  }
+}
+
+static void commit_piece(int k) {
+  int i,end=(k+1)*Piece,r;
+  wall w;
+  cellno x,y,lower;
+  if (end>n_pending) end=n_pending;
+  for (i=k*Piece;i<end;++i) {
+    r=pending[i];
+    if (fate[r]) continue;
+    x=roots[r][0]; y=roots[r][1];
+    if (reserved[x]==r) cells[x]=(chain)y;
+    else if (reserved[y]==r) cells[y]=(chain)x;
+    else continue;
+    fate[r]=Knocked_down;
+    w=walls[window_start+r]; lower=Lower(w);
+    /* Another thread may be doing the other cell in this byte: */
+    __atomic_fetch_or(&open_walls[lower>>1],
+                      (unsigned char)(kinds[Kind(w)].bit<<((lower&1)<<2)),
+                      __ATOMIC_RELAXED);
+  }
+}
+
+static void unreserve_piece(int k) {
+  int i,end=(k+1)*Piece,r;
+  if (end>n_pending) end=n_pending;
+  for (i=k*Piece;i<end;++i) {
+    r=pending[i];
+    if (fate[r]==Left_standing) continue;
+    __atomic_store_n(&reserved[roots[r][0]],Unreserved,__ATOMIC_RELAXED);
+    __atomic_store_n(&reserved[roots[r][1]],Unreserved,__ATOMIC_RELAXED);
+  }
+}
+
+static void knock_down_walls_in_parallel(void) {
+  cellno n_cells=(cellno)n_columns*n_rows;
+  cellno i,n=0;
+  int r,len,k,n_pieces;
+  pending=malloc(Window*sizeof(int));
+  roots=malloc(Window*sizeof(*roots));
+  fate=malloc(Window);
+  reserved=malloc(n_cells*sizeof(int));
+  if (!pending || !roots || !fate || !reserved) {
+    fprintf(stderr,"! I couldn't get enough memory to make the maze.\n");
+    exit(1);
+  }
+  for (i=0;i<n_cells;++i) reserved[i]=Unreserved;
+  for (window_start=0;window_start<n_walls;window_start+=Window) {
+    len = n_walls-window_start<Window ? (int)(n_walls-window_start) : Window;
+    for (r=0;r<len;++r) pending[r]=r;
+    memset(fate,Undecided,len);
+    n_pending=len;
+    while (n_pending) {
+      n_pieces=(n_pending+Piece-1)/Piece;
+      run_jobs(reserve_piece,n_pieces);
+      run_jobs(commit_piece,n_pieces);
+      run_jobs(unreserve_piece,n_pieces);
+      for (r=k=0;r<n_pending;++r) if (!fate[pending[r]]) pending[k++]=pending[r];
+      n_pending=k;
+    }
+    for (r=0;r<len;++r)
+      if (fate[r]==Left_standing) walls[n++]=walls[window_start+r];
+  }
+  n_walls=n;
+  free(pending); free(roots); free(fate); free(reserved);
+}
+#endif
+
+/* Afterwards we don't need |cells| any more, so we give it back, along
+ * with the space the knocked-down walls were using.
+ */
+static void create_maze(void) {
+  wall *t;
+#ifdef USE_THREADS
+  if (n_threads>1 && n_walls>Window) knock_down_walls_in_parallel();
+  else
+#endif
+  knock_down_walls();
+  free(cells);
+  t=realloc(walls,n_walls*sizeof(wall));
+  if (t) walls=t;
+}
+
+/* To build the tree we need to know all the exits from a cell, not
+ * just the walls it owns: |Neighbours| (see above) tells us where they
+ * all are, and which cell owns each one.
+ */
+
+/* We go round the tree breadth first: the cells we've found go into
+ * |queue|, and we take them out again in the same order. There's a
+ * queue rather than a stack, or any recursion, because paths in a
+ * big maze can be hundreds of thousands of cells long; and because
+ * when we've finished, |queue| has every cell in it after the cell
+ * we came to it from, which is just what |analyse_tree| wants.
+ */
+static cellref *queue;
+
+/* What's more, the cells we come to from the one at |queue[p]| all go
+ * into |queue| one after another, which makes |queue| a list of every
+ * cell's children. If |kid_start| has been set up, we remember where
+ * each cell's children start in |queue|: they are |queue[kid_start[p]]|
+ * up to but not including |queue[kid_start[p+1]]|. Everything else we
+ * need to know about the tree we can keep in arrays indexed by place in
+ * |queue| as well.
+ */
+static cellref *kid_start;
+
+/* Visit every cell we can get to from cell |start|, without going
+ * anywhere already visited, and return the last one we come to. That's
+ * one of the furthest from |start|, since we go breadth first.
+ * Since the maze is a tree, that's all of them; and if |kid_start| has
+ * been set up, it builds the entire tree, with root at |start|.
+ */
+static cellno visit_all(cellno start) {
+  cellno head=0,tail=0;
+  cellno c=start;
+  int i,j;
+  queue[tail++]=(cellref)start; Set_open(start,Visited);
+  while (head<tail) {
+    if (kid_start) kid_start[head]=(cellref)tail;
+    c=queue[head++];
+    i=(int)(c/n_rows); j=(int)(c%n_rows);
+#define Visit(cond,delta,owner,bit) \
+  if ((cond) && (Open(c+(owner))&(bit)) && !(Open(c+(delta))&Visited)) { \
+    Set_open(c+(delta),Visited); queue[tail++]=(cellref)(c+(delta)); }
+    Neighbours(i,j,n_columns,n_rows,Visit)
+#undef Visit
+  }
+  if (kid_start) kid_start[head]=(cellref)tail;
+  return c;
 }
 
-/* Fill in some fields of the |node|s of the subtree at |n|.
- * |first|,|second| are the ends of the longest path in this
- * subtree; |length| is its length. |furthest| is the most
- * distant (from |n|) single node, and |distance| is its
- * distance from |n|.
- * The points are that (1) we can compute all this stuff
- * recursively, and (2) when we've done so for the entire
- * tree, we know what the two maximally-distant nodes are.
+/* Forget that we've been anywhere.
+ */
+static void clear_visited(cellno n) {
+  cellno i;
+  for (i=0;i<(n+1)>>1;++i) open_walls[i]&=~(Visited|Visited<<4);
+}
+
+/* The start and end of the maze are as far apart as we can make them.
+ * Ordinarily that means the two ends of the longest path in the maze,
+ * and we find them like this: the furthest cell from anywhere at all
+ * is one end of a longest path, and the furthest cell from that is the
+ * other end. That takes two trips round the maze, but they're cheap
+ * ones; we don't even need to build the tree.
+ * |find_ends()| sets |first| and |second|, one way or the other.
+ */
+static int branchy=0;
+static cellno first,second;
+
+/* Alternatively, with -branchy, we use a strange metric: paths with
+ * lots of branches count for more than paths with few branches. This
+ * probably makes for a harder maze. For that we build the tree, and
+ * then work out some things about the subtree at each node |p|
+ * (numbered by place in |queue|, as above).
+ * |first[p]|,|second[p]| are the ends of the longest path in this
+ * subtree; |length[p]| is its length. |furthest[p]| is the most
+ * distant (from |p|) single node, and |distance[p]| is its
+ * distance from |p|.
+ * The points are that (1) we can compute all this stuff from the
+ * same stuff for |p|'s children, and (2) when we've done so for the
+ * entire tree, we know what the two maximally-distant nodes are.
+ * So we do the nodes in reverse order, which means children before
+ * parents, and means that each node's children are next to each
+ * other and not far from the last lot.
  * This algorithm was suggested to me by Colin Bell, but
  * it's obvious enough that it's probably been thought of
  * before.
- * We actually use a strange metric: paths with lots of branches
- * count for more than paths with few branches. This probably
- * makes for a harder maze.
- */
-void analyse_tree(node *n) {
-  int i=n->n_kids;
-  node *m;
-  int d1=0,d2=0;	/* biggest & next-biggest distance to leaves */
-  int l1=0;		/* longest path among subtrees */
-  node *dn1=0,*dn2=0;	/* nodes achieving d1,d2 */
-  node *ln1=0;		/* node achieving l1 */
-  /* First off, deal with leaf nodes */
-  if (!i) {
-    n->first=n->second=n->furthest=n;
-    n->length=n->distance=0;
+ */
+static cellref *first_end,*second_end,*furthest;
+static cellref *length,*distance;
+
+static void analyse_tree(void) {
+  cellno n=(cellno)n_columns*n_rows;
+  cellno p,m;
+  cellref n_kids;
+  cellref d1,d2;	/* biggest & next-biggest distance to leaves */
+  cellref l1;		/* longest path among subtrees */
+  cellno dn1,dn2;	/* nodes achieving d1,d2 */
+  cellno ln1;		/* node achieving l1 */
+  first_end=malloc(n*sizeof(cellref)); second_end=malloc(n*sizeof(cellref));
+  furthest=malloc(n*sizeof(cellref));
+  length=malloc(n*sizeof(cellref)); distance=malloc(n*sizeof(cellref));
+  if (!first_end || !second_end || !furthest || !length || !distance) {
+    fprintf(stderr,"! I couldn't get enough memory to analyse the tree.\n");
+    exit(1);
+  }
+  for (p=n-1;p>=0;--p) {
+    n_kids=kid_start[p+1]-kid_start[p];
+    /* First off, deal with leaf nodes */
+    if (!n_kids) {
+      first_end[p]=second_end[p]=furthest[p]=(cellref)p;
+      length[p]=distance[p]=0;
+      continue;
+    }
+    /* The general case: */
+    d1=d2=l1=0; dn1=dn2=ln1=-1;
+    for (m=kid_start[p+1]-1;m>=(cellno)kid_start[p];--m) {
+      if (length[m]>=l1) { l1=length[m]; ln1=m; }
+      if (distance[m]>=d1) { d2=d1; dn2=dn1; d1=distance[m]; dn1=m; }
+      else if (distance[m]>=d2) { d2=distance[m]; dn2=m; }
+    }
+    d1+=n_kids; d2+=n_kids;
+    distance[p]=d1; furthest[p]=furthest[dn1];
+    if (d1+d2>l1) {
+      length[p]=d1+d2;
+      first_end[p]=furthest[dn1];
+      /* (|dn2<0| when there's just one child.) */
+      second_end[p]=dn2>=0 ? furthest[dn2] : (cellref)p;
+    }
+    else {
+      length[p]=l1;
+      first_end[p]=first_end[ln1];
+      second_end[p]=second_end[ln1];
+    }
+  }
+  first=queue[first_end[0]]; second=queue[second_end[0]];
+}
+
+static void find_ends(void) {
+  queue=malloc((cellno)n_columns*n_rows*sizeof(cellref));
+  if (!queue) {
+    fprintf(stderr,"! I couldn't get enough memory for |queue|.\n");
+    exit(1);
+  }
+  if (branchy) {
+    kid_start=malloc(((cellno)n_columns*n_rows+1)*sizeof(cellref));
+    if (!kid_start) {
+      fprintf(stderr,"! I couldn't get enough memory for |kid_start|.\n");
+      exit(1);
+    }
+    visit_all(0);
+    analyse_tree();
     return;
   }
-  /* The general case: */
-  while (--i>=0) {
-    m=n->kids[i];
-    analyse_tree(m);
-    if (m->length>=l1) { l1=m->length; ln1=m; }
-    if (m->distance>=d1) { d2=d1; dn2=dn1; d1=m->distance; dn1=m; }
-    else if (m->distance>=d2) { d2=m->distance; dn2=m; }
-  }
-  d1+=n->n_kids; d2+=n->n_kids;
-  n->distance=d1; n->furthest=dn1->furthest;
-  if (d1+d2>l1) {
-    n->length=d1+d2;
-    n->first=dn1->furthest;
-    n->second=dn2 ? dn2->furthest : n;	/* this deals with case n_kids==1 */
+  first=visit_all(0);
+  clear_visited((cellno)n_columns*n_rows);
+  second=visit_all(first);
+}
+
+/* The walls of a big maze make a lot of PostScript, so we build it up
+ * in memory and write it out in big pieces; and the walls of each
+ * column are packed three bits to a cell, and then written in ASCII85
+ * (four bytes to five characters), for the printer to unpack.
+ */
+#define Out_buffer (1<<20)
+
+typedef struct text {
+  char *s;
+  size_t len,size;
+} text;
+
+/* Make room for another |n| characters at the end of |t|.
+ */
+static void text_room(text *t, size_t n) {
+  if (t->len+n<t->size) return;
+  t->size=2*t->size+n+1;
+  t->s=realloc(t->s,t->size);
+  if (!t->s) {
+    fprintf(stderr,"! I couldn't get enough memory for the output.\n");
+    exit(1);
+  }
+}
+
+static void add_text(text *t, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  for (;;) {
+    va_start(ap,fmt);
+    n=vsnprintf(t->s+t->len,t->size-t->len,fmt,ap);
+    va_end(ap);
+    if (n<0) {
+      fprintf(stderr,"! Gareth screwed up (vsnprintf failed).\n");
+      exit(1);
+    }
+    if (t->len+n<t->size) { t->len+=n; return; }
+    text_room(t,n);
   }
+}
+
+static void put_text(text *t) {
+  fwrite(t->s,1,t->len,stdout);
+  t->len=0;
+}
+
+/* ----- Packing walls ----- */
+
+/* |acc| has |n_acc| bits that haven't made a byte yet, and |word| has
+ * |n_word| bytes that haven't been written yet; |n_chars| is how much
+ * of the current line we've used.
+ */
+typedef struct packer {
+  text *t;
+  uint32_t acc,word;
+  int n_acc,n_word,n_chars;
+} packer;
+
+static void begin_packing(packer *p, text *t) {
+  p->t=t;
+  p->acc=p->word=0;
+  p->n_acc=p->n_word=p->n_chars=0;
+}
+
+/* Write the |n| bytes in |p->word|: five characters for four bytes,
+ * or |n+1| for the last few.
+ */
+static void pack_word(packer *p, int n) {
+  text *t=p->t;
+  uint32_t w=p->word;
+  int i;
+  text_room(t,7);
+  if (n==4 && w==0) { t->s[t->len++]='z'; ++p->n_chars; }
   else {
-    n->length=l1;
-    n->first=ln1->first;
-    n->second=ln1->second;
+    for (i=4;i>=0;--i) { t->s[t->len+i]=(char)('!'+w%85); w/=85; }
+    t->len+=n+1; p->n_chars+=n+1;
   }
+  if (p->n_chars>=75) { t->s[t->len++]='\n'; p->n_chars=0; }
+  p->word=0; p->n_word=0;
 }
 
-/* Print out the maze.
- * |start| and |end| are the starting and ending points of the maze,
- * of course; they're integers using the same correspondence as
- * everywhere else in the program.
- * We produce PostScript; we define three operators:
- * N draws the north wall of a given cell, NE,NW draw the NE,NW walls.
- * Cells are given as <place in column> <column number>.
+static void pack_byte(packer *p, uint32_t b) {
+  p->word=p->word<<8|b;
+  if (++p->n_word==4) pack_word(p,4);
+}
+
+/* Another cell, with walls |x| (N=1, NW=2, NE=4). */
+static void pack_cell(packer *p, int x) {
+  p->acc=p->acc<<3|x;
+  if ((p->n_acc+=3)>=8) {
+    p->n_acc-=8;
+    pack_byte(p,p->acc>>p->n_acc);
+    p->acc&=(1u<<p->n_acc)-1;
+  }
+}
+
+static void end_packing(packer *p) {
+  if (p->n_acc) pack_byte(p,p->acc<<(8-p->n_acc));
+  if (p->n_word) { p->word<<=8*(4-p->n_word); pack_word(p,p->n_word); }
+  add_text(p->t,"~>\n");
+}
+
+/* ----- Tracing walls ----- */
+
+/* Normally each wall is drawn by itself, as a little filled hexagon,
+ * which is a lot of work for the printer when there are millions of
+ * them. With -lines we join walls that meet end to end into long
+ * polylines instead, and stroke a column's worth of them at a time.
+ *
+ * We go from corner to corner of the cells. Each corner is the top
+ * left (TL) or top right (TR) corner of just one cell, and has three
+ * walls: a TL has its cell's N and NW walls, and the NE wall of a cell
+ * in the column to the left; a TR has its cell's N and NE walls, and
+ * the NW wall of a cell in the column to the right. Each wall belongs
+ * to the cell it's the N, NW or NE wall of. Cells in column -1, and
+ * column |n_columns|, and row -1, have the bits of the outside of the
+ * maze that |print_maze| draws.
+ *
+ * Corner (X,Y) is at (X/2, Y*sqrt(3)/2) in the coordinates |M| uses;
+ * the cell in column c, row r has its centre at X=3c, Y=2r+(c&1). A
+ * step along a wall is a letter: a,b are (+2,0),(-2,0); c,d are
+ * (+1,+1),(-1,-1); e,f are (-1,+1),(+1,-1).
  */
-#define Check { if ((nn+=10)>=70) { printf("\n"); nn=0; } else printf(" "); }
-#define Check1 { if ((nn+=2)>=70) { printf("\n"); nn=0; } else printf(" "); }
-static void print_maze(int start, int end) {
-  wall *p=first_wall;
-  double xs=500/((n_columns+1)*1.36602540378444);
-  double ys=700/((n_rows+1)*1.73205080756888);
-  double scale = (xs<ys) ? xs : ys;
-  int i,j,x;
-  int nn=0;	/* number of walls on current line */
-  printf("%%!PS\n");
-  printf("/Times-Roman findfont 10 scalefont setfont\n");
-  printf("30 770 moveto (Maze produced by ) show\n");
-  printf("/Times-Italic findfont 10 scalefont setfont\n");
-  printf("(make-maze ) show\n");
-  printf("/Times-Roman findfont 10 scalefont setfont\n");
-  printf("30 755 moveto (Parameters: %dx%d, seed=%d) show\n",
-         n_columns,n_rows,seed);
-  printf("\n30 40 translate\n");
-  printf("%lg %lg scale\n",scale,scale);
-  printf("1 1 translate\n");
-  printf("\n");
+static int lines=0;
+
+enum { TL, TR };
+
+typedef struct edge {
+  int c,r,bit;			/* whose wall it is */
+  int to_c,to_r,to_side;	/* the corner at the other end */
+  char step;			/* how to get there */
+} edge;
+
+/* The |i|th wall at corner |side| of cell |c|,|r|. */
+static void get_edge(int c, int r, int side, int i, edge *e) {
+  int odd=c&1;
+  if (side==TL) switch (i) {
+    case 0: e->c=c; e->r=r; e->bit=N_open;
+            e->to_c=c; e->to_r=r; e->step='a'; break;
+    case 1: e->c=c; e->r=r; e->bit=NW_open;
+            e->to_c=c-1; e->to_r=r-!odd; e->step='d'; break;
+    default: e->c=c-1; e->r=r+odd; e->bit=NE_open;
+             e->to_c=c-1; e->to_r=r+odd; e->step='e'; break;
+  }
+  else switch (i) {
+    case 0: e->c=c; e->r=r; e->bit=N_open;
+            e->to_c=c; e->to_r=r; e->step='b'; break;
+    case 1: e->c=c; e->r=r; e->bit=NE_open;
+            e->to_c=c+1; e->to_r=r-!odd; e->step='f'; break;
+    default: e->c=c+1; e->r=r+odd; e->bit=NW_open;
+             e->to_c=c+1; e->to_r=r+odd; e->step='c'; break;
+  }
+  e->to_side=!side;
+}
+
+/* The walls of cell |c|,|r| that we draw, counting the outside. */
+static int walls_of(int c, int r) {
+  if (c>=0 && c<n_columns && r>=0 && r<n_rows)
+    return ~Open((cellno)c*n_rows+r)&7;
+  if (r==-1 && c>=0 && c<n_columns)
+    return (c&1) ? N_open|NW_open|(c<n_columns-1 ? NE_open : 0) : N_open;
+  if (c==-1 && r>=-1 && r<=n_rows-2) return NE_open;
+  if (c==n_columns && r>=-(n_columns&1) && r<=n_rows-1-(n_columns&1))
+    return NW_open;
+  return 0;
+}
+
+/* We trace the walls of the cells in columns |c_lo..c_hi| and rows
+ * |r_lo..r_hi|; |left[]| has the ones we haven't drawn yet.
+ */
+typedef struct tracer {
+  text *t;
+  unsigned char *left;
+  int c_lo,c_hi,r_lo,r_hi;
+} tracer;
+
+static unsigned char *left_at(tracer *tr, int c, int r) {
+  if (c<tr->c_lo || c>tr->c_hi || r<tr->r_lo || r>tr->r_hi) return 0;
+  return tr->left+(size_t)(c-tr->c_lo)*(tr->r_hi-tr->r_lo+1)+(r-tr->r_lo);
+}
+
+/* How many walls not yet drawn at a corner; and the first of them. */
+static int corner_degree(tracer *tr, int c, int r, int side, edge *first) {
+  edge e;
+  unsigned char *l;
+  int i,n=0;
+  for (i=0;i<3;++i) {
+    get_edge(c,r,side,i,&e);
+    if ((l=left_at(tr,e.c,e.r)) && (*l&e.bit)) { if (!n++) *first=e; }
+  }
+  return n;
+}
+
+/* Draw walls from a corner until we get stuck. In the PostScript,
+ * <X> <Y> (<steps>) L draws the steps from corner X,Y.
+ */
+static void trace_from(tracer *tr, int c, int r, int side) {
+  text *t=tr->t;
+  edge e;
+  int n=0;
+  add_text(t,"%d %d (",3*c+(side==TL ? -1 : 1),2*r+(c&1)+1);
+  while (corner_degree(tr,c,r,side,&e)) {
+    *left_at(tr,e.c,e.r)&=~e.bit;
+    text_room(t,2);
+    if (++n%70==0) { t->s[t->len++]='\\'; t->s[t->len++]='\n'; }
+    t->s[t->len++]=e.step;
+    c=e.to_c; r=e.to_r; side=e.to_side;
+  }
+  add_text(t,") L\n");
+}
+
+/* Trace all the walls of the cells in columns |c_lo..c_hi| and rows
+ * |r_lo..r_hi|, a column at a time, each between LS and LE. A trail has to start at a corner with an odd number
+ * of walls left, or it will stop at one, so we start from those first:
+ * that way each trail goes as far as it can. If |flush|, we write
+ * |t| out as we go.
+ */
+static void trace_walls(text *t, int flush,
+                        int c_lo, int c_hi, int r_lo, int r_hi) {
+  tracer tr;
+  int c,r,side,pass,n,started;
+  edge e;
+  tr.t=t; tr.c_lo=c_lo; tr.c_hi=c_hi; tr.r_lo=r_lo; tr.r_hi=r_hi;
+  tr.left=malloc((size_t)(c_hi-c_lo+1)*(r_hi-r_lo+1));
+  if (!tr.left) {
+    fprintf(stderr,"! I couldn't get enough memory for tracing walls.\n");
+    exit(1);
+  }
+  for (c=c_lo;c<=c_hi;++c) for (r=r_lo;r<=r_hi;++r)
+    *left_at(&tr,c,r)=(unsigned char)walls_of(c,r);
+  for (pass=0;pass<2;++pass) for (c=c_lo-1;c<=c_hi+1;++c) {
+    started=0;
+    for (r=r_lo-1;r<=r_hi+1;++r) for (side=TL;side<=TR;++side)
+      for (;;) {
+        n=corner_degree(&tr,c,r,side,&e);
+        if (n==0 || (n%2==0 && pass==0)) break;
+        if (!started) { add_text(t,"LS\n"); started=1; }
+        trace_from(&tr,c,r,side);
+      }
+    if (started) add_text(t,"LE\n");
+    if (flush && t->len>=Out_buffer) put_text(t);
+  }
+  free(tr.left);
+}
+
+/* ----- PostScript ----- */
+
+/* The PostScript procedures for drawing walls.
+ * N draws the north wall of the current cell, NE,NW draw the NE,NW walls.
+ * A moves up to the next cell, and B-H draw some walls and then do A:
+ * the letters count in binary, with N=1, NW=2, NE=4.
+ * M moves to a given cell: <place in column> <column number> M.
+ * <n> Col does n cells up from there, unpacking their walls from the
+ * ASCII85 that follows it, as |pack_cell| packed them.
+ * S, then any number of L, then E strokes walls traced by |trace_walls|.
+ * On other grids, N, NW and NE draw whatever those bits are there (see
+ * |Drawn|), and M goes to the bottom left of a cell rather than its
+ * middle; <dx> <dy> Dot puts a dot that far from there.
+ */
+static void print_procs(void) {
+#ifdef HEX
   printf("/M { dup 1 and 0 ne { exch .5 add exch } if\n");
   printf("     1.5 mul exch\n");
   printf("     1.73205080756888 mul\n");
@@ -455,56 +1309,732 @@ static void print_maze(int start, int end) {
   printf("/F { N NE A } bind def\n");
   printf("/G { NW NE A } bind def\n");
   printf("/H { NW N NE A } bind def\n");
-  /* Outer walls: */
-  printf("\n%% Outer walls:\n");
-  printf("-1 -1 M NE"); Check;
-  for (i=1;i<n_rows;++i) { printf("A NE"); Check; }
-  printf("0 0 M NW"); Check;
-  for (i=1;i<n_rows;++i) { printf("A NW"); Check; }
-  printf("0 %d M NE",n_columns-1); Check;
-  for (i=1;i<n_rows;++i) { printf("A NE"); Check; }
-  printf("%d %d M NW",-(n_columns&1),n_columns); Check;
-  for (i=1;i<n_rows;++i) { printf("A NW"); Check; }
-  for (i=0;i<n_columns;++i) {
-    printf("-1 %d M N",i); Check;
-    printf("%d %d M N",n_rows-1,i); Check;
-    if (i&1) {
-      printf("-1 %d M NW",i); Check;
-      if (i<n_columns-1) { printf("-1 %d M NE",i); Check; }
-      printf("%d %d M NW",n_rows-1,i); Check;
-      printf("%d %d M NE",n_rows-1,i); Check;
-    }
-  }
-  if (nn) printf("\n");
-  /* Inner walls: */
-  printf("\n%% Inner walls:\n");
-  for (i=0;i<n_columns;++i) {
-    printf("0 %d M",i); Check;
-    for (j=0;j<n_rows;++j) {
-      x=nodes[i*n_rows+j].exits;
-      if (i&1) x = ((x&Up) ? 0 : 1) | ((x&LUp) ? 0 : 2) | ((x&RUp) ? 0 : 4);
-          else x = ((x&Up) ? 0 : 1) | ((x&LEq) ? 0 : 2) | ((x&REq) ? 0 : 4);
-      printf("%c",65+x); Check1;
-    }
-  }
-#if 0
-  while (p) {
-    printf("%d %d ",p->lower%n_rows,p->lower/n_rows);
-    if (p->higher-p->lower==1) printf("N");
-    else if (p->higher>p->lower) printf("NE");
-    else printf("NW");
-    Check;
-    p=p->next;
+#elif defined(TRIANGLES)
+  printf("/M { .5 mul exch .866025403784439 mul newpath moveto } bind def\n");
+  printf("/A { 0 .866025403784439 rmoveto\n");
+  printf("     currentpoint newpath moveto } bind def\n");
+  printf("/UE { gsave 1 0 rmoveto -.5 .866025403784439 rlineto\n");
+  printf("      stroke grestore } bind def\n");
+  printf("/DE { gsave 1 .866025403784439 rmoveto -.5 -.866025403784439 rlineto\n");
+  printf("      stroke grestore } bind def\n");
+  printf("/DN { gsave 0 .866025403784439 rmoveto 1 0 rlineto\n");
+  printf("      stroke grestore } bind def\n");
+  printf("/B { A } bind def\n");
+  printf("/C { UE A } bind def\n");
+  printf("/D { UE A } bind def\n");
+  printf("/E { A } bind def\n");
+  printf("/F { DN A } bind def\n");
+  printf("/G { DE A } bind def\n");
+  printf("/H { DN DE A } bind def\n");
+#else
+# ifdef LAYERS
+  printf("/W %d def\n",layer_width);
+  printf("/M { dup W idiv add exch newpath moveto } bind def\n");
+  printf("/NE { gsave .3 .3 rmoveto .4 0 rlineto -.2 .4 rlineto\n");
+  printf("      closepath fill grestore\n");
+  printf("      gsave W 1.3 add .7 rmoveto .4 0 rlineto -.2 -.4 rlineto\n");
+  printf("      closepath fill grestore } bind def\n");
+# else
+  printf("/M { exch newpath moveto } bind def\n");
+  printf("/NE { } bind def\n");
+# endif
+  printf("/N { gsave 0 1 rmoveto 1 0 rlineto stroke grestore } bind def\n");
+  printf("/NW { gsave 1 0 rmoveto 0 1 rlineto stroke grestore } bind def\n");
+  printf("/A { 0 1 rmoveto currentpoint newpath moveto } bind def\n");
+  printf("/B { N A } bind def\n");
+  printf("/C { NW A } bind def\n");
+  printf("/D { NW N A } bind def\n");
+  printf("/E { NE A } bind def\n");
+  printf("/F { N NE A } bind def\n");
+  printf("/G { NW NE A } bind def\n");
+  printf("/H { NW N NE A } bind def\n");
+#endif
+#ifndef HEX
+  printf("/Dot { rmoveto currentpoint Dot_r 0 360 arc fill } bind def\n");
+#endif
+  printf("/Walls [ /A load /B load /C load /D load"
+         " /E load /F load /G load /H load ] def\n");
+  printf("/Cell { Nb 3 lt { /Acc Acc 8 bitshift Rd read pop add def\n");
+  printf("                  /Nb Nb 8 add def } if\n");
+  printf("        /Nb Nb 3 sub def\n");
+  printf("        Acc Nb neg bitshift\n");
+  printf("        /Acc Acc 1 Nb bitshift 1 sub and def\n");
+  printf("        Walls exch get exec } bind def\n");
+  printf("/Col { /Rd currentfile /ASCII85Decode filter def\n");
+  printf("       /Acc 0 def /Nb 0 def\n");
+  printf("       { Cell } repeat\n");
+  printf("       { Rd read not { exit } if pop } loop } bind def\n");
+  if (lines) {
+    printf("/Steps 128 array def\n");
+    printf("Steps 97 { 2 0 rlineto } put Steps 98 { -2 0 rlineto } put\n");
+    printf("Steps 99 { 1 1 rlineto } put Steps 100 { -1 -1 rlineto } put\n");
+    printf("Steps 101 { -1 1 rlineto } put Steps 102 { 1 -1 rlineto } put\n");
+    printf("/L { 3 1 roll moveto { Steps exch get exec } forall } bind def\n");
+    printf("/LS { matrix currentmatrix .5 .866025403784439 scale newpath\n");
+    printf("      .173205080756888 setlinewidth 2 setlinecap } bind def\n");
+    printf("/LE { setmatrix stroke } bind def\n");
+  }
+}
+
+#define Check { if ((nn+=10)>=70) { printf("\n"); nn=0; } else printf(" "); }
+
+#ifdef HEX
+/* Print out the maze.
+ * |start| and |end| are the starting and ending points of the maze,
+ * of course; they're integers using the same correspondence as
+ * everywhere else in the program.
+ * We produce PostScript, using the procedures above.
+ */
+static void print_maze(cellno start, cellno end) {
+  double xs=500/((n_columns+1)*1.36602540378444);
+  double ys=700/((n_rows+1)*1.73205080756888);
+  double scale = (xs<ys) ? xs : ys;
+  int i,j;
+  int nn=0;	/* number of walls on current line */
+  text t={0,0,0};
+  packer p;
+  printf("%%!PS\n");
+  printf("/Times-Roman findfont 10 scalefont setfont\n");
+  printf("30 770 moveto (Maze produced by ) show\n");
+  printf("/Times-Italic findfont 10 scalefont setfont\n");
+  printf("(make-maze ) show\n");
+  printf("/Times-Roman findfont 10 scalefont setfont\n");
+  printf("30 755 moveto (Parameters: %dx%d, seed=%d%s) show\n",
+         n_columns,n_rows,seed,branchy ? ", branchy" : "");
+  printf("\n30 40 translate\n");
+  printf("%lg %lg scale\n",scale,scale);
+  printf("1 1 translate\n");
+  printf("\n");
+  print_procs();
+  if (lines) {
+    printf("\n%% Walls:\n");
+    trace_walls(&t,1,-1,n_columns,-1,n_rows-1);
   }
+  else {
+    /* Outer walls: */
+    printf("\n%% Outer walls:\n");
+    printf("-1 -1 M NE"); Check;
+    for (i=1;i<n_rows;++i) { printf("A NE"); Check; }
+    printf("0 0 M NW"); Check;
+    for (i=1;i<n_rows;++i) { printf("A NW"); Check; }
+    printf("0 %d M NE",n_columns-1); Check;
+    for (i=1;i<n_rows;++i) { printf("A NE"); Check; }
+    printf("%d %d M NW",-(n_columns&1),n_columns); Check;
+    for (i=1;i<n_rows;++i) { printf("A NW"); Check; }
+    for (i=0;i<n_columns;++i) {
+      printf("-1 %d M N",i); Check;
+      printf("%d %d M N",n_rows-1,i); Check;
+      if (i&1) {
+        printf("-1 %d M NW",i); Check;
+        if (i<n_columns-1) { printf("-1 %d M NE",i); Check; }
+        printf("%d %d M NW",n_rows-1,i); Check;
+        printf("%d %d M NE",n_rows-1,i); Check;
+      }
+    }
+    if (nn) printf("\n");
+    /* Inner walls: */
+    printf("\n%% Inner walls:\n");
+    for (i=0;i<n_columns;++i) {
+      add_text(&t,"0 %d M %d Col\n",i,n_rows);
+      begin_packing(&p,&t);
+      /* One bit for each of the N, NW, NE walls that's still up: */
+      for (j=0;j<n_rows;++j) pack_cell(&p,~Open((cellno)i*n_rows+j)&7);
+      end_packing(&p);
+      if (t.len>=Out_buffer) put_text(&t);
+    }
+#if 0
+    for (i=0;i<n_walls;++i) {
+      printf("%d %d ",(int)(Lower(walls[i])%n_rows),(int)(Lower(walls[i])/n_rows));
+      if (Kind(walls[i])==North) printf("N");
+      else if (Kind(walls[i])>=NE_even) printf("NE");
+      else printf("NW");
+      Check;
+    }
 #endif
-  if (nn) printf("\n");
+  }
+  put_text(&t);
+  free(t.s);
   /* Start and end points: */
   printf("\n%% Start and end of path:\n");
-  printf("%d %d M currentpoint 0.3 0 360 arc fill\n",start%n_rows,start/n_rows);
-  printf("%d %d M currentpoint 0.3 0 360 arc fill\n",end%n_rows,end/n_rows);
+  printf("%d %d M currentpoint 0.3 0 360 arc fill\n",
+         (int)(start%n_rows),(int)(start/n_rows));
+  printf("%d %d M currentpoint 0.3 0 360 arc fill\n",
+         (int)(end%n_rows),(int)(end/n_rows));
   printf("\nshowpage\n");
 }
 
+#else
+/* The same, for other grids. For each, |Drawn(c,i,j)| is what to pack
+ * for cell |c|, in column |i| and row |j|: the walls of its we draw,
+ * and anything else we want to show. |print_outside()| draws the walls
+ * round the edge that aren't any cell's. The maze is |Grid_width| by
+ * |Grid_height|; |Centre(i,j,x,y)| sets |x|,|y| to how far the middle
+ * of cell (i,j) is from where |M| goes, and |Dot_r| is how big the
+ * dots at the ends are.
+ */
+# if defined(TRIANGLES)
+#  define Drawn(c,i,j) \
+  ((((i)+(j))&1) ? (~Open(c)&(N_open|E_open))|4 : ~Open(c)&E_open)
+#  define Grid_width (.5*n_columns+.5)
+#  define Grid_height (.866025403784439*n_rows)
+#  define Centre(i,j,x,y) \
+  { x=.5; y = (((i)+(j))&1) ? .577350269189626 : .288675134594813; }
+#  define Dot_r .15
+static void print_outside(void) {
+  int i,j;
+  for (j=0;j<n_rows;++j)	/* the left side */
+    printf("%d 0 M %s rlineto stroke\n",j&1 ? j+1 : j,
+           j&1 ? ".5 -.866025403784439" : ".5 .866025403784439");
+  for (i=0;i<n_columns;i+=2)	/* the bottoms of the ones pointing up */
+    printf("0 %d M 1 0 rlineto stroke\n",i);
+}
+# else
+#  ifdef LAYERS
+#   define Drawn(c,i,j) ((~Open(c)&(N_open|E_open))|(Open(c)&U_open))
+#   define Grid_width (n_columns+N_layers-1)
+#  else
+#   define Drawn(c,i,j) (~Open(c)&(N_open|E_open))
+#   define Grid_width n_columns
+#  endif
+#  define Grid_height n_rows
+#  define Centre(i,j,x,y) { x=.5; y=.5; }
+#  define Dot_r .3
+static void print_outside(void) {
+#  ifdef TORUS
+  /* The walls that wrap round are drawn on the right and at the top, as
+   * the walls of the cells there; here they are again, on the left and
+   * at the bottom.
+   */
+  int i,j;
+  for (j=0;j<n_rows;++j)
+    if (~Open((cellno)(n_columns-1)*n_rows+j)&E_open)
+      printf("0 %d moveto 0 1 rlineto stroke\n",j);
+  for (i=0;i<n_columns;++i)
+    if (~Open((cellno)i*n_rows+n_rows-1)&N_open)
+      printf("%d 0 moveto 1 0 rlineto stroke\n",i);
+#  else
+  int l;
+  for (l=0;l<N_layers;++l)
+    printf("%d %d moveto 0 %d rlineto 0 %d rmoveto %d 0 rlineto stroke\n",
+           l*(n_columns/N_layers+1),n_rows,-n_rows,0,n_columns/N_layers);
+#  endif
+}
+# endif
+
+static void print_maze(cellno start, cellno end) {
+  double xs=500/(Grid_width+1);
+  double ys=700/(Grid_height+1);
+  double scale = (xs<ys) ? xs : ys;
+  double x,y;
+  int i,j,k;
+  text t={0,0,0};
+  packer p;
+  cellno c;
+  printf("%%!PS\n");
+  printf("/Times-Roman findfont 10 scalefont setfont\n");
+  printf("30 770 moveto (Maze produced by ) show\n");
+  printf("/Times-Italic findfont 10 scalefont setfont\n");
+  printf("(make-maze ) show\n");
+  printf("/Times-Roman findfont 10 scalefont setfont\n");
+  printf("30 755 moveto (Parameters: %dx%d",n_columns/N_layers,n_rows);
+  if (N_layers>1) printf("x%d",N_layers);
+  printf(", %s, seed=%d%s) show\n",Grid_name,seed,branchy ? ", branchy" : "");
+  printf("\n30 40 translate\n");
+  printf("%lg %lg scale\n",scale,scale);
+  printf(".5 .5 translate\n");
+  printf(".1 setlinewidth 2 setlinecap\n");
+  printf("/Dot_r %lg def\n",Dot_r);
+  printf("\n");
+  print_procs();
+  printf("\n%% Outer walls:\n");
+  print_outside();
+  printf("\n%% Inner walls:\n");
+  for (i=0;i<n_columns;++i) {
+    add_text(&t,"0 %d M %d Col\n",i,n_rows);
+    begin_packing(&p,&t);
+    for (j=0;j<n_rows;++j) pack_cell(&p,Drawn((cellno)i*n_rows+j,i,j));
+    end_packing(&p);
+    if (t.len>=Out_buffer) put_text(&t);
+  }
+  put_text(&t);
+  free(t.s);
+  printf("\n%% Start and end of path:\n");
+  for (k=0;k<2;++k) {
+    c = k ? end : start;
+    i=(int)(c/n_rows); j=(int)(c%n_rows);
+    Centre(i,j,x,y)
+    printf("%d %d M %lg %lg Dot\n",j,i,x,y);
+  }
+  printf("\nshowpage\n");
+}
+#endif
+
+/* ***************************************************************
+ * A big maze on one page has walls too thin to see, and takes the
+ * printer a long time. With -tiles <across>x<down> we spread it over
+ * that many pages instead, all at the same scale, each with only the
+ * walls near its own tile. Neighbouring pages overlap a little, and
+ * have marks at the corners of the tile, so that you can trim them and
+ * stick them together.
+ * The pages are independent, so with threads we do several at once,
+ * each into a |text| of its own, and print them in order afterwards.
+ * **************************************************************** */
+
+static int tiles_across=0,tiles_down=0;
+
+/* Like |Check|, for a |text|: |w| is how wide the last thing was,
+ * and |*nn| how far along the line we are.
+ */
+static void add_gap(text *t, int *nn, int w) {
+  if ((*nn+=w)>=70) { add_text(t,"\n"); *nn=0; }
+  else add_text(t," ");
+}
+
+/* ----- One page ----- */
+
+/* Page |k| is tile |k%tiles_across| across and |k/tiles_across| down,
+ * counting from the top left; it has columns |c0..c1-1| and rows
+ * |r0..r1-1|. |Overlap| is how much further than its tile a page goes,
+ * in the units |M| uses. A cell's walls reach a little way into the
+ * cells around it, so we print those of one more row and column all
+ * round; with |Overlap| under .7 nothing further out shows.
+ */
+#define Overlap 0.5
+static double tile_scale;
+static text *pages;	/* |pages[i]| is for tile |first_page+i| */
+static int first_page;
+static cellno tile_start,tile_end;
+
+static void tile_bounds(int k, int *c0, int *c1, int *r0, int *r1) {
+  int across=k%tiles_across,down=k/tiles_across;
+  *c0=(int)((cellno)n_columns*across/tiles_across);
+  *c1=(int)((cellno)n_columns*(across+1)/tiles_across);
+  *r1=(int)((cellno)n_rows*(tiles_down-down)/tiles_down);
+  *r0=(int)((cellno)n_rows*(tiles_down-down-1)/tiles_down);
+}
+
+/* A run of |NE| or |NW| walls up the side of column |c|, from row |r|
+ * to row |r_end|, but only the ones in rows |lo..hi|.
+ */
+static void add_side(text *t, int *nn, int c, int r, int r_end, char *w,
+                     int lo, int hi) {
+  if (r<lo) r=lo;
+  if (r_end>hi) r_end=hi;
+  if (r>r_end) return;
+  add_text(t,"%d %d M %s",r,c,w); add_gap(t,nn,10);
+  while (++r<=r_end) { add_text(t,"A %s",w); add_gap(t,nn,10); }
+}
+
+static void print_tile(int i0) {
+  text *t=pages+i0;
+  int k=first_page+i0;
+  int c0,c1,r0,r1;	/* the tile */
+  int ca,cb,ra,rb;	/* the cells whose walls we print */
+  double x0,x1,y0,y1;	/* the tile's corners */
+  double xa,xb,ya,yb;	/* the page's corners */
+  int i,j,nn=0;
+  packer p;
+  tile_bounds(k,&c0,&c1,&r0,&r1);
+  ca = c0>0 ? c0-1 : 0; cb = c1<n_columns ? c1 : n_columns-1;
+  ra = r0>0 ? r0-1 : 0; rb = r1<n_rows ? r1 : n_rows-1;
+  x0=1.5*c0-.75; x1=1.5*c1-.75;
+  y0=1.73205080756888*r0-.866025403784439;
+  y1=1.73205080756888*r1-.866025403784439;
+  xa = c0>0 ? x0-Overlap : -2.5;
+  xb = c1<n_columns ? x1+Overlap : 1.5*n_columns+1;
+  ya = r0>0 ? y0-Overlap : -2.5;
+  yb = r1<n_rows ? y1+Overlap : 1.73205080756888*(n_rows+.5)+1;
+  add_text(t,"%%%%Page: %d %d\n",k+1,k+1);
+  add_text(t,"save\n");
+  add_text(t,"/Times-Roman findfont 10 scalefont setfont\n");
+  add_text(t,"30 770 moveto (Maze produced by ) show\n");
+  add_text(t,"/Times-Italic findfont 10 scalefont setfont\n");
+  add_text(t,"(make-maze ) show\n");
+  add_text(t,"/Times-Roman findfont 10 scalefont setfont\n");
+  add_text(t,"30 755 moveto (Parameters: %dx%d, seed=%d%s;"
+             " tile %d across, %d down, of %dx%d) show\n",
+           n_columns,n_rows,seed,branchy ? ", branchy" : "",
+           k%tiles_across+1,k/tiles_across+1,tiles_across,tiles_down);
+  add_text(t,"\n30 40 translate\n");
+  add_text(t,"%lg %lg scale\n",tile_scale,tile_scale);
+  add_text(t,"%lg %lg translate\n",-xa,-ya);
+  /* Corner marks, outside the tile: */
+  add_text(t,"gsave .05 setlinewidth\n");
+  add_text(t,"%lg %lg moveto 0 -.5 rlineto -.5 0 rmoveto .5 0 rlineto\n",x0,y0);
+  add_text(t,"%lg %lg moveto 0 -.5 rlineto .5 0 rmoveto -.5 0 rlineto\n",x1,y0);
+  add_text(t,"%lg %lg moveto 0 .5 rlineto -.5 0 rmoveto .5 0 rlineto\n",x0,y1);
+  add_text(t,"%lg %lg moveto 0 .5 rlineto .5 0 rmoveto -.5 0 rlineto\n",x1,y1);
+  add_text(t,"stroke grestore\n");
+  add_text(t,"newpath %lg %lg moveto %lg %lg lineto %lg %lg lineto"
+             " %lg %lg lineto closepath clip\n",xa,ya,xb,ya,xb,yb,xa,yb);
+  if (lines) {
+    add_text(t,"\n%% Walls:\n");
+    trace_walls(t,0,ca-(c0==0),cb+(c1==n_columns),ra-(r0==0),rb);
+  }
+  else {
+    /* Outer walls: */
+    add_text(t,"\n%% Outer walls:\n");
+    if (c0==0) {
+      add_side(t,&nn,-1,-1,n_rows-2,"NE",ra-1,rb);
+      add_side(t,&nn,0,0,n_rows-1,"NW",ra-1,rb);
+    }
+    if (c1==n_columns) {
+      add_side(t,&nn,n_columns-1,0,n_rows-1,"NE",ra-1,rb);
+      add_side(t,&nn,n_columns,-(n_columns&1),n_rows-1-(n_columns&1),"NW",
+               ra-1,rb);
+    }
+    for (i=ca;i<=cb;++i) {
+      if (r0==0) {
+        add_text(t,"-1 %d M N",i); add_gap(t,&nn,10);
+        if (i&1) {
+          add_text(t,"-1 %d M NW",i); add_gap(t,&nn,10);
+          if (i<n_columns-1) { add_text(t,"-1 %d M NE",i); add_gap(t,&nn,10); }
+        }
+      }
+      if (r1==n_rows) {
+        add_text(t,"%d %d M N",n_rows-1,i); add_gap(t,&nn,10);
+        if (i&1) {
+          add_text(t,"%d %d M NW",n_rows-1,i); add_gap(t,&nn,10);
+          add_text(t,"%d %d M NE",n_rows-1,i); add_gap(t,&nn,10);
+        }
+      }
+    }
+    if (nn) add_text(t,"\n");
+    /* Inner walls: */
+    add_text(t,"\n%% Inner walls:\n");
+    for (i=ca;i<=cb;++i) {
+      add_text(t,"%d %d M %d Col\n",ra,i,rb-ra+1);
+      begin_packing(&p,t);
+      for (j=ra;j<=rb;++j) pack_cell(&p,~Open((cellno)i*n_rows+j)&7);
+      end_packing(&p);
+    }
+  }
+  /* Start and end points, if they're here: */
+  for (i=0;i<2;++i) {
+    cellno c = i ? tile_end : tile_start;
+    j=(int)(c/n_rows);
+    if (j>=ca && j<=cb && c%n_rows>=ra && c%n_rows<=rb)
+      add_text(t,"%d %d M currentpoint 0.3 0 360 arc fill\n",
+               (int)(c%n_rows),j);
+  }
+  add_text(t,"restore showpage\n");
+}
+
+/* ----- All the pages ----- */
+
+static void print_tiles(cellno start, cellno end) {
+  int n=tiles_across*tiles_down;
+  int batch=4*n_threads;
+  int k,i;
+  double w=1.5*((n_columns+tiles_across-1)/tiles_across)+2*Overlap+3.5;
+  double h=1.73205080756888*((n_rows+tiles_down-1)/tiles_down)+2*Overlap+4.5;
+  tile_scale = 500/w<700/h ? 500/w : 700/h;
+  tile_start=start; tile_end=end;
+  pages=calloc(batch,sizeof(text));
+  if (!pages) {
+    fprintf(stderr,"! I couldn't get enough memory for |pages|.\n");
+    exit(1);
+  }
+  printf("%%!PS-Adobe-3.0\n");
+  printf("%%%%LanguageLevel: 2\n");
+  printf("%%%%Pages: %d\n",n);
+  printf("%%%%EndComments\n");
+  printf("%%%%BeginProlog\n");
+  print_procs();
+  printf("%%%%EndProlog\n");
+  for (k=0;k<n;k+=batch) {
+    if (batch>n-k) batch=n-k;
+    first_page=k;
+    run_jobs(print_tile,batch);
+    for (i=0;i<batch;++i) {
+      fwrite(pages[i].s,1,pages[i].len,stdout);
+      pages[i].len=0;
+    }
+  }
+  for (i=0;i<4*n_threads;++i) free(pages[i].s);
+  free(pages);
+  printf("%%%%Trailer\n");
+  printf("%%%%EOF\n");
+}
+
+/* ***************************************************************
+ * With -stream we don't make the whole maze and then print it: we
+ * make it a column at a time, left to right, print each column as soon
+ * as it's finished, and forget it. That takes memory for a column or
+ * two, however long the maze is, so you can have as many columns as
+ * you like (well, up to 2^63).
+ * We can't use Kruskal's method for that; instead we use Eller's,
+ * which obfus-maze.c does (for a square grid) in about 40 lines.
+ * The cells of the current column are labelled with which component
+ * they're in, as far as the maze so far is concerned. To do the next
+ * column, we knock down some of the walls between the two columns at
+ * random, never joining two cells that are already connected; then,
+ * for each component that didn't get through, we knock down one of its
+ * walls into the next column, since otherwise it would be cut off for
+ * ever; then we knock down some of the walls between cells in the new
+ * column. In the last column, we knock down every wall between cells
+ * that aren't connected yet, and that joins everything up.
+ * The maze is printed on as many pages as it takes, with the scale
+ * chosen so that a column fills the height of a page. Since we never
+ * see the whole maze, we can't look for the longest path in it; the
+ * start is at the bottom left, and the end at the top right.
+ * **************************************************************** */
+
+static cellno s_columns;	/* number of columns, with -stream */
+
+/* ----- Keeping track of components ----- */
+
+/* |label[j]| is the component of cell |j| of the current column, given
+ * as the first cell in the column that's in it. While we work out the
+ * next column, we keep a little union-find structure in |parent|:
+ * 0..n_rows-1 are the current column, and n_rows..2*n_rows-1 the next.
+ * Everything here has |n_rows| entries, or twice that.
+ */
+static int *label,*parent,*first_in;
+static unsigned char *this_bits,*next_bits;	/* as in |open_walls| */
+static unsigned char *went_on;	/* by label: knocked through yet? */
+static int *n_ways,*way;	/* by label: walls we could knock through */
+
+static int s_find(int x) {
+  while (parent[x]!=x) { parent[x]=parent[parent[x]]; x=parent[x]; }
+  return x;
+}
+
+/* Put |x| and |y| in the same component, and return 1; or return 0 if
+ * they already were.
+ */
+static int s_join(int x, int y) {
+  x=s_find(x); y=s_find(y);
+  if (x==y) return 0;
+  parent[x]=y;
+  return 1;
+}
+
+/* Tossing a coin, 32 times for each call of |rng_next|. */
+static uint32_t coin_bits;
+static int n_coins;
+static int coin(void) {
+  if (!n_coins) { coin_bits=rng_next(&main_rng); n_coins=32; }
+  return (coin_bits>>--n_coins)&1;
+}
+
+/* ----- Walls between columns ----- */
+
+/* There are |2*n_rows-1| walls between column |k| and column |k+1|.
+ * |cross_wall(k,e,&a,&b)| says that wall number |e| is between cell
+ * |a| of column |k| and cell |b| of column |k+1|. Half of them are
+ * NE walls of column |k|, and half are NW walls of column |k+1|;
+ * |knock_through(k,e)| marks wall |e| as open in the right one.
+ */
+static void cross_wall(cellno k, int e, int *a, int *b) {
+  int j=e>>1;
+  *a=j; *b=j;
+  if (e&1) { if (k&1) ++*b; else ++*a; }
+}
+
+static void knock_through(cellno k, int e) {
+  if ((e&1)==(int)(k&1)) this_bits[e>>1]|=NE_open;
+  else next_bits[e>>1]|=NW_open;
+}
+
+/* Work out which walls between column |k| and column |k+1| come down.
+ */
+static void stream_across(cellno k) {
+  int n=n_rows;
+  int e,a,b,j,l;
+  for (j=0;j<n;++j) {
+    parent[j]=label[j]; parent[n+j]=n+j;
+    went_on[j]=0; n_ways[j]=0; next_bits[j]=0;
+  }
+  /* Some walls at random: */
+  for (e=0;e<2*n-1;++e) if (coin()) {
+    cross_wall(k,e,&a,&b);
+    if (s_join(a,n+b)) { knock_through(k,e); went_on[label[a]]=1; }
+  }
+  /* And one more for each component that didn't get through, chosen
+   * at random from all its walls into the next column:
+   */
+  for (e=0;e<2*n-1;++e) {
+    cross_wall(k,e,&a,&b);
+    l=label[a];
+    if (!went_on[l] && !rng_below(&main_rng,(uint32_t)++n_ways[l])) way[l]=e;
+  }
+  for (l=0;l<n;++l) if (n_ways[l]) {
+    cross_wall(k,way[l],&a,&b);
+    if (!s_join(a,n+b)) {
+      fprintf(stderr,"! Gareth screwed up (column %ld is cut off).\n",(long)k);
+      exit(1);
+    }
+    knock_through(k,way[l]);
+  }
+}
+
+/* Work out which walls between cells of the next column come down, and
+ * label its cells. If it's the |last| column, they all come down unless
+ * that would make a loop.
+ */
+static void stream_up(int last) {
+  int n=n_rows;
+  int j,r;
+  for (j=0;j<n-1;++j)
+    if ((last || coin()) && s_join(n+j,n+j+1)) next_bits[j]|=N_open;
+  for (j=0;j<2*n;++j) first_in[j]=-1;
+  for (j=0;j<n;++j) {
+    r=s_find(n+j);
+    if (first_in[r]<0) first_in[r]=j;
+    label[j]=first_in[r];
+  }
+}
+
+/* ----- Printing ----- */
+
+static cellno page_start;	/* first column on this page */
+static cellno page_no;
+static int per_page;		/* columns on each page */
+static double s_scale;
+static int nn;			/* for |Check| */
+
+static void begin_page(void) {
+  ++page_no;
+  printf("%%%%Page: %ld %ld\n",(long)page_no,(long)page_no);
+  printf("save\n");
+  printf("/Times-Roman findfont 10 scalefont setfont\n");
+  printf("30 770 moveto (Maze produced by ) show\n");
+  printf("/Times-Italic findfont 10 scalefont setfont\n");
+  printf("(make-maze ) show\n");
+  printf("/Times-Roman findfont 10 scalefont setfont\n");
+  printf("30 755 moveto (Parameters: %ldx%d, seed=%d, streamed; page %ld)"
+         " show\n",(long)s_columns,n_rows,seed,(long)page_no);
+  printf("\n30 40 translate\n");
+  printf("%lg %lg scale\n",s_scale,s_scale);
+  printf("1 1 translate\n");
+  nn=0;
+}
+
+static void end_page(void) {
+  if (nn) printf("\n");
+  printf("restore showpage\n");
+}
+
+/* Print the walls of column |k| whose bits are in |mask|, from |bits|.
+ */
+static void print_column(cellno k, unsigned char *bits, int mask) {
+  static text t;
+  packer p;
+  int x=(int)(k-page_start);
+  int j;
+  if (nn) { printf("\n"); nn=0; }
+  add_text(&t,"0 %d M %d Col\n",x,n_rows);
+  begin_packing(&p,&t);
+  for (j=0;j<n_rows;++j) pack_cell(&p,~bits[j]&mask);
+  end_packing(&p);
+  put_text(&t);
+}
+
+/* Print column |k| (all of whose walls we know, now), and its bit of
+ * the outside of the maze, and start a new page after it if it's time.
+ * We always print the left and right sides of each page in full, even
+ * though that means doing some walls twice, so the pages can be laid
+ * side by side. That's why we want |next_bits| here: it has the NW
+ * walls of the next column.
+ */
+static void stream_print(cellno k) {
+  int x=(int)(k-page_start);
+  int j;
+  print_column(k,this_bits,N_open|NW_open|NE_open);
+  printf("-1 %d M N",x); Check;
+  printf("%d %d M N",n_rows-1,x); Check;
+  if (k&1) {
+    printf("-1 %d M NW",x); Check;
+    if (k<s_columns-1) { printf("-1 %d M NE",x); Check; }
+    printf("%d %d M NW",n_rows-1,x); Check;
+    printf("%d %d M NE",n_rows-1,x); Check;
+  }
+  if (k==0) {
+    printf("-1 -1 M NE"); Check;
+    for (j=1;j<n_rows;++j) { printf("A NE"); Check; }
+    printf("0 0 M NW"); Check;
+    for (j=1;j<n_rows;++j) { printf("A NW"); Check; }
+    if (nn) { printf("\n"); nn=0; }
+    printf("0 0 M currentpoint 0.3 0 360 arc fill\n");
+  }
+  if (k==s_columns-1) {
+    printf("0 %d M NE",x); Check;
+    for (j=1;j<n_rows;++j) { printf("A NE"); Check; }
+    printf("%d %d M NW",-(int)(s_columns&1),x+1); Check;
+    for (j=1;j<n_rows;++j) { printf("A NW"); Check; }
+    if (nn) { printf("\n"); nn=0; }
+    printf("%d %d M currentpoint 0.3 0 360 arc fill\n",n_rows-1,x);
+    end_page();
+  }
+  else if (x==per_page-1) {
+    print_column(k+1,next_bits,NW_open);
+    end_page();
+    page_start=k+1;
+    begin_page();
+    print_column(k,this_bits,NE_open);
+  }
+}
+
+/* ----- Putting it together ----- */
+
+static void begin_columns(void) {
+  int n=n_rows;
+  label=malloc(n*sizeof(int)); parent=malloc(2*n*sizeof(int));
+  first_in=malloc(2*n*sizeof(int));
+  this_bits=malloc(n); next_bits=malloc(n); went_on=malloc(n);
+  n_ways=malloc(n*sizeof(int)); way=malloc(n*sizeof(int));
+  if (!label || !parent || !first_in || !this_bits || !next_bits
+      || !went_on || !n_ways || !way) {
+    fprintf(stderr,"! I couldn't get enough memory for a column.\n");
+    exit(1);
+  }
+}
+
+static void end_columns(void) {
+  free(label); free(parent); free(first_in);
+  free(this_bits); free(next_bits); free(went_on);
+  free(n_ways); free(way);
+}
+
+static void stream_maze(void) {
+  int n=n_rows;
+  int j;
+  cellno k;
+  unsigned char *t;
+  begin_columns();
+  s_scale=700/((n_rows+1)*1.73205080756888);
+  if (s_scale>20) s_scale=20;
+  per_page=(int)(500/(s_scale*1.5))-1;
+  per_page&=~1;	/* so that every page starts on an even column */
+  if (per_page<2) per_page=2;
+  printf("%%!PS-Adobe-3.0\n");
+  printf("%%%%LanguageLevel: 2\n");
+  printf("%%%%Pages: (atend)\n");
+  printf("%%%%EndComments\n");
+  printf("%%%%BeginProlog\n");
+  print_procs();
+  printf("%%%%EndProlog\n");
+  begin_page();
+  /* The first column is like any other, except that there's nothing
+   * to its left.
+   */
+  for (j=0;j<n;++j) { parent[n+j]=n+j; next_bits[j]=0; }
+  stream_up(0);
+  t=this_bits; this_bits=next_bits; next_bits=t;
+  for (k=0;k<s_columns-1;++k) {
+    stream_across(k);
+    stream_up(k==s_columns-2);
+    stream_print(k);
+    t=this_bits; this_bits=next_bits; next_bits=t;
+  }
+  stream_print(s_columns-1);
+  printf("%%%%Trailer\n");
+  printf("%%%%Pages: %ld\n",(long)page_no);
+  printf("%%%%EOF\n");
+  end_columns();
+}
+
 /* It's nice to have some idea of how long all this is taking.
  * So we keep track of the elapsed time and CPU time.
  */
@@ -535,46 +2065,661 @@ static void init_time(void) {
   real0=real1=time(0);
 }
 
+/* ***************************************************************
+ * How fast are the alternatives to |base| and |unify|? With
+ * -unionfind we don't make a maze; instead we make the same shuffled
+ * walls as we would, and see how long various ways of keeping track
+ * of components take to go through them, in nanoseconds per wall, and
+ * how many cache misses per wall they cause. We do that for the size
+ * asked for, and for a few sizes smaller, halving each time.
+ * **************************************************************** */
+
+/* ----- The contestants ----- */
+
+/* What we use: find with two-pass compression, union by size. */
+static cellno uf_compress(void) {
+  cellno i,n=0,x,y;
+  for (i=0;i<n_walls;++i) {
+    x=base(Lower(walls[i]));
+    y=base(Lower(walls[i])+kinds[Kind(walls[i])].delta);
+    if (x!=y) { unify(x,y); ++n; }
+  }
+  return n;
+}
+
+/* No compression at all, union by size. */
+static cellno uf_plain(void) {
+  cellno i,n=0,x,y;
+  for (i=0;i<n_walls;++i) {
+    x=Lower(walls[i]); y=x+kinds[Kind(walls[i])].delta;
+    while (cells[x]>=0) x=cells[x];
+    while (cells[y]>=0) y=cells[y];
+    if (x!=y) { unify(x,y); ++n; }
+  }
+  return n;
+}
+
+/* Path halving (point every other cell on the way at its grandparent),
+ * union by size.
+ */
+static cellno halve(cellno x) {
+  chain p,g;
+  while ((p=cells[x])>=0) {
+    if ((g=cells[p])<0) return p;
+    cells[x]=g; x=g;
+  }
+  return x;
+}
+static cellno uf_halving(void) {
+  cellno i,n=0,x,y;
+  for (i=0;i<n_walls;++i) {
+    x=halve(Lower(walls[i]));
+    y=halve(Lower(walls[i])+kinds[Kind(walls[i])].delta);
+    if (x!=y) { unify(x,y); ++n; }
+  }
+  return n;
+}
+
+/* Path splitting (point every cell on the way at its grandparent),
+ * union by size.
+ */
+static cellno split(cellno x) {
+  chain p,g;
+  while ((p=cells[x])>=0) {
+    if ((g=cells[p])<0) return p;
+    cells[x]=g; x=p;
+  }
+  return x;
+}
+static cellno uf_splitting(void) {
+  cellno i,n=0,x,y;
+  for (i=0;i<n_walls;++i) {
+    x=split(Lower(walls[i]));
+    y=split(Lower(walls[i])+kinds[Kind(walls[i])].delta);
+    if (x!=y) { unify(x,y); ++n; }
+  }
+  return n;
+}
+
+/* Path halving, union by rank; a base holds -1-rank instead of -size. */
+static cellno uf_rank(void) {
+  cellno i,n=0,x,y;
+  for (i=0;i<n_walls;++i) {
+    x=halve(Lower(walls[i]));
+    y=halve(Lower(walls[i])+kinds[Kind(walls[i])].delta);
+    if (x==y) continue;
+    if (cells[x]<cells[y]) cells[y]=(chain)x;
+    else {
+      if (cells[x]==cells[y]) --cells[y];
+      cells[x]=(chain)y;
+    }
+    ++n;
+  }
+  return n;
+}
+
+/* Rem's algorithm, with splicing: bases point at themselves, and a cell
+ * always points at a higher-numbered one. We walk up from both cells
+ * at once, always from the lower one, and hook it across as we go.
+ */
+static cellno uf_rem(void) {
+  cellno i,n=0,x,y;
+  chain z;
+  for (i=0;i<n_walls;++i) {
+    x=Lower(walls[i]); y=x+kinds[Kind(walls[i])].delta;
+    while (cells[x]!=cells[y]) {
+      if (cells[x]<cells[y]) {
+        if (x==cells[x]) { cells[x]=cells[y]; ++n; break; }
+        z=cells[x]; cells[x]=cells[y]; x=z;
+      }
+      else {
+        if (y==cells[y]) { cells[y]=cells[x]; ++n; break; }
+        z=cells[y]; cells[y]=cells[x]; y=z;
+      }
+    }
+  }
+  return n;
+}
+
+static struct {
+  char *name;
+  cellno (*run)(void);
+  int self_based;	/* bases point at themselves, rather than being <0 */
+} uf_variants[]={
+  { "compress", uf_compress, 0 },
+  { "plain", uf_plain, 0 },
+  { "halving", uf_halving, 0 },
+  { "splitting", uf_splitting, 0 },
+  { "rank", uf_rank, 0 },
+  { "rem", uf_rem, 1 }
+};
+#define N_variants ((int)(sizeof(uf_variants)/sizeof(uf_variants[0])))
+
+/* ----- Counting cache misses ----- */
+
+/* Where the system will let us (Linux, with perf events allowed), we
+ * count the cache misses in |miss_fd|; otherwise we just say "-".
+ */
+#ifdef CACHE_MISSES
+static int miss_fd=-1;
+static void init_misses(void) {
+  struct perf_event_attr a;
+  memset(&a,0,sizeof(a));
+  a.type=PERF_TYPE_HARDWARE;
+  a.size=sizeof(a);
+  a.config=PERF_COUNT_HW_CACHE_MISSES;
+  a.disabled=1;
+  a.exclude_kernel=1;
+  a.exclude_hv=1;
+  miss_fd=(int)syscall(__NR_perf_event_open,&a,0,-1,-1,0);
+}
+static void start_misses(void) {
+  if (miss_fd<0) return;
+  ioctl(miss_fd,PERF_EVENT_IOC_RESET,0);
+  ioctl(miss_fd,PERF_EVENT_IOC_ENABLE,0);
+}
+static double stop_misses(void) {
+  long long n;
+  if (miss_fd<0) return -1;
+  ioctl(miss_fd,PERF_EVENT_IOC_DISABLE,0);
+  if (read(miss_fd,&n,sizeof(n))!=sizeof(n)) return -1;
+  return (double)n;
+}
+#else
+static void init_misses(void) { }
+static void start_misses(void) { }
+static double stop_misses(void) { return -1; }
+#endif
+
+/* ----- The race ----- */
+
+/* Small mazes are over too quickly to time once, so we go round until
+ * at least this much CPU time has gone by.
+ */
+#define Min_bench_time (CLOCKS_PER_SEC/5)
+
+static void bench_size(int m, int n) {
+  cellno n_cells;
+  cellno i,joined;
+  int v,reps;
+  clock_t t,total;
+  double misses,ns;
+  set_size(m,n);
+  n_cells=(cellno)n_columns*n_rows;
+  rng_seed(&main_rng,(uint32_t)seed);
+  init_walls(n_columns,n_rows);
+  shuffle_walls();
+  cells=malloc(n_cells*sizeof(chain));
+  if (!cells) {
+    fprintf(stderr,"! I couldn't get enough memory for |cells|.\n");
+    exit(1);
+  }
+  printf("%6dx%-6d %11ld",m,n,(long)n_walls);
+  for (v=0;v<N_variants;++v) {
+    total=0; reps=0; misses=0;
+    do {
+      if (uf_variants[v].self_based) for (i=0;i<n_cells;++i) cells[i]=(chain)i;
+      else memset(cells,-1,n_cells*sizeof(chain));
+      start_misses();
+      t=clock();
+      joined=uf_variants[v].run();
+      total+=clock()-t;
+      misses+=stop_misses();
+      ++reps;
+      if (joined!=n_cells-1) {
+        fprintf(stderr,"! Gareth screwed up (%s joined %ld, not %ld).\n",
+                uf_variants[v].name,(long)joined,(long)(n_cells-1));
+        exit(1);
+      }
+    } while (total<Min_bench_time);
+    ns=1e9*total/CLOCKS_PER_SEC/reps/n_walls;
+    if (misses>=0) printf(" %6.1lf/%-5.2lf",ns,misses/reps/n_walls);
+    else printf(" %6.1lf/-    ",ns);
+    fflush(stdout);
+  }
+  printf("\n");
+  free(cells); free(walls);
+}
+
+static void bench_union_find(void) {
+  int sizes[32][2];
+  int k=0,v;
+  int m=n_columns/N_layers,n=n_rows;
+  while (k<32 && m>=2 && n>=2 && (k<1 || (cellno)m*n>=1024)) {
+    sizes[k][0]=m; sizes[k][1]=n; ++k;
+    m/=2; n/=2;
+  }
+  init_misses();
+  printf("Union-find on make-maze's walls, seed=%d: ns/wall and cache misses/wall\n",
+         seed);
+  printf("%13s %11s","size","walls");
+  for (v=0;v<N_variants;++v) printf(" %12s",uf_variants[v].name);
+  printf("\n");
+  while (--k>=0) bench_size(sizes[k][0],sizes[k][1]);
+}
+
+/* ***************************************************************
+ * Kruskal's method isn't the only way to make a maze, and the others
+ * make mazes that look different: long winding corridors, or lots of
+ * short dead ends, or (Wilson's and Aldous-Broder) every maze equally
+ * likely. With -algorithm <name> we use another one. They all just
+ * knock down walls in |open_walls|, so finding the ends and printing
+ * work the same whichever we use.
+ * With -generators we don't make a maze; instead we see how many cells
+ * a second each of them does, for the size asked for and a few sizes
+ * smaller, halving each time, as -unionfind does.
+ * **************************************************************** */
+
+/* ----- Neighbours ----- */
+
+/* Cell |cell| is next to the one we're looking at, through the wall
+ * that is |bit| of cell |owner|.
+ */
+typedef struct neighbour {
+  cellno cell,owner;
+  int bit;
+} neighbour;
+
+/* |neighbours(c,nb)| puts the cells next to |c| in |nb| and returns how
+ * many there are: up to 6. It's |Neighbours| without the macros.
+ */
+static int neighbours(cellno c, neighbour *nb) {
+  int i=(int)(c/n_rows),j=(int)(c%n_rows);
+  int k=0;
+#define Next(cond,delta,own,b) if (cond) \
+  { nb[k].cell=c+(delta); nb[k].owner=c+(own); nb[k].bit=(b); ++k; }
+  Neighbours(i,j,n_columns,n_rows,Next)
+#undef Next
+  return k;
+}
+
+#define Seen(c) (Open(c)&Visited)
+#define See(c) Set_open(c,Visited)
+#define Knock(nb) Set_open((nb).owner,(nb).bit)
+
+/* A random number from 0 to |n-1|, even if |n| is more than 32 bits.
+ */
+static cellno random_below(cellno n) {
+  uint64_t x;
+  if (n<=0xFFFFFFFF) return rng_below(&main_rng,(uint32_t)n);
+  x=(uint64_t)rng_next(&main_rng)<<32|rng_next(&main_rng);
+  return (cellno)(x%(uint64_t)n);
+}
+
+/* Of the cells next to |c|, pick one at random that we've been to (if
+ * |seen|) or haven't (if not), and put it in |*to|; or return 0 if
+ * there aren't any.
+ */
+static int pick_neighbour(cellno c, int seen, neighbour *to) {
+  neighbour nb[6];
+  int i,k=neighbours(c,nb),n=0;
+  for (i=0;i<k;++i) if (!Seen(nb[i].cell)==!seen) nb[n++]=nb[i];
+  if (!n) return 0;
+  *to=nb[n>1 ? rng_below(&main_rng,(uint32_t)n) : 0];
+  return 1;
+}
+
+static cellref *make_list(cellno n) {
+  cellref *l=malloc(n*sizeof(cellref));
+  if (!l) {
+    fprintf(stderr,"! I couldn't get enough memory for a list of cells.\n");
+    exit(1);
+  }
+  return l;
+}
+
+/* ----- The generators ----- */
+
+/* Kruskal's, as usual. */
+static void make_kruskal(void) {
+  init_cells((cellno)n_columns*n_rows);
+  init_walls(n_columns,n_rows);
+  shuffle_walls();
+  create_maze();
+  free(walls);
+}
+
+/* Prim's: grow the maze from one cell, each time knocking down a wall
+ * chosen at random from all the walls between it and the rest. The
+ * cells on the other side of those walls are in |list|, once for each
+ * wall, so picking from |list| is picking a wall; we join the cell to a
+ * random one of the cells it's next to in the maze. (A cell can be in
+ * |list| again after it's joined; then we just skip it.) That makes a
+ * maze with lots of short dead ends.
+ */
+static void make_prim(void) {
+  cellno n=(cellno)n_columns*n_rows;
+  cellref *list=make_list(3*n);
+  cellno len=0,k,c;
+  neighbour nb[6],to;
+  int i,m;
+  c=random_below(n);
+  for (;;) {
+    See(c);
+    m=neighbours(c,nb);
+    for (i=0;i<m;++i) if (!Seen(nb[i].cell)) list[len++]=(cellref)nb[i].cell;
+    do {
+      if (!len) goto done;
+      k=random_below(len);
+      c=list[k]; list[k]=list[--len];
+    } while (Seen(c));
+    pick_neighbour(c,1,&to);
+    Knock(to);
+  }
+done:
+  free(list);
+  clear_visited(n);
+}
+
+/* The recursive backtracker, without the recursion: go to a random
+ * cell next door that we haven't been to, until there aren't any; then
+ * back up until there are. That makes long winding corridors.
+ * The growing tree method does the same, except that when it's stuck
+ * it goes on from a random cell it has been to that isn't stuck yet,
+ * instead of the last one; we do that half the time. Taking a cell out
+ * of the middle of |list| puts the last one where it was, so "the last
+ * one" isn't always the newest after that; it doesn't matter much.
+ */
+static void grow_tree(int newest_only) {
+  cellno n=(cellno)n_columns*n_rows;
+  cellref *list=make_list(n);
+  cellno len=0,k,c;
+  neighbour to;
+  c=random_below(n);
+  See(c); list[len++]=(cellref)c;
+  while (len) {
+    k = newest_only || coin() ? len-1 : random_below(len);
+    c=list[k];
+    if (pick_neighbour(c,0,&to)) {
+      Knock(to); See(to.cell);
+      list[len++]=(cellref)to.cell;
+    }
+    else list[k]=list[--len];
+  }
+  free(list);
+  clear_visited(n);
+}
+
+static void make_backtrack(void) { grow_tree(1); }
+static void make_growing(void) { grow_tree(0); }
+
+#ifdef HEX
+/* Eller's, as for -stream, only keeping the columns. */
+static void make_eller(void) {
+  int n=n_rows;
+  int j,k;
+  unsigned char *t;
+  begin_columns();
+  for (j=0;j<n;++j) { parent[n+j]=n+j; next_bits[j]=0; }
+  stream_up(0);
+  t=this_bits; this_bits=next_bits; next_bits=t;
+  for (k=0;k<n_columns;++k) {
+    if (k<n_columns-1) {
+      stream_across(k);
+      stream_up(k==n_columns-2);
+    }
+    for (j=0;j<n;++j) Set_open((cellno)k*n+j,this_bits[j]);
+    t=this_bits; this_bits=next_bits; next_bits=t;
+  }
+  end_columns();
+}
+#endif
+
+/* Wilson's: start with one cell in the maze; then from each cell that
+ * isn't, wander about at random until we hit the maze, and add the way
+ * we came, leaving out any loops. Each cell remembers which way it last
+ * left in |dir|, which is how the loops get left out. Every maze is
+ * equally likely.
+ */
+static void make_wilson(void) {
+  cellno n=(cellno)n_columns*n_rows;
+  unsigned char *dir=malloc(n);
+  neighbour nb[6];
+  cellno c,u;
+  if (!dir) {
+    fprintf(stderr,"! I couldn't get enough memory for |dir|.\n");
+    exit(1);
+  }
+  See(random_below(n));
+  for (c=0;c<n;++c) {
+    for (u=c;!Seen(u);u=nb[dir[u]].cell)
+      dir[u]=(unsigned char)rng_below(&main_rng,(uint32_t)neighbours(u,nb));
+    for (u=c;!Seen(u);u=nb[dir[u]].cell) {
+      See(u);
+      neighbours(u,nb);
+      Knock(nb[dir[u]]);
+    }
+  }
+  free(dir);
+  clear_visited(n);
+}
+
+/* Aldous-Broder: wander about at random, and knock down the wall into
+ * each cell the first time we get there. Every maze is equally likely
+ * this way too, but it takes a long time to get everywhere: roughly
+ * n log^2 n steps for n cells.
+ */
+static void make_aldous_broder(void) {
+  cellno n=(cellno)n_columns*n_rows;
+  cellno c,left=n-1;
+  neighbour nb[6];
+  int k;
+  c=random_below(n);
+  See(c);
+  while (left) {
+    k=(int)rng_below(&main_rng,(uint32_t)neighbours(c,nb));
+    c=nb[k].cell;
+    if (!Seen(c)) { See(c); Knock(nb[k]); --left; }
+  }
+  clear_visited(n);
+}
+
+static struct {
+  char *name;
+  void (*make)(void);
+} generators[]={
+  { "kruskal", make_kruskal },
+  { "prim", make_prim },
+  { "backtrack", make_backtrack },
+  { "growing", make_growing },
+#ifdef HEX
+  { "eller", make_eller },
+#endif
+  { "wilson", make_wilson },
+  { "aldous-broder", make_aldous_broder }
+};
+#define N_generators ((int)(sizeof(generators)/sizeof(generators[0])))
+static int algorithm=0;	/* which of them */
+
+/* ----- The race ----- */
+
+/* Make sure that what |generators[g]| made is a tree: |n-1| walls
+ * knocked down, and everything reachable from cell 0.
+ */
+static void check_tree(int g) {
+  cellno n=(cellno)n_columns*n_rows;
+  cellno c,n_open=0,n_seen=0;
+  for (c=0;c<n;++c)
+    n_open+=(Open(c)&1)+(Open(c)>>1&1)+(Open(c)>>2&1);
+  visit_all(0);
+  for (c=0;c<n;++c) if (Seen(c)) ++n_seen;
+  clear_visited(n);
+  if (n_open!=n-1 || n_seen!=n) {
+    fprintf(stderr,"! Gareth screwed up (%s made %ld walls and %ld cells).\n",
+            generators[g].name,(long)n_open,(long)n_seen);
+    exit(1);
+  }
+}
+
+static void bench_generators_size(int m, int n) {
+  cellno n_cells;
+  int g,reps;
+  clock_t t,total;
+  set_size(m,n);
+  n_cells=(cellno)n_columns*n_rows;
+  queue=make_list(n_cells);
+  init_open_walls(n_cells);
+  printf("%6dx%-6d",m,n);
+  for (g=0;g<N_generators;++g) {
+    total=0; reps=0;
+    do {
+      memset(open_walls,0,(n_cells+1)>>1);
+      rng_seed(&main_rng,(uint32_t)seed); n_coins=0;
+      t=clock();
+      generators[g].make();
+      total+=clock()-t;
+      if (!reps++) check_tree(g);
+    } while (total<Min_bench_time);
+    printf(" %13.3lf",1e-6*n_cells*reps*CLOCKS_PER_SEC/(total ? total : 1));
+    fflush(stdout);
+  }
+  printf("\n");
+  free(queue); queue=0;
+  free(open_walls);
+}
+
+static void bench_generators(void) {
+  int sizes[32][2];
+  int k=0,g;
+  int m=n_columns/N_layers,n=n_rows;
+  while (k<32 && m>=2 && n>=2 && (k<1 || (cellno)m*n>=1024)) {
+    sizes[k][0]=m; sizes[k][1]=n; ++k;
+    m/=2; n/=2;
+  }
+  printf("Maze generators, seed=%d: millions of cells per second\n",seed);
+  printf("%13s","size");
+  for (g=0;g<N_generators;++g) printf(" %13s",generators[g].name);
+  printf("\n");
+  while (--k>=0) bench_generators_size(sizes[k][0],sizes[k][1]);
+}
+
 /* Now everything's trivial!
  */
 int main(int argc, char *argv[]) {
+  char *me=argv[0];
+  int union_find=0,stream=0,bench=0;
+  long columns;
+#ifdef USE_THREADS
+  n_threads=(int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  while (argc>1 && argv[1][0]=='-') {
+    if (!strcmp(argv[1],"-branchy")) branchy=1;
+    else if (!strcmp(argv[1],"-stream")) stream=1;
+    else if (!strcmp(argv[1],"-lines")) lines=1;
+    else if (!strcmp(argv[1],"-generators")) bench=1;
+    else if (!strcmp(argv[1],"-algorithm") && argc>2) {
+      for (algorithm=0;algorithm<N_generators;++algorithm)
+        if (!strcmp(argv[2],generators[algorithm].name)) break;
+      if (algorithm==N_generators) argc=1;
+      ++argv; --argc;
+    }
+    else if (!strcmp(argv[1],"-unionfind")) union_find=1;
+    else if (!strcmp(argv[1],"-threads") && argc>2) {
+      n_threads=atoi(argv[2]);
+      ++argv; --argc;
+    }
+    else if (!strcmp(argv[1],"-tiles") && argc>2) {
+      if (sscanf(argv[2],"%dx%d",&tiles_across,&tiles_down)!=2
+          || tiles_across<1 || tiles_down<1) argc=1;
+      ++argv; --argc;
+    }
+    else argc=0;
+    ++argv; --argc;
+  }
   if (argc!=3 && argc!=4) {
-    fprintf(stderr,"Usage: %s <columns> <rows> [<seed>]\n",argv[0]);
+    fprintf(stderr,
+            "Usage: %s [-branchy] [-threads <n>] [-unionfind] [-stream]"
+            " [-tiles <across>x<down>] [-lines]\n"
+            "       [-algorithm <name>] [-generators]"
+            " <columns> <rows> [<seed>]\n",me);
+    fprintf(stderr,"The algorithms are:");
+    for (algorithm=0;algorithm<N_generators;++algorithm)
+      fprintf(stderr," %s",generators[algorithm].name);
+    fprintf(stderr,".\n");
     return 0;
   }
-  n_columns=atoi(argv[1]);
+#ifdef USE_THREADS
+  if (n_threads<1) n_threads=1;
+  if (n_threads>Max_threads) n_threads=Max_threads;
+#endif
+  columns=atol(argv[1]);
   n_rows=atoi(argv[2]);
-  if (n_columns<2 || n_rows<2 || n_columns>1000 || n_rows>1000) {
-    fprintf(stderr,"Both dimensions must be in the range 2..1000.\n");
+  if (columns<2 || n_rows<2) {
+    fprintf(stderr,"Both dimensions must be at least 2.\n");
     return 1;
   }
   if (argc==4) seed=atoi(argv[3]);
+#ifndef HEX
+  if (stream || lines || tiles_across) {
+    fprintf(stderr,"-stream, -tiles and -lines only do hexagons.\n");
+    return 1;
+  }
+#endif
+
+  if (stream) {
+    s_columns=columns;
+    fprintf(stderr,"Streaming maze...          ");
+    init_time();
+    init_rand();
+    stream_maze();
+    show_time();
+    return 0;
+  }
+
+  set_size((int)columns,n_rows);
+  if ((int)columns!=columns || (cellno)columns*N_layers!=n_columns
+      || (cellno)n_columns*n_rows>Max_cells) {
+#ifdef BIG_MAZES
+    fprintf(stderr,"That's too many cells, even for me.\n");
+#else
+    fprintf(stderr,"That's too many cells; compile me with -DBIG_MAZES.\n");
+#endif
+    return 1;
+  }
+  if (tiles_across>n_columns || tiles_down>n_rows) {
+    fprintf(stderr,"There can't be more tiles than cells.\n");
+    return 1;
+  }
+
+  if (union_find) {
+    init_rand();
+    bench_union_find();
+    return 0;
+  }
+  if (bench) {
+    init_rand();
+    bench_generators();
+    return 0;
+  }
 
   fprintf(stderr,"Initialising everything... ");
   init_time();
   init_rand();
-  init_cells(n_rows*n_columns);
-  init_walls(n_columns,n_rows);
+  init_open_walls((cellno)n_rows*n_columns);
+  if (!algorithm) {
+    init_cells((cellno)n_rows*n_columns);
+    init_walls(n_columns,n_rows);
+  }
   show_time();
 
-  fprintf(stderr,"Shuffling walls...         ");
-  shuffle_walls();
-  show_time();
+  if (!algorithm) {
+    fprintf(stderr,"Shuffling walls...         ");
+    shuffle_walls();
+    show_time();
+  }
 
   fprintf(stderr,"Creating maze...           ");
-  create_maze();
-  show_time();
-
-  fprintf(stderr,"Building tree...           ");
-  build_tree(nodes);
+  if (!algorithm) create_maze();
+  else generators[algorithm].make();
   show_time();
 
-  fprintf(stderr,"Analysing tree...          ");
-  analyse_tree(nodes);
+  fprintf(stderr,"Finding ends...            ");
+  find_ends();
   show_time();
 
   fprintf(stderr,"Printing maze...           ");
-  print_maze(nodes->first-nodes,nodes->second-nodes);
+  if (tiles_across) print_tiles(first,second);
+  else print_maze(first,second);
   show_time();
 
   fprintf(stderr,"Done.\n");